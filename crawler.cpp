@@ -2,10 +2,48 @@
 #include <vector>
 #include <conio.h>
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
 #include <algorithm>
 #include <string>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <new>
+#define FD_SETSIZE 1024 // room for hundreds of spectators
+#include <winsock2.h>
 #include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "psapi.lib")
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CRAWLER_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CRAWLER_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 using namespace std;
 
@@ -24,6 +62,9 @@ const char ARMOR = 'A';
 const char TRAP = '^';
 const char GOLD = '$';
 const char STAIRS = '>';
+const char ARCHER = 'a';
+const char THROWER = 't';
+const char PROJECTILE = '*';
 
 // Colors for Windows console
 enum Color {
@@ -45,10 +86,716 @@ enum Color {
     WHITE = 15
 };
 
-// Map dimensions
+// Map dimensions of the classic mode, and the size of the on-screen view
 const int WIDTH = 50;
 const int HEIGHT = 25;
 
+class TelemetryWriter;
+class SpectatorHub;
+class SessionRecorder;
+class MetricsExport;
+
+// Where heap memory is charged, see Memory accounting
+enum MemorySubsystem : uint8_t {
+    MEM_OTHER,
+    MEM_MAP,          // tile rows
+    MEM_ENEMIES,      // monsters, living and buried
+    MEM_ITEMS,        // inventory, equipment, and loot on the floor
+    MEM_MESSAGES,     // the message log
+    MEM_LEVEL_CACHE,  // bitboards, light, overview, occupancy and other per-level caches
+    MEMORY_SUBSYSTEMS
+};
+const char* const MEMORY_SUBSYSTEM_NAMES[MEMORY_SUBSYSTEMS] = { "other", "map", "enemies", "items", "messages", "cache" };
+
+// Options chosen on the command line
+struct GameConfig {
+    int mapWidth = WIDTH;
+    int mapHeight = HEIGHT;
+    int swarm = 0;   // extra monsters per level on top of the usual mix
+    int threads = 0; // enemy-update worker threads, 0 = one per core
+    bool verifyHash = false; // recompute the state hash every turn and compare
+    bool headless = false;   // no drawing or key prompts, for bots and tools
+    int autoplay = 0;        // headless games for the search bot to play
+    int botIterations = 1500; // rollouts per bot decision
+    unsigned seed = 0;       // random seed for the game, 0 = from the clock
+    int rewind = 0;          // rewind journal entries to keep, 0 = no rewinding
+    string playerName = "player";        // who runs are recorded under
+    string leaderboard = "leaderboard";  // run log and index file name, without extension
+    TelemetryWriter* telemetry = nullptr; // shared event writer, if telemetry is on
+    SpectatorHub* spectators = nullptr;   // where frames are broadcast, if anyone may watch
+    SessionRecorder* recorder = nullptr;  // asciicast recording of the session, if on
+    int tickRate = 0;        // real-time simulation ticks per second, 0 = turn-based
+    bool sound = false;      // system sounds for hits, kills, new levels and death
+    MetricsExport* metrics = nullptr;     // live counters in shared memory, if exported
+    int hibernateAfter = 0;  // seconds idle before the level is moved to disk, 0 = never
+    int64_t memoryBudget[MEMORY_SUBSYSTEMS] = {}; // bytes per subsystem for each game, 0 = no limit
+    int startLevel = 1;      // dungeon level the game begins on
+};
+
+inline int popcount64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(v);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (int)__popcnt64(v);
+#else
+    int n = 0;
+    while (v) { v &= v - 1; n++; }
+    return n;
+#endif
+}
+
+inline int lowestBit64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (int)index;
+#else
+    int n = 0;
+    while (!(v & 1)) { v >>= 1; n++; }
+    return n;
+#endif
+}
+
+// Bitboard: one bit per tile, each row packed into 64-bit words.
+// Bit x of a row is column x, so shifting a row left moves it east.
+class Bitboard {
+public:
+    int width = 0;
+    int height = 0;
+    int words = 0; // 64-bit words per row
+    vector<uint64_t> bits;
+
+    Bitboard() {}
+    Bitboard(int w, int h) : width(w), height(h), words((w + 63) / 64), bits((size_t)words * h, 0) {}
+
+    uint64_t* row(int y) { return &bits[(size_t)y * words]; }
+    const uint64_t* row(int y) const { return &bits[(size_t)y * words]; }
+
+    // Valid-column mask for the last word of each row
+    uint64_t tailMask() const {
+        int used = width - (words - 1) * 64;
+        return used == 64 ? ~0ULL : ((1ULL << used) - 1);
+    }
+
+    bool test(int x, int y) const {
+        if (x < 0 || x >= width || y < 0 || y >= height) return false;
+        return (row(y)[x >> 6] >> (x & 63)) & 1;
+    }
+
+    void set(int x, int y) { row(y)[x >> 6] |= 1ULL << (x & 63); }
+    void reset(int x, int y) { row(y)[x >> 6] &= ~(1ULL << (x & 63)); }
+    void assign(int x, int y, bool on) { if (on) set(x, y); else reset(x, y); }
+
+    void clear() { fill(bits.begin(), bits.end(), 0ULL); }
+
+    void setAll() {
+        for (int y = 0; y < height; y++) {
+            uint64_t* r = row(y);
+            for (int w = 0; w < words; w++) r[w] = ~0ULL;
+            r[words - 1] &= tailMask();
+        }
+    }
+
+    // Set columns x0..x1 (inclusive, clipped) of row y
+    void setSpan(int y, int x0, int x1) {
+        if (y < 0 || y >= height) return;
+        x0 = max(x0, 0);
+        x1 = min(x1, width - 1);
+        if (x0 > x1) return;
+        uint64_t* r = row(y);
+        for (int w = x0 >> 6; w <= (x1 >> 6); w++) {
+            int lo = max(x0 - w * 64, 0);
+            int hi = min(x1 - w * 64, 63);
+            uint64_t mask = (hi == 63 ? ~0ULL : ((1ULL << (hi + 1)) - 1)) & ~((1ULL << lo) - 1);
+            r[w] |= mask;
+        }
+    }
+
+    // All tiles within Manhattan distance `radius` of (cx, cy)
+    static Bitboard diamond(int w, int h, int cx, int cy, int radius) {
+        Bitboard b(w, h);
+        for (int y = cy - radius; y <= cy + radius; y++) {
+            int reach = radius - abs(y - cy);
+            b.setSpan(y, cx - reach, cx + reach);
+        }
+        return b;
+    }
+
+    Bitboard& operator&=(const Bitboard& o) { combine<0>(o); return *this; }
+    Bitboard& operator|=(const Bitboard& o) { combine<1>(o); return *this; }
+    Bitboard& andNot(const Bitboard& o) { combine<2>(o); return *this; }
+
+    Bitboard operator&(const Bitboard& o) const { Bitboard r = *this; r &= o; return r; }
+    Bitboard operator|(const Bitboard& o) const { Bitboard r = *this; r |= o; return r; }
+
+    Bitboard operator~() const {
+        Bitboard r(width, height);
+        r.setAll();
+        r.andNot(*this);
+        return r;
+    }
+
+    bool operator==(const Bitboard& o) const {
+        size_t n = bits.size();
+        size_t i = 0;
+#if defined(CRAWLER_AVX2)
+        for (; i + 4 <= n; i += 4) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)&bits[i]);
+            __m256i b = _mm256_loadu_si256((const __m256i*)&o.bits[i]);
+            if (!_mm256_testz_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(-1))) return false;
+        }
+#elif defined(CRAWLER_SSE2)
+        for (; i + 2 <= n; i += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)&bits[i]);
+            __m128i b = _mm_loadu_si128((const __m128i*)&o.bits[i]);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) return false;
+        }
+#endif
+        for (; i < n; i++) {
+            if (bits[i] != o.bits[i]) return false;
+        }
+        return true;
+    }
+    bool operator!=(const Bitboard& o) const { return !(*this == o); }
+
+    int count() const {
+        int n = 0;
+        for (uint64_t w : bits) n += popcount64(w);
+        return n;
+    }
+
+    bool any() const {
+        for (uint64_t w : bits) if (w) return true;
+        return false;
+    }
+
+    bool intersects(const Bitboard& o) const {
+        for (size_t i = 0; i < bits.size(); i++) {
+            if (bits[i] & o.bits[i]) return true;
+        }
+        return false;
+    }
+
+    // Population count of (this & o) without building a temporary
+    int countAnd(const Bitboard& o) const {
+        int n = 0;
+        for (size_t i = 0; i < bits.size(); i++) n += popcount64(bits[i] & o.bits[i]);
+        return n;
+    }
+
+    // Find the n-th set tile in row-major order
+    bool nthSet(int n, int& outX, int& outY) const {
+        for (int y = 0; y < height; y++) {
+            const uint64_t* r = row(y);
+            for (int w = 0; w < words; w++) {
+                uint64_t v = r[w];
+                int c = popcount64(v);
+                if (n >= c) { n -= c; continue; }
+                while (n-- > 0) v &= v - 1;
+                outX = w * 64 + lowestBit64(v);
+                outY = y;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Union of the 4-neighbourhood (plus self) of every set tile
+    Bitboard dilate4() const {
+        Bitboard r = *this;
+        for (int y = 0; y < height; y++) {
+            shiftRowInto(r.row(y), row(y), 1);
+            shiftRowInto(r.row(y), row(y), -1);
+            if (y > 0) orRow(r.row(y), row(y - 1));
+            if (y + 1 < height) orRow(r.row(y), row(y + 1));
+        }
+        return r;
+    }
+
+    // Union of the 8-neighbourhood (plus self), done as two separable passes
+    Bitboard dilate8() const {
+        Bitboard horizontal = *this;
+        for (int y = 0; y < height; y++) {
+            shiftRowInto(horizontal.row(y), row(y), 1);
+            shiftRowInto(horizontal.row(y), row(y), -1);
+        }
+        Bitboard r = horizontal;
+        for (int y = 0; y < height; y++) {
+            if (y > 0) orRow(r.row(y), horizontal.row(y - 1));
+            if (y + 1 < height) orRow(r.row(y), horizontal.row(y + 1));
+        }
+        return r;
+    }
+
+    // Tiles whose whole 8-neighbourhood is set; off-map counts as unset
+    Bitboard erode8() const {
+        Bitboard horizontal = *this;
+        vector<uint64_t> shifted(words);
+        for (int y = 0; y < height; y++) {
+            for (int dir = -1; dir <= 1; dir += 2) {
+                fill(shifted.begin(), shifted.end(), 0ULL);
+                shiftRowInto(shifted.data(), row(y), dir);
+                for (int w = 0; w < words; w++) horizontal.row(y)[w] &= shifted[w];
+            }
+        }
+        Bitboard r(width, height);
+        for (int y = 1; y + 1 < height; y++) {
+            for (int w = 0; w < words; w++) {
+                r.row(y)[w] = horizontal.row(y - 1)[w] & horizontal.row(y)[w] & horizontal.row(y + 1)[w];
+            }
+        }
+        return r;
+    }
+
+    // Tiles in `passable` 4-connected to (x, y). Sweeps rows down then up,
+    // spreading along each row as a whole, until nothing changes.
+    static Bitboard floodFill(int x, int y, const Bitboard& passable) {
+        Bitboard reach(passable.width, passable.height);
+        if (!passable.test(x, y)) return reach;
+        reach.set(x, y);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int pass = 0; pass < 2; pass++) {
+                for (int i = 0; i < reach.height; i++) {
+                    int yy = pass == 0 ? i : reach.height - 1 - i;
+                    int from = pass == 0 ? yy - 1 : yy + 1;
+                    uint64_t* r = reach.row(yy);
+                    const uint64_t* p = passable.row(yy);
+                    if (from >= 0 && from < reach.height) {
+                        const uint64_t* f = reach.row(from);
+                        for (int w = 0; w < reach.words; w++) r[w] |= f[w] & p[w];
+                    }
+                    // Spread along the row; only carries between words need another round
+                    for (;;) {
+                        bool grew = false;
+                        for (int w = 0; w < reach.words; w++) {
+                            uint64_t seeds = r[w];
+                            if (w > 0 && (r[w - 1] >> 63)) seeds |= 1ULL;
+                            if (w + 1 < reach.words && (r[w + 1] & 1)) seeds |= 1ULL << 63;
+                            uint64_t next = spreadWord(seeds, p[w]);
+                            if (next != r[w]) { r[w] = next; grew = true; }
+                        }
+                        if (!grew) break;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return reach;
+    }
+
+private:
+    // Fill each run of `open` bits that contains a seed (Kogge-Stone, both directions)
+    static uint64_t spreadWord(uint64_t seeds, uint64_t open) {
+        uint64_t east = seeds & open, west = east;
+        uint64_t pe = open, pw = open;
+        for (int s = 1; s < 64; s <<= 1) {
+            east |= pe & (east << s);
+            pe &= pe << s;
+            west |= pw & (west >> s);
+            pw &= pw >> s;
+        }
+        return east | west;
+    }
+
+    // OP 0 = and, 1 = or, 2 = and-not; whole-board, vectorised where available
+    template <int OP>
+    void combine(const Bitboard& o) {
+        size_t n = bits.size();
+        size_t i = 0;
+        uint64_t* d = bits.data();
+        const uint64_t* s = o.bits.data();
+#if defined(CRAWLER_AVX2)
+        for (; i + 4 <= n; i += 4) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(d + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(s + i));
+            __m256i r = OP == 0 ? _mm256_and_si256(a, b) : OP == 1 ? _mm256_or_si256(a, b) : _mm256_andnot_si256(b, a);
+            _mm256_storeu_si256((__m256i*)(d + i), r);
+        }
+#elif defined(CRAWLER_SSE2)
+        for (; i + 2 <= n; i += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(d + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + i));
+            __m128i r = OP == 0 ? _mm_and_si128(a, b) : OP == 1 ? _mm_or_si128(a, b) : _mm_andnot_si128(b, a);
+            _mm_storeu_si128((__m128i*)(d + i), r);
+        }
+#endif
+        for (; i < n; i++) {
+            d[i] = OP == 0 ? (d[i] & s[i]) : OP == 1 ? (d[i] | s[i]) : (d[i] & ~s[i]);
+        }
+    }
+
+    void orRow(uint64_t* dst, const uint64_t* src) const {
+        for (int w = 0; w < words; w++) dst[w] |= src[w];
+    }
+
+    void shiftRowInto(uint64_t* dst, const uint64_t* src, int dir) const {
+        shiftRowInto(dst, src, dir, words);
+        dst[words - 1] &= tailMask();
+    }
+
+    // dst |= src shifted one column east (dir = 1) or west (dir = -1)
+    static void shiftRowInto(uint64_t* dst, const uint64_t* src, int dir, int words) {
+        if (dir > 0) {
+            for (int w = words - 1; w >= 0; w--) {
+                dst[w] |= (src[w] << 1) | (w > 0 ? src[w - 1] >> 63 : 0);
+            }
+        } else {
+            for (int w = 0; w < words; w++) {
+                dst[w] |= (src[w] >> 1) | (w + 1 < words ? src[w + 1] << 63 : 0);
+            }
+        }
+    }
+};
+
+// Line-of-sight service. Queries are collected for a turn, traced in one
+// batch against the passability bitboard, and cached until the next turn.
+class LineOfSight {
+public:
+    struct Query {
+        int x0, y0, x1, y1;
+    };
+
+    // Start a new turn; forgets all cached answers
+    void beginTurn(const Bitboard* openTiles) {
+        passable = openTiles;
+        pending.clear();
+        results.clear();
+        stamp++;
+        if (cacheKeys.empty()) {
+            cacheKeys.assign(CACHE_SIZE, 0);
+            cacheStamps.assign(CACHE_SIZE, 0);
+            cacheValues.assign(CACHE_SIZE, 0);
+        }
+    }
+
+    // Queue a query; the answer is available from result() after resolve()
+    int request(int x0, int y0, int x1, int y1) {
+        Query q = { x0, y0, x1, y1 };
+        pending.push_back(q);
+        return (int)pending.size() - 1;
+    }
+
+    void resolve() {
+        results.resize(pending.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            const Query& q = pending[i];
+            results[i] = check(q.x0, q.y0, q.x1, q.y1);
+        }
+    }
+
+    bool result(int index) const {
+        return results[index] != 0;
+    }
+
+    // Single cached query. Endpoints are put in a fixed order first so that
+    // a->b and b->a trace the same line and share a cache slot.
+    bool check(int x0, int y0, int x1, int y1) {
+        if (y1 < y0 || (y1 == y0 && x1 < x0)) {
+            swap(x0, x1);
+            swap(y0, y1);
+        }
+        uint64_t key = ((uint64_t)(uint16_t)x0 << 48) | ((uint64_t)(uint16_t)y0 << 32) |
+                       ((uint64_t)(uint16_t)x1 << 16) | (uint64_t)(uint16_t)y1;
+        size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 52) & (CACHE_SIZE - 1);
+        for (size_t probe = 0; probe < 8; probe++) {
+            size_t i = (slot + probe) & (CACHE_SIZE - 1);
+            if (cacheStamps[i] != stamp) {
+                bool visible = trace(x0, y0, x1, y1);
+                cacheKeys[i] = key;
+                cacheStamps[i] = stamp;
+                cacheValues[i] = visible;
+                return visible;
+            }
+            if (cacheKeys[i] == key) {
+                hits++;
+                return cacheValues[i] != 0;
+            }
+        }
+        return trace(x0, y0, x1, y1);
+    }
+
+    long long traces = 0;
+    long long hits = 0;
+
+private:
+    static const size_t CACHE_SIZE = 4096; // power of two
+
+    const Bitboard* passable = nullptr;
+    vector<Query> pending;
+    vector<uint8_t> results;
+    vector<uint64_t> cacheKeys;
+    vector<uint32_t> cacheStamps;
+    vector<uint8_t> cacheValues;
+    uint32_t stamp = 0;
+
+    // Bresenham walk; only the tiles strictly between the endpoints can block
+    bool trace(int x0, int y0, int x1, int y1) {
+        traces++;
+        int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+        int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+        int err = dx + dy;
+        int x = x0, y = y0;
+        while (true) {
+            if (x == x1 && y == y1) return true;
+            int e2 = 2 * err;
+            if (e2 >= dy) { err += dy; x += sx; }
+            if (e2 <= dx) { err += dx; y += sy; }
+            if ((x != x1 || y != y1) && !passable->test(x, y)) return false;
+        }
+    }
+};
+
+// Light. Every source stamps its share into a per-tile light map and keeps
+// the list of tiles it lit, so moving, dimming, or removing a source only
+// touches its own radius; nothing ever sweeps the whole map. Walls stop
+// light the same way they stop line of sight.
+const int LIGHT_VISIBLE = 48;       // light a tile needs before it can be seen
+const int TORCH_RADIUS = 6;
+const int TORCH_LIGHT = 220;
+const int SLIME_GLOW_RADIUS = 2;
+const int SLIME_GLOW = 90;
+const int ROOM_LIGHT = 140;
+const int DARK_SENSE = 3;           // goblins and trolls notice an unlit player this close
+
+class LightMap {
+public:
+    void reset(int w, int h, const Bitboard* openTiles) {
+        width = w;
+        height = h;
+        passable = openTiles;
+        level.assign((size_t)w * h, 0);
+        lights.clear();
+        freeIds.clear();
+        dirty.clear();
+    }
+
+    // Light level of a tile, 0 (dark) to 255
+    int at(int x, int y) const {
+        return min<int>(level[(size_t)y * width + x], 255);
+    }
+
+    int add(int x, int y, int radius, int intensity) {
+        int id;
+        if (freeIds.empty()) {
+            id = (int)lights.size();
+            lights.emplace_back();
+        } else {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        Light& light = lights[id];
+        light.x = x;
+        light.y = y;
+        light.radius = radius;
+        light.intensity = intensity;
+        light.alive = true;
+        markDirty(id);
+        return id;
+    }
+
+    void move(int id, int x, int y) {
+        Light& light = lights[id];
+        if (light.x == x && light.y == y) return;
+        light.x = x;
+        light.y = y;
+        markDirty(id);
+    }
+
+    void setIntensity(int id, int intensity) {
+        if (lights[id].intensity == intensity) return;
+        lights[id].intensity = intensity;
+        markDirty(id);
+    }
+
+    void remove(int id) {
+        unstamp(lights[id]);
+        lights[id].alive = false;
+        lights[id].dirty = false;
+        freeIds.push_back(id);
+    }
+
+    // A wall appeared or vanished at (x, y): relight whatever reaches it
+    void wallsChanged(int x, int y) {
+        for (size_t id = 0; id < lights.size(); id++) {
+            const Light& light = lights[id];
+            if (light.alive && max(abs(light.x - x), abs(light.y - y)) <= light.radius) markDirty((int)id);
+        }
+    }
+
+    // Let the stamped light go, keeping only the sources, until restore()
+    void release() {
+        vector<uint16_t>().swap(level);
+        for (auto& light : lights) {
+            vector<pair<int, uint16_t>>().swap(light.lit);
+            light.dirty = false;
+        }
+        dirty.clear();
+    }
+
+    // Every source is stamped again on the next refresh
+    void restore() {
+        level.assign((size_t)width * height, 0);
+        for (size_t id = 0; id < lights.size(); id++) {
+            if (lights[id].alive) markDirty((int)id);
+        }
+    }
+
+    // Restamp the sources that changed since the last refresh
+    void refresh() {
+        for (int id : dirty) {
+            Light& light = lights[id];
+            if (!light.alive || !light.dirty) continue;
+            light.dirty = false;
+            unstamp(light);
+            stamp(light);
+        }
+        dirty.clear();
+    }
+
+private:
+    struct Light {
+        int x = 0, y = 0;
+        int radius = 0;
+        int intensity = 0;
+        bool alive = false;
+        bool dirty = false;
+        vector<pair<int, uint16_t>> lit; // tile and amount added to it
+    };
+
+    int width = 0, height = 0;
+    const Bitboard* passable = nullptr;
+    vector<uint16_t> level; // summed light per tile
+    vector<Light> lights;
+    vector<int> freeIds;
+    vector<int> dirty;
+
+    void markDirty(int id) {
+        if (lights[id].dirty) return;
+        lights[id].dirty = true;
+        dirty.push_back(id);
+    }
+
+    void unstamp(Light& light) {
+        for (const auto& share : light.lit) level[share.first] -= share.second;
+        light.lit.clear();
+    }
+
+    // Light falls off to half strength at the radius, then stops
+    void stamp(Light& light) {
+        if (light.intensity <= 0) return;
+        int r = light.radius;
+        for (int y = max(0, light.y - r); y <= min(height - 1, light.y + r); y++) {
+            for (int x = max(0, light.x - r); x <= min(width - 1, light.x + r); x++) {
+                int d2 = (x - light.x) * (x - light.x) + (y - light.y) * (y - light.y);
+                if (d2 > r * r + r || !reaches(light.x, light.y, x, y)) continue;
+                int distance = (int)(sqrt((double)d2) + 0.5);
+                uint16_t amount = (uint16_t)(light.intensity * (2 * (r + 1) - distance) / (2 * (r + 1)));
+                int tile = y * width + x;
+                level[tile] += amount;
+                light.lit.push_back(make_pair(tile, amount));
+            }
+        }
+    }
+
+    // Bresenham walk as in LineOfSight: only tiles strictly between block
+    bool reaches(int x0, int y0, int x1, int y1) const {
+        int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+        int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+        int err = dx + dy;
+        int x = x0, y = y0;
+        while (true) {
+            if (x == x1 && y == y1) return true;
+            int e2 = 2 * err;
+            if (e2 >= dy) { err += dy; x += sx; }
+            if (e2 <= dx) { err += dx; y += sy; }
+            if ((x != x1 || y != y1) && !passable->test(x, y)) return false;
+        }
+    }
+};
+
+// Tile grids ------------------------------------------------------------
+// A flat copy of the map inside a one-tile WALL border, for the movement and
+// pathing kernels: a step off any map tile lands on a real cell, so no bounds
+// are checked. Kernels are templates over the grid. The classic 50x25 map
+// uses FixedSize, where the stride and cell count are compile-time constants;
+// any other size uses RuntimeSize. GameManager picks one per call in withGrid.
+
+template <int W, int H>
+struct FixedSize {
+    enum { width = W, height = H, stride = W + 2 };
+    typedef array<char, (W + 2) * (H + 2)> Cells;
+
+    void resize(Cells&, int, int) {}
+};
+
+struct RuntimeSize {
+    int width = 0, height = 0, stride = 2;
+    typedef vector<char> Cells;
+
+    void resize(Cells& cells, int w, int h) {
+        width = w;
+        height = h;
+        stride = w + 2;
+        cells.assign((size_t)(w + 2) * (h + 2), WALL);
+    }
+};
+
+typedef FixedSize<WIDTH, HEIGHT> ClassicSize;
+
+template <class Size>
+class TileGrid {
+public:
+    // Cell index of (x, y); x may be -1 or width, y -1 or height
+    int index(int x, int y) const { return (y + 1) * size.stride + x + 1; }
+    int stride() const { return size.stride; }
+    int cellCount() const { return (int)cells.size(); }
+    char at(int x, int y) const { return cells[index(x, y)]; }
+    char cell(int i) const { return cells[i]; }
+    void set(int x, int y, char tile) { cells[index(x, y)] = tile; }
+
+    void load(const vector<vector<char>>& map) {
+        size.resize(cells, (int)map[0].size(), (int)map.size());
+        fill(cells.begin(), cells.end(), WALL);
+        for (int y = 0; y < (int)map.size(); y++) {
+            memcpy(&cells[index(0, y)], map[y].data(), map[y].size());
+        }
+    }
+
+private:
+    Size size;
+    typename Size::Cells cells;
+};
+
+// Breadth-first steps over non-wall cells. `dist` holds -1 per cell except
+// 0 at the sources, which are already in `queue`. The four neighbours are
+// written out, so on a FixedSize grid each is a constant offset.
+template <class Grid>
+void walkDistances(const Grid& grid, vector<int>& queue, vector<int>& dist) {
+    const int stride = grid.stride();
+    for (size_t head = 0; head < queue.size(); head++) {
+        int from = queue[head], next = dist[from] + 1;
+        int east = from + 1, west = from - 1, south = from + stride, north = from - stride;
+        if (dist[east] < 0 && grid.cell(east) != WALL) { dist[east] = next; queue.push_back(east); }
+        if (dist[west] < 0 && grid.cell(west) != WALL) { dist[west] = next; queue.push_back(west); }
+        if (dist[south] < 0 && grid.cell(south) != WALL) { dist[south] = next; queue.push_back(south); }
+        if (dist[north] < 0 && grid.cell(north) != WALL) { dist[north] = next; queue.push_back(north); }
+    }
+}
+
+// Status effects driven by the timer wheel
+enum StatusEffect {
+    STATUS_NONE = -1,
+    STATUS_POISON,
+    STATUS_BURNING,
+    STATUS_HASTE,
+    STATUS_REGENERATION,
+    STATUS_COUNT
+};
+
 // Item and weapon classes
 class Item {
 public:
@@ -58,6 +805,8 @@ public:
     Item(string n, string desc) : name(n), description(desc) {}
     virtual ~Item() {}
     virtual void use(class Player& player) = 0;
+    // Lasting effect started when the item is used, if any
+    virtual StatusEffect statusEffect() const { return STATUS_NONE; }
 };
 
 class HealthPotion : public Item {
@@ -69,6 +818,22 @@ public:
     void use(class Player& player) override;
 };
 
+class HastePotion : public Item {
+public:
+    HastePotion() : Item("Haste Potion", "You act twice as fast for a while") {}
+    
+    void use(class Player& player) override {}
+    StatusEffect statusEffect() const override { return STATUS_HASTE; }
+};
+
+class RegenerationPotion : public Item {
+public:
+    RegenerationPotion() : Item("Regeneration Potion", "Heals a little every turn for a while") {}
+    
+    void use(class Player& player) override {}
+    StatusEffect statusEffect() const override { return STATUS_REGENERATION; }
+};
+
 class Weapon {
 public:
     string name;
@@ -94,17 +859,23 @@ public:
     int maxHealth = 100;
     int attack = 10;
     int defense = 0;
+    int mana = 30;
+    int maxMana = 30;
     int gold = 0;
     int score = 0;
     int level = 1;
     int experience = 0;
     int experienceToLevel = 100;
     bool hasKey = false;
+    bool torchLit = true;
     Weapon* equippedWeapon = nullptr;
     Armor* equippedArmor = nullptr;
     vector<Item*> inventory;
     int inventorySize = 10;
     int dungeonLevel = 1;
+    int facingX = 1; // direction of the last move, used for throwing
+    int facingY = 0;
+    int statusCount[STATUS_COUNT] = {}; // active instances of each status effect
 
     Player(int startX, int startY) : x(startX), y(startY) {
         equippedWeapon = new Weapon("Dagger", 5, 50);
@@ -118,14 +889,13 @@ public:
         }
     }
 
-    void move(int dx, int dy, const vector<vector<char>>& map) {
-        int newX = x + dx;
-        int newY = y + dy;
-        if (newX >= 0 && newX < WIDTH && newY >= 0 && newY < HEIGHT) {
-            if (map[newY][newX] != WALL) {
-                x = newX;
-                y = newY;
-            }
+    template <class Grid>
+    void move(int dx, int dy, const Grid& grid) {
+        facingX = dx;
+        facingY = dy;
+        if (grid.at(x + dx, y + dy) != WALL) {
+            x += dx;
+            y += dy;
         }
     }
     
@@ -139,7 +909,7 @@ public:
     
     void gainExperience(int exp) {
         experience += exp;
-        if (experience >= experienceToLevel) {
+        while (experience >= experienceToLevel) {
             levelUp();
         }
     }
@@ -150,6 +920,8 @@ public:
         experienceToLevel = level * 100;
         maxHealth += 10;
         health = maxHealth;
+        maxMana += 5;
+        mana = maxMana;
         attack += 2;
         defense += 1;
     }
@@ -184,9 +956,71 @@ void HealthPotion::use(Player& player) {
     player.health = min(player.maxHealth, player.health + healAmount);
 }
 
+// Random numbers for enemy decisions, derived from the level seed, turn,
+// and enemy id, so a decision does not depend on which thread made it
+struct IntentRng {
+    uint64_t state;
+    
+    IntentRng(uint64_t seed, uint32_t turn, int id)
+        : state(seed ^ ((uint64_t)turn << 32) ^ ((uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ULL)) {}
+    
+    uint64_t next() {
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    
+    int below(int n) { return (int)(next() % (uint64_t)n); }
+};
+
+// The game's own random numbers. Each GameManager has one, so games on
+// different threads never share state; next() is used like rand().
+class GameRng {
+public:
+    explicit GameRng(uint64_t seed = 1) : state(seed) {}
+    
+    void reseed(uint64_t seed) { state = seed; }
+    
+    int next() {
+        // splitmix64, top 31 bits
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return (int)((z ^ (z >> 31)) >> 33);
+    }
+    
+private:
+    uint64_t state;
+};
+
+// Candidate steps for one enemy, most preferred first
+struct MoveIntent {
+    int count = 0;
+    int xs[3], ys[3];
+    bool waitsOnCooldown = false;
+    
+    // (nx, ny) is at most one step from a map tile, so the grid's border covers it
+    template <class Grid>
+    void consider(int nx, int ny, int fromX, int fromY, const Grid& grid) {
+        if (nx == fromX && ny == fromY) return;
+        if (grid.at(nx, ny) == WALL) return;
+        for (int i = 0; i < count; i++) {
+            if (xs[i] == nx && ys[i] == ny) return;
+        }
+        xs[count] = nx;
+        ys[count] = ny;
+        count++;
+    }
+};
+
 // Enemy base class
 class Enemy {
 public:
+    int id = -1; // index into GameManager::enemyById for this level
+    uint8_t tier = 0; // SimTier, how much simulation this enemy gets
+    uint64_t hashKey = 0; // this enemy's current share of the state hash
     int x, y;
     int health;
     int maxHealth;
@@ -198,6 +1032,18 @@ public:
     string name;
     bool hasAttacked = false;
     int moveCooldown = 0;
+    int range = 0;         // ranged attack reach in tiles, 0 for melee only
+    int reloadTime = 0;    // turns between ranged attacks
+    int reload = 0;
+    bool holdsDistance = false; // stays put while it has a shot
+    bool erratic = false;       // half its steps are random, even when chasing
+    bool regenerates = false;   // heals a little every few turns
+    bool regenPaused = false;   // regeneration timer dropped while dormant
+    bool journalDirty = false;  // changed since its last rewind journal entry
+    int journalPos = 0;         // tile index and health as last journaled
+    int journalHealth = 0;
+    int overviewBlock = -1;     // summary block it is counted in, -1 if none
+    int light = -1;             // its LightMap source if it glows, -1 if not
 
     Enemy(int startX, int startY, int hp, int atk, int def, int exp, int gold, char sym, string n) 
         : x(startX), y(startY), health(hp), maxHealth(hp), attack(atk), defense(def), 
@@ -205,9 +1051,19 @@ public:
           
     virtual ~Enemy() {}
 
-    virtual void move(int playerX, int playerY, const vector<vector<char>>& map) {
+    // Decide where to step this turn without changing anything; the
+    // GameManager commits the move later, once collisions are resolved
+    template <class Grid>
+    void planMove(int playerX, int playerY, const Grid& grid, IntentRng& rng, MoveIntent& intent) const {
+        // Erratic movers (slimes) step at random half the time, cooldown or not
+        if (erratic && rng.below(2) == 0) {
+            int dx = rng.below(3) - 1;
+            int dy = rng.below(3) - 1;
+            intent.consider(x + dx, y + dy, x, y, grid);
+            return;
+        }
         if (moveCooldown > 0) {
-            moveCooldown--;
+            intent.waitsOnCooldown = true;
             return;
         }
         
@@ -221,42 +1077,44 @@ public:
         if (y < playerY) dy = 1;
         else if (y > playerY) dy = -1;
         
-        // Try to move
-        int newX = x + dx;
-        int newY = y + dy;
-        
-        // Check if the move is valid
-        if (newX >= 0 && newX < WIDTH && newY >= 0 && newY < HEIGHT && map[newY][newX] != WALL) {
-            // Check for collision with other enemies (would need game manager access)
-            x = newX;
-            y = newY;
-        } else {
-            // Try moving in just one direction if diagonal movement is blocked
-            newX = x + dx;
-            newY = y;
-            if (newX >= 0 && newX < WIDTH && map[newY][newX] != WALL) {
-                x = newX;
-            } else {
-                newX = x;
-                newY = y + dy;
-                if (newY >= 0 && newY < HEIGHT && map[newY][newX] != WALL) {
-                    y = newY;
-                }
-            }
+        // Preferred step first, then just one direction if the diagonal is blocked
+        intent.consider(x + dx, y + dy, x, y, grid);
+        intent.consider(x + dx, y, x, y, grid);
+        intent.consider(x, y + dy, x, y, grid);
+    }
+    
+    // Aimless step for a monster that has not noticed the player
+    template <class Grid>
+    void planWander(const Grid& grid, IntentRng& rng, MoveIntent& intent) const {
+        if (moveCooldown > 0) {
+            intent.waitsOnCooldown = true;
+            return;
         }
+        int dx = rng.below(3) - 1;
+        int dy = rng.below(3) - 1;
+        intent.consider(x + dx, y + dy, x, y, grid);
     }
     
-    virtual int attackPlayer(Player& player) {
+    virtual int attackPlayer(Player& player, GameRng& rng) {
         int damage = max(1, attack - player.getTotalDefense() / 2);
         player.health -= damage;
         hasAttacked = true;
         return damage;
     }
     
+    virtual int rangedAttack(Player& player, GameRng& rng) {
+        reload = reloadTime;
+        return attackPlayer(player, rng);
+    }
+    
     virtual void takeDamage(int damage) {
         health -= max(1, damage - defense / 2);
     }
     
+    bool inRange(int playerX, int playerY) const {
+        return range > 0 && max(abs(x - playerX), abs(y - playerY)) <= range;
+    }
+    
     bool isAdjacent(int playerX, int playerY) const {
         return abs(x - playerX) <= 1 && abs(y - playerY) <= 1;
     }
@@ -267,22 +1125,7 @@ class Slime : public Enemy {
 public:
     Slime(int x, int y) : Enemy(x, y, 15, 5, 1, 10, 2, SLIME, "Slime") {
         moveCooldown = 2; // Slimes move slower
-    }
-    
-    void move(int playerX, int playerY, const vector<vector<char>>& map) override {
-        // Slimes move randomly 50% of the time
-        if (rand() % 2 == 0) {
-            int dx = rand() % 3 - 1;
-            int dy = rand() % 3 - 1;
-            int newX = x + dx;
-            int newY = y + dy;
-            if (newX >= 0 && newX < WIDTH && newY >= 0 && newY < HEIGHT && map[newY][newX] != WALL) {
-                x = newX;
-                y = newY;
-            }
-        } else {
-            Enemy::move(playerX, playerY, map);
-        }
+        erratic = true;
     }
 };
 
@@ -290,15 +1133,15 @@ class Goblin : public Enemy {
 public:
     Goblin(int x, int y) : Enemy(x, y, 25, 8, 2, 20, 5, GOBLIN, "Goblin") {}
     
-    int attackPlayer(Player& player) override {
+    int attackPlayer(Player& player, GameRng& rng) override {
         // Goblins sometimes do critical hits
-        if (rand() % 5 == 0) {
+        if (rng.next() % 5 == 0) {
             int damage = max(1, attack * 2 - player.getTotalDefense() / 2);
             player.health -= damage;
             hasAttacked = true;
             return damage;
         }
-        return Enemy::attackPlayer(player);
+        return Enemy::attackPlayer(player, rng);
     }
 };
 
@@ -306,939 +1149,6278 @@ class Troll : public Enemy {
 public:
     Troll(int x, int y) : Enemy(x, y, 60, 15, 5, 50, 15, TROLL, "Troll") {
         moveCooldown = 1; // Trolls move a bit slower
+        regenerates = true;
     }
     
-    void takeDamage(int damage) override {
-        Enemy::takeDamage(damage);
-        // Trolls regenerate health
-        if (rand() % 4 == 0) {
-            health = min(maxHealth, health + 2);
-        }
-    }
+    // Trolls regenerate health on a timer, see GameManager::addEnemy
 };
 
-// Game Manager
-class GameManager {
-private:
-    vector<vector<char>> map;
-    Player player;
-    vector<Enemy*> enemies;
-    bool gameOver;
-    vector<string> messages;
-    int maxMessages = 5;
-    int turns = 0;
-    HANDLE consoleHandle;
-
+class GoblinArcher : public Enemy {
 public:
-    GameManager() : player(1, 1), gameOver(false) {
-        consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-        srand(time(0)); // Initialize random seed
-        initializeMap(1); // Start with level 1
-    }
-    
-    ~GameManager() {
-        for (auto enemy : enemies) {
-            delete enemy;
-        }
+    GoblinArcher(int x, int y) : Enemy(x, y, 18, 6, 1, 25, 6, ARCHER, "Goblin Archer") {
+        range = 6;
+        reloadTime = 1;
+        holdsDistance = true; // Archers keep shooting rather than closing in
     }
+};
 
-    void initializeMap(int dungeonLevel) {
+class BoulderTroll : public Troll {
+public:
+    BoulderTroll(int x, int y) : Troll(x, y) {
+        symbol = THROWER;
+        name = "Boulder Troll";
+        range = 4;
+        reloadTime = 3; // Boulders take a while to pick up
+    }
+};
+
+// Hierarchical timer wheel, one tick per turn. Near events sit in a
+// 256-slot wheel, later ones in a 64-slot wheel of 256-turn buckets, and
+// anything further out in an overflow list. Scheduling and firing are O(1)
+// per event; outer buckets are cascaded inwards as time reaches them.
+enum TimerKind {
+    TIMER_PLAYER_REGEN,  // natural health regeneration
+    TIMER_MANA_REGEN,
+    TIMER_STATUS_TICK,   // one tick of a status effect on the player or an enemy
+    TIMER_STATUS_END,
+    TIMER_TRAP_REARM,
+    TIMER_ENEMY_REGEN
+};
+
+struct TimerEvent {
+    uint32_t due = 0;
+    uint8_t kind = 0;
+    uint8_t status = 0;    // StatusEffect for status timers
+    uint32_t epoch = 0;    // level the event belongs to, 0 if it outlives levels
+    int target = -1;       // enemy id, -1 for the player, tile index for traps
+    int amount = 0;
+    int period = 0;        // reschedule this many turns later if > 0
+    int remaining = -1;    // repeats left, -1 for forever
+    int next = -1;         // intrusive list link inside the wheel
+};
+
+class TimerWheel {
+public:
+    TimerWheel() {
+        clear();
+    }
+
+    void clear() {
+        pool.clear();
+        freeList = -1;
+        for (int& head : inner) head = -1;
+        for (int& head : outer) head = -1;
+        overflow = -1;
+        pendingCount = 0;
+    }
+
+    uint32_t now() const { return current; }
+    int pending() const { return pendingCount; }
+
+    void schedule(uint32_t delay, TimerEvent event) {
+        event.due = current + max(delay, 1u);
+        int index;
+        if (freeList >= 0) {
+            index = freeList;
+            freeList = pool[index].next;
+            pool[index] = event;
+        } else {
+            index = (int)pool.size();
+            pool.push_back(event);
+        }
+        pendingCount++;
+        link(index);
+    }
+
+    // Advance one turn and append every event now due to `fired`
+    void advance(vector<TimerEvent>& fired) {
+        current++;
+        if ((current & (INNER_SLOTS * OUTER_SLOTS - 1)) == 0) {
+            relink(overflow);
+        }
+        if ((current & (INNER_SLOTS - 1)) == 0) {
+            relink(outer[(current / INNER_SLOTS) & (OUTER_SLOTS - 1)]);
+        }
+        int& head = inner[current & (INNER_SLOTS - 1)];
+        int index = head;
+        head = -1;
+        while (index >= 0) {
+            int next = pool[index].next;
+            fired.push_back(pool[index]);
+            pool[index].next = freeList;
+            freeList = index;
+            pendingCount--;
+            index = next;
+        }
+    }
+
+    // Visit every pending event (for saving state)
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (int head : inner) walk(head, fn);
+        for (int head : outer) walk(head, fn);
+        walk(overflow, fn);
+    }
+
+private:
+    static const uint32_t INNER_SLOTS = 256;
+    static const uint32_t OUTER_SLOTS = 64;
+
+    vector<TimerEvent> pool;
+    int freeList = -1;
+    int inner[INNER_SLOTS];
+    int outer[OUTER_SLOTS];
+    int overflow = -1;
+    uint32_t current = 0;
+    int pendingCount = 0;
+
+    void link(int index) {
+        uint32_t delta = pool[index].due - current;
+        int* head;
+        if (delta < INNER_SLOTS) {
+            head = &inner[pool[index].due & (INNER_SLOTS - 1)];
+        } else if (delta < INNER_SLOTS * OUTER_SLOTS) {
+            head = &outer[(pool[index].due / INNER_SLOTS) & (OUTER_SLOTS - 1)];
+        } else {
+            head = &overflow;
+        }
+        pool[index].next = *head;
+        *head = index;
+    }
+
+    // Re-file a whole bucket now that time has moved closer to it
+    void relink(int& head) {
+        int index = head;
+        head = -1;
+        while (index >= 0) {
+            int next = pool[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    template <typename Fn>
+    void walk(int index, Fn& fn) const {
+        for (; index >= 0; index = pool[index].next) fn(pool[index]);
+    }
+};
+
+// A thrown knife in flight
+struct Projectile {
+    int x, y;
+    int dx, dy;
+    int range;
+    int damage;
+};
+
+const int PROJECTILE_SPEED = 2; // tiles per turn
+
+// Area-of-effect spells
+enum SpellType {
+    FIREBALL,
+    SHOCKWAVE,
+    POISON_CLOUD,
+    SPELL_COUNT
+};
+
+struct SpellInfo {
+    const char* name;
+    int manaCost;
+    int baseDamage;  // added to half the player's attack
+    int radius;      // Chebyshev radius of the blast
+    int reach;       // how far ahead the blast is centred, 0 for on the player
+    StatusEffect lingering; // left on survivors
+    int lingerDamage;
+    int lingerTurns;
+};
+
+const SpellInfo SPELLS[SPELL_COUNT] = {
+    { "Fireball",     10, 12, 1, 8, STATUS_BURNING, 2, 3 },
+    { "Shockwave",     8,  6, 2, 0, STATUS_NONE,    0, 0 },
+    { "Poison Cloud", 12,  4, 3, 4, STATUS_POISON,  2, 5 },
+};
+
+// Structure-of-arrays scratch space for resolving one hit against many
+// enemies. Buffers keep their capacity between casts, so a blast does not
+// allocate per target.
+struct DamageBatch {
+    vector<int32_t> xs, ys, health, defense, hit;
+
+    void gather(const vector<Enemy*>& enemies) {
+        size_t n = enemies.size();
+        xs.resize(n);
+        ys.resize(n);
+        health.resize(n);
+        defense.resize(n);
+        hit.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            xs[i] = enemies[i]->x;
+            ys[i] = enemies[i]->y;
+            health[i] = enemies[i]->health;
+            defense[i] = enemies[i]->defense;
+        }
+    }
+
+    // Flags enemies standing on a set tile of `area`; returns how many
+    int mark(const Bitboard& area) {
+        int count = 0;
+        for (size_t i = 0; i < xs.size(); i++) {
+            hit[i] = area.test(xs[i], ys[i]) ? 1 : 0;
+            count += hit[i];
+        }
+        return count;
+    }
+
+    // Same rule as Enemy::takeDamage, branch-free so it vectorises
+    void apply(int32_t damage) {
+        size_t n = health.size();
+        int32_t* hp = health.data();
+        const int32_t* def = defense.data();
+        const int32_t* h = hit.data();
+        for (size_t i = 0; i < n; i++) {
+            int32_t d = damage - def[i] / 2;
+            d = d < 1 ? 1 : d;
+            hp[i] -= d & -h[i];
+        }
+    }
+};
+
+// Fixed set of worker threads for data-parallel loops. The calling thread
+// works too, so a pool of one runs everything inline.
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads) {
+        if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
+        for (int i = 1; i < threads; i++) {
+            workers.push_back(thread(&WorkerPool::workerLoop, this, i));
+        }
+    }
+    
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+    
+    int size() const { return (int)workers.size() + 1; }
+    
+    // Split [0, count) into one contiguous chunk per thread and run
+    // task(begin, end) on each; returns when all chunks are done
+    void parallelFor(size_t count, const function<void(size_t, size_t)>& task) {
+        size_t chunks = size();
+        if (chunks == 1 || count < chunks) {
+            task(0, count);
+            return;
+        }
+        function<void(int)> job = [&](int index) {
+            size_t begin = count * index / chunks;
+            size_t end = count * (index + 1) / chunks;
+            task(begin, end);
+        };
+        {
+            lock_guard<mutex> lock(m);
+            current = &job;
+            remaining = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        job(0);
+        unique_lock<mutex> lock(m);
+        finished.wait(lock, [this] { return remaining == 0; });
+        current = nullptr;
+    }
+    
+private:
+    vector<thread> workers;
+    mutex m;
+    condition_variable wake;
+    condition_variable finished;
+    const function<void(int)>* current = nullptr;
+    uint64_t generation = 0;
+    int remaining = 0;
+    bool stopping = false;
+    
+    void workerLoop(int index) {
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(m);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            const function<void(int)>* job = current;
+            lock.unlock();
+            (*job)(index);
+            lock.lock();
+            if (--remaining == 0) finished.notify_one();
+        }
+    }
+};
+
+// What an enemy will do this turn
+enum EnemyAction {
+    ACTION_NONE,   // next to the player, just attacks
+    ACTION_MOVE,
+    ACTION_SHOOT,
+    ACTION_HOLD    // ranged enemy waiting to reload with the player in sight
+};
+
+struct EnemyPlan {
+    uint8_t action = ACTION_NONE;
+    MoveIntent intent;
+};
+
+// Level-of-detail tiers. Active enemies near the player run the full AI
+// every turn; distant ones take a few coarse steps along a flow field every
+// DISTANT_INTERVAL turns; dormant ones cost nothing until something wakes
+// them. Only used on maps larger than the classic size.
+enum SimTier {
+    TIER_ACTIVE,
+    TIER_DISTANT,
+    TIER_DORMANT
+};
+
+const int ACTIVE_RADIUS = 24;     // Chebyshev distance for full AI
+const int DORMANT_RADIUS = 64;    // beyond this enemies fall asleep
+const int DISTANT_INTERVAL = 4;   // distant enemies move every this many turns
+const int LOD_BLOCK = 16;         // side of a dormant-enemy bucket
+const int FLOW_RADIUS = DORMANT_RADIUS + 16;
+
+// Map overview ('M'): the level drawn at 1/4 or 1/8 scale from per-block
+// summaries. A summary is recomputed from its 16 tiles only after a tile
+// or loot change in it marks it dirty, and only when it is next drawn;
+// enemy counts are kept up to date as enemies move, in rehashEnemy. So
+// drawing the overview costs about as much as the normal view at any
+// map size.
+const int OVERVIEW_BLOCK = 4;     // tiles per side of a summary block
+const int EXPLORE_RADIUS = 8;     // how far around the player counts as explored
+
+enum OverviewFeature {
+    FEATURE_STAIRS = 1,
+    FEATURE_DOOR = 2,
+    FEATURE_KEY = 4,
+    FEATURE_TRAP = 8
+};
+
+struct BlockSummary {
+    uint8_t tiles = 0;    // tiles of the block inside the map
+    uint8_t walls = 0;
+    uint8_t loot = 0;     // tiles with loot lying on them
+    uint8_t features = 0; // OverviewFeature bits
+    uint16_t enemies = 0;
+    bool explored = false;
+    bool dirty = true;    // tiles or loot changed since the last recompute
+};
+
+// Zobrist hashing of game state. Instead of large random tables, each key
+// is a splitmix64 mix of (field, a, b), so any map size gets independent
+// keys without extra memory. Parts of the state are XORed in and out as
+// they change.
+enum HashField {
+    HASH_TILE,
+    HASH_PLAYER_POS,
+    HASH_PLAYER_STAT,
+    HASH_ENEMY_POS,
+    HASH_ENEMY_HEALTH,
+    HASH_ITEM
+};
+
+inline uint64_t zobristKey(uint64_t field, uint64_t a, uint64_t b) {
+    uint64_t z = field * 0x9E3779B97F4A7C15ULL ^ a * 0xC2B2AE3D27D4EB4FULL ^ b * 0x165667B19E3779F9ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Loot lying on the floor. Each item is generated with its stats when it
+// is placed or dropped, and packs into 32 bits for the hash and journal.
+enum LootKind : uint8_t {
+    LOOT_KEY,
+    LOOT_POTION,   // variant: 0 health, 1 haste, 2 regeneration
+    LOOT_GOLD,
+    LOOT_WEAPON,   // variant: type * 4 + quality
+    LOOT_ARMOR     // variant: type * 4 + quality
+};
+
+struct FloorItem {
+    uint8_t kind = LOOT_GOLD;
+    uint8_t variant = 0;
+    uint16_t amount = 0;     // gold, healing, damage, or defense
+    uint16_t durability = 0; // weapons only
+
+    uint32_t pack() const {
+        return (uint32_t)kind << 29 | (uint32_t)(variant & 31) << 24 |
+               (uint32_t)(amount & 4095) << 12 | (durability & 4095);
+    }
+
+    static FloorItem unpack(uint32_t bits) {
+        FloorItem item;
+        item.kind = (uint8_t)(bits >> 29);
+        item.variant = (uint8_t)(bits >> 24 & 31);
+        item.amount = (uint16_t)(bits >> 12 & 4095);
+        item.durability = (uint16_t)(bits & 4095);
+        return item;
+    }
+};
+
+const char* const WEAPON_TYPES[5] = { "Sword", "Axe", "Mace", "Spear", "Dagger" };
+const int WEAPON_DAMAGE[5] = { 8, 10, 12, 9, 6 };
+const int WEAPON_DURABILITY[5] = { 50, 40, 35, 45, 60 };
+const int WEAPON_WEAR[5] = { 5, 4, 3, 4, 6 }; // extra durability per dungeon level
+const char* const WEAPON_QUALITY[4] = { "Rusty", "Normal", "Sharp", "Masterwork" };
+const char* const ARMOR_TYPES[4] = { "Leather Armor", "Chain Mail", "Plate Armor", "Scale Mail" };
+const int ARMOR_DEFENSE[4] = { 3, 5, 7, 4 };
+const char* const ARMOR_QUALITY[4] = { "Tattered", "Standard", "Reinforced", "Mastercraft" };
+
+inline char lootSymbol(const FloorItem& item) {
+    static const char symbols[] = { KEY, HEALTH, GOLD, WEAPON, ARMOR };
+    return symbols[item.kind];
+}
+
+inline string lootName(const FloorItem& item) {
+    switch (item.kind) {
+        case LOOT_KEY: return "key";
+        case LOOT_POTION:
+            return item.variant == 1 ? "Haste Potion" : item.variant == 2 ? "Regeneration Potion" : "Health Potion";
+        case LOOT_GOLD: return to_string(item.amount) + " gold";
+        case LOOT_WEAPON:
+            return string(WEAPON_QUALITY[item.variant % 4]) + " " + WEAPON_TYPES[item.variant / 4];
+        default:
+            return string(ARMOR_QUALITY[item.variant % 4]) + " " + ARMOR_TYPES[item.variant / 4];
+    }
+}
+
+// Sparse item layer. Piles are singly linked lists threaded through a
+// pooled arena, and an open-addressing table maps a tile to the head of
+// its pile, so memory follows the number of items rather than the map area.
+class FloorItems {
+public:
+    FloorItems() : keys(16, -1), heads(16, -1) {}
+
+    size_t size() const { return live; }
+
+    // First node of the pile on `tile`, -1 if the floor is bare
+    int head(int tile) const {
+        size_t slot = find(tile);
+        return keys[slot] == tile ? heads[slot] : -1;
+    }
+
+    int next(int node) const { return pool[node].next; }
+    const FloorItem& item(int node) const { return pool[node].item; }
+
+    void push(int tile, const FloorItem& item) {
+        int node = freeNode;
+        if (node >= 0) {
+            freeNode = pool[node].next;
+        } else {
+            node = (int)pool.size();
+            pool.push_back(Node());
+        }
+        pool[node].item = item;
+        pool[node].next = head(tile);
+        setHead(tile, node);
+        live++;
+    }
+
+    // Unlink `node` from the pile on `tile` and return what it held
+    FloorItem remove(int tile, int node) {
+        int first = head(tile);
+        if (first == node) {
+            setHead(tile, pool[node].next);
+        } else {
+            int prev = first;
+            while (pool[prev].next != node) prev = pool[prev].next;
+            pool[prev].next = pool[node].next;
+        }
+        FloorItem item = pool[node].item;
+        pool[node].next = freeNode;
+        freeNode = node;
+        live--;
+        return item;
+    }
+
+    void clear() {
+        pool.clear();
+        freeNode = -1;
+        live = 0;
+        piles = 0;
+        keys.assign(16, -1);
+        heads.assign(16, -1);
+    }
+
+    // Calls visit(tile, item) for every item on the floor
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (size_t slot = 0; slot < keys.size(); slot++) {
+            if (keys[slot] < 0) continue;
+            for (int node = heads[slot]; node >= 0; node = pool[node].next) {
+                visit(keys[slot], pool[node].item);
+            }
+        }
+    }
+
+private:
+    struct Node {
+        FloorItem item;
+        int next = -1;
+    };
+    vector<Node> pool;
+    int freeNode = -1;
+    size_t live = 0;
+    vector<int> keys;  // tile per slot, -1 if empty
+    vector<int> heads; // pile head per slot
+    size_t piles = 0;
+
+    static size_t home(int tile, size_t mask) {
+        uint32_t h = (uint32_t)tile * 2654435761u;
+        return (h ^ h >> 16) & mask;
+    }
+
+    size_t find(int tile) const {
+        size_t mask = keys.size() - 1;
+        size_t slot = home(tile, mask);
+        while (keys[slot] >= 0 && keys[slot] != tile) slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    void setHead(int tile, int node) {
+        size_t slot = find(tile);
+        if (node >= 0) {
+            if (keys[slot] != tile) {
+                keys[slot] = tile;
+                if (++piles * 2 > keys.size()) {
+                    heads[slot] = node;
+                    grow();
+                    return;
+                }
+            }
+            heads[slot] = node;
+            return;
+        }
+        if (keys[slot] != tile) return;
+        
+        // Backward-shift delete keeps every probe run unbroken
+        size_t mask = keys.size() - 1;
+        size_t hole = slot;
+        for (size_t i = (hole + 1) & mask; keys[i] >= 0; i = (i + 1) & mask) {
+            if (((i - home(keys[i], mask)) & mask) >= ((i - hole) & mask)) {
+                keys[hole] = keys[i];
+                heads[hole] = heads[i];
+                hole = i;
+            }
+        }
+        keys[hole] = -1;
+        heads[hole] = -1;
+        piles--;
+    }
+
+    void grow() {
+        vector<int> oldKeys(keys.size() * 2, -1), oldHeads(heads.size() * 2, -1);
+        oldKeys.swap(keys);
+        oldHeads.swap(heads);
+        for (size_t i = 0; i < oldKeys.size(); i++) {
+            if (oldKeys[i] < 0) continue;
+            size_t slot = find(oldKeys[i]);
+            keys[slot] = oldKeys[i];
+            heads[slot] = oldHeads[i];
+        }
+    }
+};
+
+// Leaderboard ----------------------------------------------------------
+// Finished runs are appended to <base>.log as fixed-size records and never
+// rewritten. <base>.idx holds a compacted index over the log: entries by
+// score, plus orderings by depth and by player, so queries are binary
+// searches. Runs logged since the last compaction sit in a small tail that
+// queries scan; once it grows past LEADERBOARD_TAIL the index is rebuilt.
+
+enum EnemyKind {
+    KIND_SLIME,
+    KIND_GOBLIN,
+    KIND_TROLL,
+    KIND_ARCHER,
+    KIND_THROWER,
+    ENEMY_KINDS
+};
+
+const char ENEMY_SYMBOLS[ENEMY_KINDS] = { SLIME, GOBLIN, TROLL, ARCHER, THROWER };
+const char* const ENEMY_KIND_NAMES[ENEMY_KINDS] = { "Slimes", "Goblins", "Trolls", "Goblin Archers", "Boulder Trolls" };
+const char* const ENEMY_NAMES[ENEMY_KINDS] = { "Slime", "Goblin", "Troll", "Goblin Archer", "Boulder Troll" };
+const char* const ENEMY_RANGED_VERBS[ENEMY_KINDS] = { "shoots", "shoots", "shoots", "shoots", "hurls a boulder at" };
+
+inline int enemyKind(char symbol) {
+    for (int i = 0; i < ENEMY_KINDS; i++) {
+        if (ENEMY_SYMBOLS[i] == symbol) return i;
+    }
+    return KIND_SLIME;
+}
+
+// Seed mining -----------------------------------------------------------
+// --mine-seeds generates the first levels of a range of seeds on every core
+// and writes one small record of features per level; --find-seeds scans that
+// file for levels matching terms such as "stairs<40" or "trolls>=2". A hit
+// (seed S, level L) is replayed with --seed S --level L.
+
+const uint32_t SEED_INDEX_MAGIC = 0x58444E53; // "SNDX"
+const int MINED_LEVELS = 5;
+const uint16_t UNREACHABLE = 0xFFFF;
+
+enum LevelFlag : uint8_t {
+    LEVEL_KEY_BEHIND_DOOR = 1,    // the key can't be reached without passing the door
+    LEVEL_STAIRS_BEHIND_DOOR = 2
+};
+
+struct LevelFeatures {
+    uint32_t seed;
+    uint8_t level;
+    uint8_t flags;         // LevelFlag bits
+    uint16_t stairsSteps;  // shortest walk from the start, UNREACHABLE if none
+    uint16_t keySteps;
+    uint16_t doorSteps;
+    uint16_t gold;         // total on the floor
+    uint8_t enemies[ENEMY_KINDS];
+    uint8_t potions, weapons, armor, litRooms;
+    uint8_t pad;
+};
+static_assert(sizeof(LevelFeatures) == 24, "seed index records are 24 bytes");
+
+struct SeedIndexHeader {
+    uint32_t magic;
+    int32_t mapWidth, mapHeight, swarm;
+    uint32_t firstSeed, seeds;
+    uint32_t levelStart[MINED_LEVELS + 1]; // first record of each level, sorted by seed within it
+};
+
+// Numeric fields a --find-seeds term can compare
+struct FeatureField {
+    const char* name;
+    int (*get)(const LevelFeatures&);
+};
+
+const FeatureField FEATURE_FIELDS[] = {
+    { "level", [](const LevelFeatures& f) { return (int)f.level; } },
+    { "stairs", [](const LevelFeatures& f) { return (int)f.stairsSteps; } },
+    { "key", [](const LevelFeatures& f) { return (int)f.keySteps; } },
+    { "door", [](const LevelFeatures& f) { return (int)f.doorSteps; } },
+    { "slimes", [](const LevelFeatures& f) { return (int)f.enemies[KIND_SLIME]; } },
+    { "goblins", [](const LevelFeatures& f) { return (int)f.enemies[KIND_GOBLIN]; } },
+    { "trolls", [](const LevelFeatures& f) { return (int)f.enemies[KIND_TROLL]; } },
+    { "archers", [](const LevelFeatures& f) { return (int)f.enemies[KIND_ARCHER]; } },
+    { "throwers", [](const LevelFeatures& f) { return (int)f.enemies[KIND_THROWER]; } },
+    { "enemies", [](const LevelFeatures& f) {
+        int n = 0;
+        for (int i = 0; i < ENEMY_KINDS; i++) n += f.enemies[i];
+        return n;
+    } },
+    { "potions", [](const LevelFeatures& f) { return (int)f.potions; } },
+    { "weapons", [](const LevelFeatures& f) { return (int)f.weapons; } },
+    { "armor", [](const LevelFeatures& f) { return (int)f.armor; } },
+    { "gold", [](const LevelFeatures& f) { return (int)f.gold; } },
+    { "lit", [](const LevelFeatures& f) { return (int)f.litRooms; } },
+};
+
+enum TermOp { OP_LESS, OP_LESS_EQUAL, OP_GREATER, OP_GREATER_EQUAL, OP_EQUAL, OP_NOT_EQUAL };
+
+// One parsed term: a field compared with a value, or a LevelFlag that must be set
+struct SeedTerm {
+    const FeatureField* field = nullptr;
+    TermOp op = OP_EQUAL;
+    int value = 0;
+    uint8_t flag = 0;
+
+    bool matches(const LevelFeatures& f) const {
+        if (!field) return (f.flags & flag) != 0;
+        int v = field->get(f);
+        switch (op) {
+            case OP_LESS: return v < value;
+            case OP_LESS_EQUAL: return v <= value;
+            case OP_GREATER: return v > value;
+            case OP_GREATER_EQUAL: return v >= value;
+            case OP_EQUAL: return v == value;
+            default: return v != value;
+        }
+    }
+};
+
+// "trolls>=2", "stairs<40", "key-behind-door"; false if the term isn't understood
+inline bool parseSeedTerm(const string& text, SeedTerm& term) {
+    if (text == "key-behind-door") { term.flag = LEVEL_KEY_BEHIND_DOOR; return true; }
+    if (text == "stairs-behind-door") { term.flag = LEVEL_STAIRS_BEHIND_DOOR; return true; }
+    size_t at = text.find_first_of("<>=!");
+    if (at == string::npos || at == 0) return false;
+    string name = text.substr(0, at), op = text.substr(at, text.find_first_not_of("<>=!", at) - at);
+    static const char* const OPS[] = { "<", "<=", ">", ">=", "=", "!=" };
+    int opIndex = -1;
+    for (int i = 0; i < 6; i++) {
+        if (op == OPS[i]) opIndex = i;
+    }
+    if (op == "==") opIndex = OP_EQUAL;
+    const char* digits = text.c_str() + at + op.size();
+    char* end;
+    long value = strtol(digits, &end, 10);
+    if (opIndex < 0 || end == digits || *end) return false;
+    for (const FeatureField& field : FEATURE_FIELDS) {
+        if (name == field.name) {
+            term.field = &field;
+            term.op = (TermOp)opIndex;
+            term.value = (int)value;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct RunRecord {
+    char player[16];        // NUL-padded name
+    int64_t time;           // when the run ended, seconds since the epoch
+    int32_t score;
+    int32_t gold;
+    int32_t depth;          // dungeon level reached
+    int32_t level;          // character level
+    int32_t turns;
+    uint16_t kills[ENEMY_KINDS];
+    uint8_t died;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(RunRecord) == 56, "run log records are read and written as raw bytes");
+
+const size_t LEADERBOARD_TAIL = 1024;
+
+class Leaderboard {
+public:
+    explicit Leaderboard(const string& base) : logPath(base + ".log"), indexPath(base + ".idx") {
+        loadIndex();
+        loadTail();
+        if (tail.size() >= LEADERBOARD_TAIL) compact();
+    }
+
+    static uint32_t playerHash(const string& name) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (size_t i = 0; i < name.size() && i < sizeof(RunRecord().player); i++) {
+            h = (h ^ (uint8_t)name[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    size_t size() const { return entries.size() + tail.size(); }
+
+    // Logs a finished run and returns its rank among all runs, 1 = best
+    size_t append(const RunRecord& run) {
+        FILE* log = fopen(logPath.c_str(), "ab");
+        if (!log) return 0;
+        fwrite(&run, sizeof(run), 1, log);
+        fclose(log);
+        
+        Entry entry = makeEntry(run, recordCount++);
+        tail.push_back(entry);
+        size_t rank = 1;
+        for (const Entry& other : tail) rank += better(other, entry);
+        rank += lower_bound(entries.begin(), entries.end(), entry, better) - entries.begin();
+        if (tail.size() >= LEADERBOARD_TAIL) compact();
+        return rank;
+    }
+
+    vector<RunRecord> top(size_t n) const {
+        return collect(0, (uint32_t)entries.size(), nullptr, n, [](const Entry&) { return true; },
+                       [](const RunRecord&) { return true; });
+    }
+
+    vector<RunRecord> topAtDepth(int depth, size_t n) const {
+        auto range = equal_range(byDepth.begin(), byDepth.end(), depth, DepthOrder{ &entries });
+        return collect((uint32_t)(range.first - byDepth.begin()), (uint32_t)(range.second - byDepth.begin()),
+                       &byDepth, n, [depth](const Entry& e) { return e.depth == depth; },
+                       [](const RunRecord&) { return true; });
+    }
+
+    // Hashes can collide, so other players' runs are skipped by name
+    // before the best n are taken
+    vector<RunRecord> topForPlayer(const string& name, size_t n) const {
+        uint32_t hash = playerHash(name);
+        string wanted = name.substr(0, sizeof(RunRecord().player));
+        auto range = equal_range(byPlayer.begin(), byPlayer.end(), PlayerKey{ hash }, PlayerOrder{ &entries });
+        return collect((uint32_t)(range.first - byPlayer.begin()), (uint32_t)(range.second - byPlayer.begin()),
+                       &byPlayer, n, [hash](const Entry& e) { return e.player == hash; },
+                       [&wanted](const RunRecord& run) { return string(run.player, strnlen(run.player, sizeof(run.player))) == wanted; });
+    }
+
+    // Merge the tail into the index and rewrite the index file
+    void compact() {
+        sort(tail.begin(), tail.end(), better);
+        vector<Entry> merged(entries.size() + tail.size());
+        merge(entries.begin(), entries.end(), tail.begin(), tail.end(), merged.begin(), better);
+        entries.swap(merged);
+        tail.clear();
+        buildOrderings();
+        indexedRecords = recordCount;
+        
+        string temp = indexPath + ".tmp";
+        FILE* file = fopen(temp.c_str(), "wb");
+        if (!file) return;
+        IndexHeader header = { INDEX_MAGIC, indexedRecords, (uint32_t)entries.size() };
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        if (!entries.empty()) {
+            ok = ok && fwrite(entries.data(), sizeof(Entry), entries.size(), file) == entries.size();
+            ok = ok && fwrite(byDepth.data(), sizeof(uint32_t), byDepth.size(), file) == byDepth.size();
+            ok = ok && fwrite(byPlayer.data(), sizeof(uint32_t), byPlayer.size(), file) == byPlayer.size();
+        }
+        ok = fclose(file) == 0 && ok;
+        if (ok) {
+            MoveFileExA(temp.c_str(), indexPath.c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+    }
+
+private:
+    struct Entry {
+        int32_t score;
+        int32_t depth;
+        uint32_t player;
+        uint32_t record; // position in the log
+    };
+
+    struct IndexHeader {
+        uint32_t magic;
+        uint32_t records; // log records covered by the index
+        uint32_t entries;
+    };
+
+    static const uint32_t INDEX_MAGIC = 0x42444C43; // "CLDB"
+
+    // Index positions of entries, compared by depth or by player hash
+    struct DepthOrder {
+        const vector<Entry>* entries;
+        bool operator()(uint32_t a, int depth) const { return (*entries)[a].depth < depth; }
+        bool operator()(int depth, uint32_t a) const { return depth < (*entries)[a].depth; }
+    };
+
+    struct PlayerKey {
+        uint32_t hash;
+    };
+
+    struct PlayerOrder {
+        const vector<Entry>* entries;
+        bool operator()(uint32_t a, PlayerKey key) const { return (*entries)[a].player < key.hash; }
+        bool operator()(PlayerKey key, uint32_t a) const { return key.hash < (*entries)[a].player; }
+    };
+
+    string logPath;
+    string indexPath;
+    vector<Entry> entries;    // best score first
+    vector<uint32_t> byDepth;  // by depth, then as in entries
+    vector<uint32_t> byPlayer; // by player hash, then as in entries
+    vector<Entry> tail;       // logged since the index was built
+    uint32_t indexedRecords = 0;
+    uint32_t recordCount = 0;
+
+    static bool better(const Entry& a, const Entry& b) {
+        return a.score != b.score ? a.score > b.score : a.record < b.record;
+    }
+
+    static Entry makeEntry(const RunRecord& run, uint32_t record) {
+        Entry entry;
+        entry.score = run.score;
+        entry.depth = run.depth;
+        entry.player = playerHash(string(run.player, strnlen(run.player, sizeof(run.player))));
+        entry.record = record;
+        return entry;
+    }
+
+    // Index positions are already in score order, so a stable sort by the
+    // secondary key leaves each group best first
+    void buildOrderings() {
+        byDepth.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) byDepth[i] = (uint32_t)i;
+        byPlayer = byDepth;
+        stable_sort(byDepth.begin(), byDepth.end(), [this](uint32_t a, uint32_t b) {
+            return entries[a].depth < entries[b].depth;
+        });
+        stable_sort(byPlayer.begin(), byPlayer.end(), [this](uint32_t a, uint32_t b) {
+            return entries[a].player < entries[b].player;
+        });
+    }
+
+    void loadIndex() {
+        FILE* file = fopen(indexPath.c_str(), "rb");
+        if (!file) return;
+        IndexHeader header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == INDEX_MAGIC;
+        if (ok) {
+            entries.resize(header.entries);
+            byDepth.resize(header.entries);
+            byPlayer.resize(header.entries);
+            if (header.entries > 0) {
+                ok = fread(entries.data(), sizeof(Entry), entries.size(), file) == entries.size() &&
+                     fread(byDepth.data(), sizeof(uint32_t), byDepth.size(), file) == byDepth.size() &&
+                     fread(byPlayer.data(), sizeof(uint32_t), byPlayer.size(), file) == byPlayer.size();
+            }
+        }
+        fclose(file);
+        if (ok) {
+            indexedRecords = header.records;
+        } else {
+            entries.clear(); // unreadable index: rebuild it from the log
+            byDepth.clear();
+            byPlayer.clear();
+        }
+    }
+
+    // Read the runs logged after the index was last written
+    void loadTail() {
+        FILE* log = fopen(logPath.c_str(), "rb");
+        if (!log) {
+            entries.clear();
+            byDepth.clear();
+            byPlayer.clear();
+            indexedRecords = 0;
+            return;
+        }
+        _fseeki64(log, 0, SEEK_END);
+        int64_t bytes = _ftelli64(log);
+        recordCount = (uint32_t)(bytes / (int64_t)sizeof(RunRecord));
+        if (bytes % (int64_t)sizeof(RunRecord) != 0) {
+            // A run torn by a crash; cut it off so later appends line up
+            fclose(log);
+            FILE* writable = fopen(logPath.c_str(), "r+b");
+            if (writable) {
+                _chsize_s(_fileno(writable), (int64_t)recordCount * (int64_t)sizeof(RunRecord));
+                fclose(writable);
+            }
+            log = fopen(logPath.c_str(), "rb");
+            if (!log) return;
+        }
+        if (indexedRecords > recordCount) {
+            entries.clear(); // index is ahead of the log, start over
+            byDepth.clear();
+            byPlayer.clear();
+            indexedRecords = 0;
+        }
+        _fseeki64(log, (int64_t)indexedRecords * (int64_t)sizeof(RunRecord), SEEK_SET);
+        RunRecord run;
+        for (uint32_t i = indexedRecords; i < recordCount && fread(&run, sizeof(run), 1, log) == 1; i++) {
+            tail.push_back(makeEntry(run, i));
+        }
+        fclose(log);
+    }
+
+    // Best `n` runs whose entries match `match` and whose records pass
+    // `keep`, from index positions [first, last) (through `order` if given)
+    // merged with the tail. Records are read best first until n are kept.
+    template <typename Match, typename Keep>
+    vector<RunRecord> collect(uint32_t first, uint32_t last, const vector<uint32_t>* order,
+                              size_t n, Match match, Keep keep) const {
+        vector<Entry> recent;
+        for (const Entry& entry : tail) {
+            if (match(entry)) recent.push_back(entry);
+        }
+        sort(recent.begin(), recent.end(), better);
+        
+        vector<RunRecord> runs;
+        FILE* log = fopen(logPath.c_str(), "rb");
+        if (!log) return runs;
+        uint32_t i = first;
+        size_t r = 0;
+        while (runs.size() < n && (i < last || r < recent.size())) {
+            const Entry* entry = i < last ? &entries[order ? (*order)[i] : i] : nullptr;
+            if (entry && (r == recent.size() || better(*entry, recent[r]))) {
+                i++;
+            } else {
+                entry = &recent[r++];
+            }
+            RunRecord run;
+            _fseeki64(log, (int64_t)entry->record * (int64_t)sizeof(RunRecord), SEEK_SET);
+            if (fread(&run, sizeof(run), 1, log) == 1 && keep(run)) runs.push_back(run);
+        }
+        fclose(log);
+        return runs;
+    }
+};
+
+inline void printRuns(const vector<RunRecord>& runs, ostream& out = cout) {
+    if (runs.empty()) {
+        out << "No runs recorded yet." << endl;
+        return;
+    }
+    out << " #  Player           Score  Depth  Level  Turns  Kills  Date" << endl;
+    for (size_t i = 0; i < runs.size(); i++) {
+        const RunRecord& run = runs[i];
+        int kills = 0;
+        for (int k = 0; k < ENEMY_KINDS; k++) kills += run.kills[k];
+        char date[16] = "";
+        time_t when = (time_t)run.time;
+        tm* local = localtime(&when);
+        if (local) strftime(date, sizeof(date), "%Y-%m-%d", local);
+        char line[128];
+        snprintf(line, sizeof(line), "%2d  %-16.16s %6d  %5d  %5d  %5d  %5d  %s%s",
+                 (int)i + 1, run.player, run.score, run.depth, run.level, run.turns, kills, date,
+                 run.died ? "" : " (quit)");
+        out << line << endl;
+    }
+}
+
+// Telemetry ------------------------------------------------------------
+// Gameplay events are pushed into a lock-free ring per game session; a
+// background thread drains the rings and writes them out as compressed
+// columnar blocks, so the game loop never waits on the disk. When a ring
+// is full the event is dropped and counted rather than blocking.
+//
+// File layout: a sequence of self-describing blocks, each holding the
+// events of one session:
+//   uint32 magic "CTEL", uint32 session, uint32 event count,
+//   uint32 byte length of each of the TELEMETRY_COLUMNS columns,
+//   then the columns back to back. type and subject are raw bytes; turn,
+//   depth, x, and y are zigzag varint deltas from the previous event;
+//   value is a zigzag varint.
+// A reader can skip straight to the columns it needs using the lengths.
+
+enum TelemetryType : uint8_t {
+    TEL_PLAYER_HIT,   // subject: enemy kind, value: damage dealt
+    TEL_ENEMY_HIT,    // subject: enemy kind, value: damage taken
+    TEL_SPELL,        // subject: spell, value: enemies hit
+    TEL_KILL,         // subject: enemy kind, value: experience
+    TEL_PICKUP,       // subject: loot kind, value: amount
+    TEL_TRAP,         // subject: 0 spikes, 1 poison, 2 alarm; value: damage
+    TEL_LEVEL,        // value: the new dungeon level
+    TEL_DEATH,        // value: final score
+    TEL_DOOR,         // subject: 0 unlocked, 1 locked; value: score gained
+    TEL_MISS,         // a melee swing that hit nothing
+    TELEMETRY_TYPES
+};
+
+const char* const TELEMETRY_NAMES[TELEMETRY_TYPES] = {
+    "player hits", "enemy hits", "spells", "kills", "pickups", "traps", "level changes", "deaths", "doors", "misses"
+};
+
+struct TelemetryEvent {
+    uint32_t turn;
+    uint8_t type;
+    uint8_t subject;
+    uint16_t depth;
+    int16_t x, y;
+    int32_t value;
+};
+
+const int TELEMETRY_COLUMNS = 7;
+const uint32_t TELEMETRY_MAGIC = 0x4C455443; // "CTEL"
+const size_t TELEMETRY_BLOCK = 1 << 16;     // events per block, at most
+
+// Single-producer single-consumer ring: the game thread pushes, the
+// writer thread pops
+class TelemetryRing {
+public:
+    const uint32_t session;
+    atomic<bool> closed{ false };
+    atomic<uint64_t> dropped{ 0 };
+
+    TelemetryRing(uint32_t id, size_t capacity) : session(id), slots(capacity), mask(capacity - 1) {}
+
+    bool push(const TelemetryEvent& event) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - tail.load(memory_order_acquire) == slots.size()) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        slots[h & mask] = event;
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    size_t pop(vector<TelemetryEvent>& out, size_t limit) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t n = min(head.load(memory_order_acquire) - t, limit);
+        for (size_t i = 0; i < n; i++) {
+            out.push_back(slots[(t + i) & mask]);
+        }
+        tail.store(t + n, memory_order_release);
+        return n;
+    }
+
+private:
+    vector<TelemetryEvent> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{ 0 };
+    alignas(64) atomic<size_t> tail{ 0 };
+};
+
+class TelemetryWriter {
+public:
+    explicit TelemetryWriter(const string& path) {
+        file = fopen(path.c_str(), "ab");
+        if (file) worker = thread(&TelemetryWriter::run, this);
+    }
+
+    ~TelemetryWriter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+        if (file) fclose(file);
+    }
+
+    bool ok() const { return file != nullptr; }
+
+    // Registers a new session; only this takes the lock, pushing never does
+    shared_ptr<TelemetryRing> openSession() {
+        lock_guard<mutex> guard(lock);
+        auto ring = make_shared<TelemetryRing>(nextSession++, 1 << 14);
+        added.push_back(ring);
+        return ring;
+    }
+
+private:
+    struct Session {
+        shared_ptr<TelemetryRing> ring;
+        vector<TelemetryEvent> events;
+    };
+
+    FILE* file = nullptr;
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    uint32_t nextSession = 0;
+    vector<shared_ptr<TelemetryRing>> added; // sessions the worker has not picked up yet
+    vector<Session> sessions;                 // worker thread only
+    vector<uint8_t> columns[TELEMETRY_COLUMNS];
+    bool unflushed = false;
+
+    void run() {
+        bool done = false;
+        while (!done) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait_for(guard, chrono::milliseconds(20), [this] { return stopping; });
+                done = stopping;
+                for (auto& ring : added) {
+                    sessions.push_back(Session{ ring, vector<TelemetryEvent>() });
+                }
+                added.clear();
+            }
+            
+            size_t kept = 0;
+            for (size_t i = 0; i < sessions.size(); i++) {
+                Session& session = sessions[i];
+                bool closed = session.ring->closed.load(memory_order_acquire);
+                while (session.ring->pop(session.events, TELEMETRY_BLOCK - session.events.size()) > 0) {
+                    if (session.events.size() == TELEMETRY_BLOCK) writeBlock(session);
+                }
+                if (closed || done) {
+                    writeBlock(session);
+                    continue;
+                }
+                if (kept != i) sessions[kept] = move(session);
+                kept++;
+            }
+            sessions.resize(kept);
+            if (unflushed) {
+                fflush(file);
+                unflushed = false;
+            }
+        }
+    }
+
+    static void putVarint(vector<uint8_t>& out, int64_t value) {
+        uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+        while (zigzag >= 0x80) {
+            out.push_back((uint8_t)(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back((uint8_t)zigzag);
+    }
+
+    void writeBlock(Session& session) {
+        if (session.events.empty()) return;
+        for (auto& column : columns) column.clear();
+        TelemetryEvent last = {};
+        for (const TelemetryEvent& event : session.events) {
+            putVarint(columns[0], (int64_t)event.turn - last.turn);
+            columns[1].push_back(event.type);
+            columns[2].push_back(event.subject);
+            putVarint(columns[3], (int64_t)event.depth - last.depth);
+            putVarint(columns[4], (int64_t)event.x - last.x);
+            putVarint(columns[5], (int64_t)event.y - last.y);
+            putVarint(columns[6], event.value);
+            last = event;
+        }
+        uint32_t header[3 + TELEMETRY_COLUMNS] = { TELEMETRY_MAGIC, session.ring->session, (uint32_t)session.events.size() };
+        for (int c = 0; c < TELEMETRY_COLUMNS; c++) {
+            header[3 + c] = (uint32_t)columns[c].size();
+        }
+        fwrite(header, sizeof(header), 1, file);
+        for (auto& column : columns) {
+            fwrite(column.data(), 1, column.size(), file);
+        }
+        session.events.clear();
+        unflushed = true;
+    }
+};
+
+// Event counts by type from a telemetry file, reading only the type column
+inline int summarizeTelemetry(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        cout << "Can't open " << path << endl;
+        return 1;
+    }
+    uint64_t counts[TELEMETRY_TYPES] = {};
+    uint64_t total = 0, blocks = 0;
+    set<uint32_t> sessions;
+    uint32_t header[3 + TELEMETRY_COLUMNS];
+    vector<uint8_t> types;
+    while (fread(header, sizeof(header), 1, file) == 1 && header[0] == TELEMETRY_MAGIC) {
+        long skipped = (long)header[3];
+        fseek(file, skipped, SEEK_CUR);
+        types.resize(header[4]);
+        if (fread(types.data(), 1, types.size(), file) != types.size()) break;
+        for (uint8_t type : types) {
+            if (type < TELEMETRY_TYPES) counts[type]++;
+        }
+        long rest = 0;
+        for (int c = 2; c < TELEMETRY_COLUMNS; c++) rest += (long)header[3 + c];
+        fseek(file, rest, SEEK_CUR);
+        total += header[2];
+        blocks++;
+        sessions.insert(header[1]);
+    }
+    fclose(file);
+    cout << total << " events in " << blocks << " blocks from " << sessions.size() << " sessions" << endl;
+    for (int i = 0; i < TELEMETRY_TYPES; i++) {
+        cout << "  " << TELEMETRY_NAMES[i] << ": " << counts[i] << endl;
+    }
+    return 0;
+}
+
+// Memory accounting -----------------------------------------------------
+// With --memory-budget, --export-metrics or --autoplay every heap block
+// carries a small header with its size and the subsystem that asked for
+// it, taken from the calling thread's MemoryScope; other runs allocate
+// plain blocks. main decides once it has read the options; blocks made
+// before then get a header and are remembered, so they are still freed
+// correctly if it turns accounting off. Each thread counts into its own
+// counters, one cache line per subsystem, and a report adds them up, so
+// threads allocating side by side never touch a shared line. Peaks are
+// kept by whoever adds them up: the end of every turn and reports. A game
+// also keeps its own tally, which its budgets are checked against.
+
+struct alignas(64) MemoryCounters {
+    atomic<int64_t> bytes{ 0 };   // live, headers included; one thread's share goes negative if it frees others' blocks
+    atomic<int64_t> blocks{ 0 };  // live
+    atomic<uint64_t> allocations{ 0 }; // ever made
+};
+
+// Only the owning thread writes its counters, so a relaxed load and store
+// will do where a shared counter would need a locked read-modify-write
+template <typename T>
+inline void bumpCounter(atomic<T>& counter, T amount) {
+    counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// A thread's counters, linked into the list that reports walk while it runs
+struct ThreadMemory {
+    MemoryCounters usage[MEMORY_SUBSYSTEMS];
+    ThreadMemory* previous = nullptr;
+    ThreadMemory* next = nullptr;
+
+    ThreadMemory();
+    ~ThreadMemory();
+};
+
+atomic_flag memoryThreadsLock = ATOMIC_FLAG_INIT; // guards the three below; never held while allocating
+ThreadMemory* memoryThreads = nullptr;
+MemoryCounters retiredMemory[MEMORY_SUBSYSTEMS]; // threads that have exited
+int64_t memoryPeak[MEMORY_SUBSYSTEMS] = {};       // most bytes live at a sample
+
+class MemoryThreadsGuard {
+public:
+    MemoryThreadsGuard() {
+        while (memoryThreadsLock.test_and_set(memory_order_acquire)) this_thread::yield();
+    }
+    ~MemoryThreadsGuard() { memoryThreadsLock.clear(memory_order_release); }
+};
+
+ThreadMemory::ThreadMemory() {
+    MemoryThreadsGuard guard;
+    next = memoryThreads;
+    if (next) next->previous = this;
+    memoryThreads = this;
+}
+
+thread_local bool threadMemoryGone = false; // its counters are destroyed; charge retiredMemory
+thread_local ThreadMemory threadMemory;
+
+ThreadMemory::~ThreadMemory() {
+    threadMemoryGone = true;
+    MemoryThreadsGuard guard;
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+        retiredMemory[s].bytes.fetch_add(usage[s].bytes.load(memory_order_relaxed), memory_order_relaxed);
+        retiredMemory[s].blocks.fetch_add(usage[s].blocks.load(memory_order_relaxed), memory_order_relaxed);
+        retiredMemory[s].allocations.fetch_add(usage[s].allocations.load(memory_order_relaxed), memory_order_relaxed);
+    }
+    if (previous) previous->next = next;
+    else memoryThreads = next;
+    if (next) next->previous = previous;
+}
+
+thread_local uint8_t memorySubsystem = MEM_OTHER;
+
+// Charges the calling thread's allocations to a subsystem until it ends
+class MemoryScope {
+public:
+    explicit MemoryScope(MemorySubsystem subsystem) : previous(memorySubsystem) {
+        memorySubsystem = subsystem;
+    }
+    ~MemoryScope() { memorySubsystem = previous; }
+
+    void switchTo(MemorySubsystem subsystem) { memorySubsystem = subsystem; }
+
+private:
+    uint8_t previous;
+};
+
+// Live bytes a game has allocated, by subsystem. Only the thread running
+// the game writes or reads it.
+struct GameMemory {
+    int64_t bytes[MEMORY_SUBSYSTEMS] = {};
+};
+
+thread_local GameMemory* gameMemory = nullptr;
+
+// Charges the calling thread's allocations to a game as well until it ends
+class GameMemoryScope {
+public:
+    explicit GameMemoryScope(GameMemory* memory) : previous(gameMemory) { gameMemory = memory; }
+    ~GameMemoryScope() { gameMemory = previous; }
+
+private:
+    GameMemory* previous;
+};
+
+enum MemoryMode : uint8_t { MEMORY_UNDECIDED, MEMORY_PLAIN, MEMORY_ACCOUNTED };
+atomic<uint8_t> memoryMode{ MEMORY_UNDECIDED };
+
+// Headered blocks made while undecided and still live: an open-addressing
+// set that is only added to before the decision, so a plain-mode free
+// looks it up without a lock
+const size_t EARLY_SLOTS = 4096;
+const uintptr_t EARLY_REMOVED = 1;
+atomic<uintptr_t> earlyBlocks[EARLY_SLOTS];
+atomic<int> earlyLive{ 0 };
+
+inline size_t earlySlot(uintptr_t pointer) {
+    return (size_t)((pointer >> 4) * 0x9E3779B97F4A7C15ULL >> 52) & (EARLY_SLOTS - 1);
+}
+
+inline bool rememberEarly(uintptr_t pointer) {
+    for (size_t i = 0, slot = earlySlot(pointer); i < EARLY_SLOTS; i++, slot = (slot + 1) & (EARLY_SLOTS - 1)) {
+        uintptr_t empty = 0;
+        if (earlyBlocks[slot].compare_exchange_strong(empty, pointer, memory_order_relaxed)) {
+            earlyLive.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool forgetEarly(uintptr_t pointer) {
+    for (size_t i = 0, slot = earlySlot(pointer); i < EARLY_SLOTS; i++, slot = (slot + 1) & (EARLY_SLOTS - 1)) {
+        uintptr_t held = earlyBlocks[slot].load(memory_order_relaxed);
+        if (held == 0) return false;
+        if (held == pointer) {
+            earlyBlocks[slot].store(EARLY_REMOVED, memory_order_relaxed);
+            earlyLive.fetch_sub(1, memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called by main once the options are read, before any game starts
+inline void setMemoryAccounting(bool on) {
+    uint8_t undecided = MEMORY_UNDECIDED;
+    memoryMode.compare_exchange_strong(undecided, on ? MEMORY_ACCOUNTED : MEMORY_PLAIN);
+}
+
+inline bool memoryAccounting() {
+    return memoryMode.load(memory_order_relaxed) == MEMORY_ACCOUNTED;
+}
+
+inline void chargeMemory(uint8_t subsystem, int64_t bytes, int64_t blocks) {
+    if (gameMemory) gameMemory->bytes[subsystem] += bytes;
+    if (threadMemoryGone) {
+        retiredMemory[subsystem].bytes.fetch_add(bytes, memory_order_relaxed);
+        retiredMemory[subsystem].blocks.fetch_add(blocks, memory_order_relaxed);
+        if (blocks > 0) retiredMemory[subsystem].allocations.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    MemoryCounters& usage = threadMemory.usage[subsystem];
+    bumpCounter(usage.bytes, bytes);
+    bumpCounter(usage.blocks, blocks);
+    if (blocks > 0) bumpCounter(usage.allocations, (uint64_t)1);
+}
+
+struct MemoryTotals {
+    int64_t bytes[MEMORY_SUBSYSTEMS] = {};
+    int64_t peak[MEMORY_SUBSYSTEMS] = {};
+    int64_t blocks[MEMORY_SUBSYSTEMS] = {};
+    uint64_t allocations[MEMORY_SUBSYSTEMS] = {};
+};
+
+// Adds up every thread's counters and raises the peaks to match
+inline MemoryTotals memoryTotals() {
+    MemoryTotals totals;
+    MemoryThreadsGuard guard;
+    auto add = [&totals](const MemoryCounters* usage) {
+        for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+            totals.bytes[s] += usage[s].bytes.load(memory_order_relaxed);
+            totals.blocks[s] += usage[s].blocks.load(memory_order_relaxed);
+            totals.allocations[s] += usage[s].allocations.load(memory_order_relaxed);
+        }
+    };
+    add(retiredMemory);
+    for (const ThreadMemory* thread = memoryThreads; thread; thread = thread->next) add(thread->usage);
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+        memoryPeak[s] = max(memoryPeak[s], totals.bytes[s]);
+        totals.peak[s] = memoryPeak[s];
+    }
+    return totals;
+}
+
+// Heap allocations made by the whole process
+inline uint64_t heapAllocations() {
+    MemoryTotals totals = memoryTotals();
+    uint64_t allocations = 0;
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) allocations += totals.allocations[s];
+    return allocations;
+}
+
+const size_t MEMORY_HEADER = 16; // keeps the block after it 16-byte aligned
+
+// Kept out of line: once GCC inlines them it warns that free() is
+// paired with operator new
+#if defined(__GNUC__) || defined(__clang__)
+#define CRAWLER_NOINLINE __attribute__((noinline))
+#else
+#define CRAWLER_NOINLINE
+#endif
+
+CRAWLER_NOINLINE void* operator new(size_t size) {
+    uint8_t mode = memoryMode.load(memory_order_relaxed);
+    if (mode == MEMORY_PLAIN) {
+        void* block = malloc(size ? size : 1);
+        if (!block) throw bad_alloc();
+        return block;
+    }
+    uint8_t* block = (uint8_t*)malloc(size + MEMORY_HEADER);
+    if (!block) throw bad_alloc();
+    if (mode == MEMORY_UNDECIDED && !rememberEarly((uintptr_t)(block + MEMORY_HEADER))) {
+        // No room to remember it: account for everything rather than lose track
+        uint8_t undecided = MEMORY_UNDECIDED;
+        if (!memoryMode.compare_exchange_strong(undecided, MEMORY_ACCOUNTED) && undecided == MEMORY_PLAIN) {
+            free(block);
+            return operator new(size);
+        }
+    }
+    uint8_t subsystem = memorySubsystem;
+    memcpy(block, &size, sizeof(size));
+    block[sizeof(size)] = subsystem;
+    chargeMemory(subsystem, (int64_t)(size + MEMORY_HEADER), 1);
+    return block + MEMORY_HEADER;
+}
+
+CRAWLER_NOINLINE void operator delete(void* pointer) noexcept {
+    if (!pointer) return;
+    uint8_t mode = memoryMode.load(memory_order_relaxed);
+    if (mode != MEMORY_ACCOUNTED && earlyLive.load(memory_order_relaxed) > 0) {
+        bool early = forgetEarly((uintptr_t)pointer);
+        if (mode == MEMORY_PLAIN && !early) {
+            free(pointer);
+            return;
+        }
+    } else if (mode == MEMORY_PLAIN) {
+        free(pointer);
+        return;
+    }
+    uint8_t* block = (uint8_t*)pointer - MEMORY_HEADER;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    chargeMemory(block[sizeof(size)], -(int64_t)(size + MEMORY_HEADER), -1);
+    free(block);
+}
+
+CRAWLER_NOINLINE void operator delete(void* pointer, size_t) noexcept { operator delete(pointer); }
+
+inline void printMemoryReport(ostream& out = cout) {
+    char row[96];
+    snprintf(row, sizeof(row), "  %-10s %12s %12s %10s %14s\n", "memory", "live bytes", "peak bytes", "blocks", "allocations");
+    out << row;
+    MemoryTotals totals = memoryTotals();
+    for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+        snprintf(row, sizeof(row), "  %-10s %12lld %12lld %10lld %14llu\n", MEMORY_SUBSYSTEM_NAMES[s],
+                 (long long)totals.bytes[s], (long long)totals.peak[s], (long long)totals.blocks[s],
+                 (unsigned long long)totals.allocations[s]);
+        out << row;
+    }
+}
+
+// A budget such as "enemies=2M"; only enemies, items, and messages can be held to one
+inline bool parseMemoryBudget(const string& text, int64_t* budgets) {
+    size_t equals = text.find('=');
+    if (equals == string::npos) return false;
+    string name = text.substr(0, equals);
+    char* unit;
+    double amount = strtod(text.c_str() + equals + 1, &unit);
+    char suffix = (char)toupper(*unit);
+    double scale = suffix == 'K' ? 1024.0 : suffix == 'M' ? 1048576.0 : suffix == 'G' ? 1073741824.0 : 1.0;
+    for (MemorySubsystem subsystem : { MEM_ENEMIES, MEM_ITEMS, MEM_MESSAGES }) {
+        if (name != MEMORY_SUBSYSTEM_NAMES[subsystem] || amount <= 0) continue;
+        budgets[subsystem] = (int64_t)(amount * scale);
+        return true;
+    }
+    return false;
+}
+
+// Live metrics ----------------------------------------------------------
+// With --export-metrics NAME a game keeps its counters and latency
+// histograms in a named shared-memory block. Every field is a lock-free
+// atomic that the game only adds to or stores into, so the game never
+// waits on a reader. `--metrics NAME` maps the same block read-only and
+// prints it once a second.
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "metrics are shared between processes, so their atomics must not hide a lock");
+
+const uint32_t METRICS_MAGIC = 0x5854454D; // "METX"
+const int METRICS_BUCKETS = 24; // bucket b counts timings in [2^(b-1), 2^b) microseconds
+
+enum MetricsHistogram { METRIC_UPDATE, METRIC_DRAW, METRIC_LEVEL, METRIC_HISTOGRAMS };
+const char* const METRIC_NAMES[METRIC_HISTOGRAMS] = { "update()", "draw()", "level generation" };
+
+struct MetricsBlock {
+    atomic<uint32_t> magic;     // METRICS_MAGIC while the game is running, 0 after
+    uint32_t size;              // sizeof(MetricsBlock), so a mismatched reader can tell
+    uint32_t pid;
+    atomic<uint32_t> sessions;  // games running in the process
+    atomic<uint32_t> enemies;   // enemies alive at the end of the last turn
+    atomic<uint32_t> hibernated; // sessions whose level is on disk
+    atomic<int64_t> memory[MEMORY_SUBSYSTEMS]; // live heap bytes at the end of the last turn
+    atomic<uint64_t> count[METRIC_HISTOGRAMS];        // timings recorded; for update(), turns played
+    atomic<uint64_t> micros[METRIC_HISTOGRAMS];       // their total
+    atomic<uint64_t> last[METRIC_HISTOGRAMS];         // the latest, in microseconds
+    atomic<uint64_t> allocations[METRIC_HISTOGRAMS];  // heap allocations made while timed
+    atomic<uint64_t> lastAllocations[METRIC_HISTOGRAMS];
+    atomic<uint64_t> buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+};
+
+inline string metricsMappingName(const string& name) {
+    return "Local\\DungeonCrawlerMetrics." + name;
+}
+
+class MetricsExport {
+public:
+    explicit MetricsExport(const string& name) {
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(MetricsBlock),
+                                     metricsMappingName(name).c_str());
+        void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(MetricsBlock)) : nullptr;
+        if (!view) return;
+        block = new (view) MetricsBlock();
+        block->size = sizeof(MetricsBlock);
+        block->pid = (uint32_t)GetCurrentProcessId();
+        block->magic.store(METRICS_MAGIC, memory_order_release);
+    }
+
+    ~MetricsExport() {
+        if (block) {
+            block->magic.store(0, memory_order_release);
+            UnmapViewOfFile(block);
+        }
+        if (mapping) CloseHandle(mapping);
+    }
+
+    bool ok() const { return block != nullptr; }
+
+    void sessionStarted() { block->sessions.fetch_add(1, memory_order_relaxed); }
+    void sessionEnded() { block->sessions.fetch_sub(1, memory_order_relaxed); }
+    // Gauges sampled at the end of every turn
+    void endTurn(size_t enemies) {
+        block->enemies.store((uint32_t)enemies, memory_order_relaxed);
+        MemoryTotals totals = memoryTotals();
+        for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+            block->memory[s].store(totals.bytes[s], memory_order_relaxed);
+        }
+    }
+    void sessionHibernated() { block->hibernated.fetch_add(1, memory_order_relaxed); }
+    void sessionResumed() { block->hibernated.fetch_sub(1, memory_order_relaxed); }
+
+    void record(MetricsHistogram which, chrono::steady_clock::duration elapsed, uint64_t allocations) {
+        uint64_t micros = (uint64_t)chrono::duration_cast<chrono::microseconds>(elapsed).count();
+        int bucket = 0;
+        while (bucket < METRICS_BUCKETS - 1 && (1ull << bucket) <= micros) bucket++;
+        block->buckets[which][bucket].fetch_add(1, memory_order_relaxed);
+        block->micros[which].fetch_add(micros, memory_order_relaxed);
+        block->last[which].store(micros, memory_order_relaxed);
+        block->allocations[which].fetch_add(allocations, memory_order_relaxed);
+        block->lastAllocations[which].store(allocations, memory_order_relaxed);
+        block->count[which].fetch_add(1, memory_order_release);
+    }
+
+private:
+    HANDLE mapping = nullptr;
+    MetricsBlock* block = nullptr;
+};
+
+// Times its own scope, and the allocations made in it, into the export.
+// Time that `waiting` grows by meanwhile (the player thinking over a
+// prompt) is left out.
+class MetricsTimer {
+public:
+    MetricsTimer(MetricsExport* metrics, MetricsHistogram which, const chrono::steady_clock::duration* waiting = nullptr)
+        : metrics(metrics), which(which), waiting(waiting) {
+        if (!metrics) return;
+        allocations = heapAllocations();
+        waitedBefore = waiting ? *waiting : chrono::steady_clock::duration(0);
+        start = chrono::steady_clock::now();
+    }
+
+    ~MetricsTimer() {
+        if (!metrics) return;
+        chrono::steady_clock::duration elapsed = chrono::steady_clock::now() - start;
+        if (waiting) elapsed -= min(elapsed, *waiting - waitedBefore);
+        metrics->record(which, elapsed, heapAllocations() - allocations);
+    }
+
+private:
+    MetricsExport* metrics;
+    MetricsHistogram which;
+    const chrono::steady_clock::duration* waiting;
+    chrono::steady_clock::duration waitedBefore{ 0 };
+    uint64_t allocations = 0;
+    chrono::steady_clock::time_point start;
+};
+
+// Upper bound, in microseconds, of the bucket holding the given percentile
+inline uint64_t metricsPercentile(const uint64_t* buckets, uint64_t total, double percentile) {
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (total > 0 && seen >= (uint64_t)ceil(total * percentile)) return 1ull << b;
+    }
+    return 0;
+}
+
+// The bundled reader: polls another process's metrics until a key is pressed
+inline int watchMetrics(const string& name) {
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, metricsMappingName(name).c_str());
+    const MetricsBlock* block = mapping ? (const MetricsBlock*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(MetricsBlock)) : nullptr;
+    if (!block || block->magic.load(memory_order_acquire) != METRICS_MAGIC || block->size != sizeof(MetricsBlock)) {
+        cout << "No game is exporting metrics as " << name << endl;
+        if (block) UnmapViewOfFile(block);
+        if (mapping) CloseHandle(mapping);
+        return 1;
+    }
+    cout << "Watching process " << block->pid << ", press any key to stop" << endl;
+    uint64_t lastTurns = block->count[METRIC_UPDATE].load(memory_order_acquire);
+    uint64_t lastAllocations = block->allocations[METRIC_UPDATE].load(memory_order_relaxed);
+    auto lastPoll = chrono::steady_clock::now();
+    while (!_kbhit()) {
+        this_thread::sleep_for(chrono::seconds(1));
+        if (block->magic.load(memory_order_acquire) != METRICS_MAGIC) {
+            cout << "The game has exited." << endl;
+            break;
+        }
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - lastPoll).count();
+        uint64_t turns = block->count[METRIC_UPDATE].load(memory_order_acquire);
+        uint64_t allocations = block->allocations[METRIC_UPDATE].load(memory_order_relaxed);
+        
+        ostringstream out;
+        out << "\nturns/s " << (uint64_t)((turns - lastTurns) / seconds)
+            << "  sessions " << block->sessions.load(memory_order_relaxed)
+            << " (" << block->hibernated.load(memory_order_relaxed) << " hibernated)"
+            << "  enemies " << block->enemies.load(memory_order_relaxed)
+            << "  allocations/turn " << (turns > lastTurns ? (double)(allocations - lastAllocations) / (turns - lastTurns) : 0.0)
+            << "  last level " << block->last[METRIC_LEVEL].load(memory_order_relaxed) / 1000.0 << " ms\n";
+        char row[128];
+        snprintf(row, sizeof(row), "  %-18s %10s %9s %9s %9s %9s\n", "", "count", "mean us", "p50 <us", "p99 <us", "p999 <us");
+        out << row;
+        for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+            uint64_t buckets[METRICS_BUCKETS], total = 0;
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                buckets[b] = block->buckets[h][b].load(memory_order_relaxed);
+                total += buckets[b];
+            }
+            uint64_t micros = block->micros[h].load(memory_order_relaxed);
+            snprintf(row, sizeof(row), "  %-18s %10llu %9llu %9llu %9llu %9llu\n", METRIC_NAMES[h],
+                     (unsigned long long)total, (unsigned long long)(total ? micros / total : 0),
+                     (unsigned long long)metricsPercentile(buckets, total, 0.5),
+                     (unsigned long long)metricsPercentile(buckets, total, 0.99),
+                     (unsigned long long)metricsPercentile(buckets, total, 0.999));
+            out << row;
+        }
+        out << "  memory KB";
+        for (int s = 0; s < MEMORY_SUBSYSTEMS; s++) {
+            out << "  " << MEMORY_SUBSYSTEM_NAMES[s] << " " << block->memory[s].load(memory_order_relaxed) / 1024;
+        }
+        out << "\n";
+        cout << out.str() << flush;
+        lastTurns = turns;
+        lastAllocations = allocations;
+        lastPoll = now;
+    }
+    if (_kbhit()) _getch();
+    UnmapViewOfFile(block);
+    CloseHandle(mapping);
+    return 0;
+}
+
+// Event bus ------------------------------------------------------------
+// Combat, pickup, and level code publishes fixed-size events into a
+// per-turn buffer instead of adjusting score, writing messages, and so on
+// inline. At the end of each phase of the turn the buffer goes to each
+// subscriber as one batch. Subscribers are template arguments of the bus, so
+// dispatch is a direct call per subscriber per batch: no virtual call and
+// no allocation per event. Subscribers must not publish while handling.
+
+// Same order as TelemetryType, so the telemetry subscriber can pass the type through
+enum GameEventType : uint8_t {
+    EVENT_PLAYER_HIT,   // subject: enemy kind, value: damage dealt
+    EVENT_ENEMY_HIT,    // subject: enemy kind, value: damage taken
+    EVENT_SPELL,        // subject: spell, value: enemies hit
+    EVENT_KILL,         // subject: enemy kind, value: experience, extra: gold
+    EVENT_PICKUP,       // subject: loot kind, variant: loot variant, value: amount
+    EVENT_TRAP,         // subject: 0 spikes, 1 poison, 2 alarm; value: damage
+    EVENT_LEVEL,        // value: the new dungeon level
+    EVENT_DEATH,        // value: final score
+    EVENT_DOOR,         // subject: 0 unlocked, 1 locked; value: score gained
+    EVENT_MISS,         // a melee swing that hit nothing
+    GAME_EVENT_TYPES
+};
+static_assert((int)GAME_EVENT_TYPES == (int)TELEMETRY_TYPES, "event types mirror telemetry types");
+
+enum GameEventFlag : uint8_t {
+    EVENT_CRITICAL = 1, // a critical melee hit
+    EVENT_THROWN = 2,   // the player's hit came from a thrown knife
+    EVENT_RANGED = 4    // the enemy's hit came from range
+};
+
+struct GameEvent {
+    uint8_t type = 0;    // GameEventType
+    uint8_t subject = 0;
+    uint8_t variant = 0;
+    uint8_t flags = 0;   // GameEventFlag bits
+    int16_t x = 0, y = 0;
+    int32_t value = 0;
+    int32_t extra = 0;
+};
+static_assert(sizeof(GameEvent) == 16, "GameEvent is meant to stay 16 bytes");
+
+const size_t EVENT_BUS_CAPACITY = 256; // a fuller turn is dispatched early
+
+template <typename... Subscribers>
+class EventBus {
+public:
+    explicit EventBus(Subscribers&... subscribers) : subscribers(subscribers...) {}
+
+    void publish(const GameEvent& event) {
+        if (count == EVENT_BUS_CAPACITY) dispatch();
+        events[count++] = event;
+    }
+
+    // Hands the batch to every subscriber, in template argument order
+    void dispatch() {
+        if (count == 0) return;
+        size_t batch = count;
+        count = 0;
+        dispatchTo(batch, index_sequence_for<Subscribers...>());
+    }
+
+private:
+    array<GameEvent, EVENT_BUS_CAPACITY> events;
+    size_t count = 0;
+    tuple<Subscribers&...> subscribers;
+
+    template <size_t... I>
+    void dispatchTo(size_t batch, index_sequence<I...>) {
+        int expand[] = { 0, (get<I>(subscribers).handle(events.data(), batch), 0)... };
+        (void)expand;
+    }
+};
+
+// Spectators ------------------------------------------------------------
+// draw() renders the screen into a ScreenFrame, a grid of characters and
+// console colors. The console prints it, and when spectating is on the
+// frame is handed to the SpectatorHub, whose own thread diffs it against
+// the last one, encodes the changes once as ANSI text in a shared
+// buffer, and queues that same buffer on every watcher connection.
+
+const int FRAME_COLS = 120;
+const int FRAME_ROWS = HEIGHT + 24; // tall enough for the title screen too
+
+struct ScreenFrame {
+    int rows = 0; // rows in use
+    vector<char> text = vector<char>(FRAME_COLS * FRAME_ROWS, ' ');
+    vector<uint8_t> color = vector<uint8_t>(FRAME_COLS * FRAME_ROWS, WHITE);
+
+    void clear() {
+        rows = 0;
+        fill(text.begin(), text.end(), ' ');
+        fill(color.begin(), color.end(), (uint8_t)WHITE);
+    }
+
+    void put(int row, int col, char c, Color fg) {
+        if (row >= FRAME_ROWS || col >= FRAME_COLS) return;
+        text[row * FRAME_COLS + col] = c;
+        color[row * FRAME_COLS + col] = (uint8_t)fg;
+        rows = max(rows, row + 1);
+    }
+
+    // Writes a line of text and returns the next row
+    int line(int row, const string& s, Color fg) {
+        for (size_t i = 0; i < s.size(); i++) put(row, (int)i, s[i], fg);
+        rows = max(rows, min(row + 1, FRAME_ROWS));
+        return row + 1;
+    }
+
+    // Writes text that may span several lines and returns the next row
+    int lines(int row, const string& s, Color fg) {
+        size_t begin = 0;
+        while (begin < s.size()) {
+            size_t end = s.find('\n', begin);
+            if (end == string::npos) end = s.size();
+            row = line(row, s.substr(begin, end - begin), fg);
+            begin = end + 1;
+        }
+        return row;
+    }
+};
+
+// Print a frame to the console, switching colour only where it changes
+inline void printFrame(const ScreenFrame& frame) {
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    system("cls");
+    string run;
+    int current = -1;
+    for (int row = 0; row < frame.rows; row++) {
+        int end = FRAME_COLS;
+        while (end > 0 && frame.text[row * FRAME_COLS + end - 1] == ' ') end--;
+        for (int col = 0; col < end; col++) {
+            int i = row * FRAME_COLS + col;
+            if (frame.color[i] != current && frame.text[i] != ' ') {
+                cout << run;
+                run.clear();
+                current = frame.color[i];
+                SetConsoleTextAttribute(console, (WORD)current);
+            }
+            run += frame.text[i];
+        }
+        run += '\n';
+    }
+    cout << run << flush;
+    SetConsoleTextAttribute(console, WHITE);
+}
+
+// ANSI escape encoding of screen frames for spectator terminals
+inline void appendAnsiColor(string& out, uint8_t color) {
+    static const char ansi[8] = { '0', '4', '2', '6', '1', '5', '3', '7' }; // console order to ANSI order
+    out += color >= 8 ? "\x1b[9" : "\x1b[3";
+    out += ansi[color & 7];
+    out += 'm';
+}
+
+inline void appendAnsiRow(string& out, const ScreenFrame& frame, int row, int first, int last) {
+    out += "\x1b[" + to_string(row + 1) + ";" + to_string(first + 1) + "H";
+    int current = -1;
+    for (int col = first; col <= last; col++) {
+        int i = row * FRAME_COLS + col;
+        if (frame.color[i] != current) {
+            current = frame.color[i];
+            appendAnsiColor(out, (uint8_t)current);
+        }
+        out += frame.text[i];
+    }
+}
+
+// Only the changed span of each changed row
+inline string encodeFrameDiff(const ScreenFrame& from, const ScreenFrame& to) {
+    string out;
+    for (int row = 0; row < FRAME_ROWS; row++) {
+        int first = -1, last = -1;
+        for (int col = 0; col < FRAME_COLS; col++) {
+            int i = row * FRAME_COLS + col;
+            if (from.text[i] != to.text[i] || from.color[i] != to.color[i]) {
+                if (first < 0) first = col;
+                last = col;
+            }
+        }
+        if (first >= 0) appendAnsiRow(out, to, row, first, last);
+    }
+    return out;
+}
+
+inline string encodeKeyframe(const ScreenFrame& frame) {
+    string out = "\x1b[0m\x1b[2J";
+    for (int row = 0; row < FRAME_ROWS; row++) {
+        appendAnsiRow(out, frame, row, 0, FRAME_COLS - 1);
+    }
+    return out;
+}
+
+class SpectatorHub {
+public:
+    explicit SpectatorHub(int port) {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0) return;
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) return;
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons((unsigned short)port);
+        u_long nonBlocking = 1;
+        if (::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0 ||
+            ioctlsocket(listener, FIONBIO, &nonBlocking) != 0) {
+            closesocket(listener);
+            listener = INVALID_SOCKET;
+            return;
+        }
+        worker = thread(&SpectatorHub::run, this);
+    }
+
+    ~SpectatorHub() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+        for (auto& watcher : watchers) closesocket(watcher.socket);
+        if (listener != INVALID_SOCKET) closesocket(listener);
+        WSACleanup();
+    }
+
+    bool ok() const { return listener != INVALID_SOCKET; }
+    size_t watching() const { return watcherCount.load(memory_order_relaxed); }
+
+    // Game thread: hand over the latest frame. Only a copy under a short
+    // lock; diffing, encoding, and sending all happen on the hub thread.
+    void publish(const ScreenFrame& frame) {
+        lock_guard<mutex> guard(lock);
+        inbox = frame;
+        fresh = true;
+    }
+
+private:
+    static const size_t MAX_BACKLOG = 4; // queued updates before a watcher is resynced
+    static const size_t MAX_WATCHERS = FD_SETSIZE - 1; // select() also needs the listener
+
+    struct Watcher {
+        SOCKET socket;
+        deque<shared_ptr<const string>> queue;
+        size_t offset = 0; // bytes of queue.front() already sent
+    };
+
+    SOCKET listener = INVALID_SOCKET;
+    thread worker;
+    atomic<bool> stopping{ false };
+    atomic<size_t> watcherCount{ 0 };
+    mutex lock;
+    ScreenFrame inbox;  // guarded by lock
+    bool fresh = false; // guarded by lock
+    
+    // Hub thread only
+    vector<Watcher> watchers;
+    ScreenFrame shown;   // the frame watchers are being brought up to
+    bool haveFrame = false;
+    shared_ptr<const string> keyframe; // of `shown`, built on first need
+
+    shared_ptr<const string> currentKeyframe() {
+        if (!keyframe) keyframe = make_shared<const string>(encodeKeyframe(shown));
+        return keyframe;
+    }
+
+    void run() {
+        ScreenFrame incoming;
+        while (!stopping) {
+            fd_set readable, writable;
+            FD_ZERO(&readable);
+            FD_ZERO(&writable);
+            FD_SET(listener, &readable);
+            SOCKET highest = listener;
+            for (auto& watcher : watchers) {
+                FD_SET(watcher.socket, &readable);
+                if (!watcher.queue.empty()) FD_SET(watcher.socket, &writable);
+                highest = max(highest, watcher.socket);
+            }
+            timeval timeout = { 0, 20000 };
+            select((int)highest + 1, &readable, &writable, nullptr, &timeout);
+            
+            if (FD_ISSET(listener, &readable)) acceptWatchers();
+            
+            bool gotFrame = false;
+            {
+                lock_guard<mutex> guard(lock);
+                if (fresh) {
+                    swap(incoming, inbox);
+                    fresh = false;
+                    gotFrame = true;
+                }
+            }
+            if (gotFrame) broadcast(incoming);
+            
+            size_t kept = 0;
+            for (size_t i = 0; i < watchers.size(); i++) {
+                Watcher& watcher = watchers[i];
+                bool alive = true;
+                if (FD_ISSET(watcher.socket, &readable)) alive = drainInput(watcher);
+                if (alive && !watcher.queue.empty()) alive = flush(watcher);
+                if (!alive) {
+                    closesocket(watcher.socket);
+                    continue;
+                }
+                if (kept != i) watchers[kept] = move(watcher);
+                kept++;
+            }
+            watchers.resize(kept);
+            watcherCount.store(kept, memory_order_relaxed);
+        }
+    }
+
+    void acceptWatchers() {
+        for (;;) {
+            SOCKET client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET) return;
+            if (watchers.size() >= MAX_WATCHERS) {
+                closesocket(client); // FD_SET would silently leave it out
+                continue;
+            }
+            u_long nonBlocking = 1;
+            ioctlsocket(client, FIONBIO, &nonBlocking);
+            Watcher watcher;
+            watcher.socket = client;
+            if (haveFrame) watcher.queue.push_back(currentKeyframe());
+            watchers.push_back(move(watcher));
+        }
+    }
+
+    // Encode the change once; every watcher queues the same buffer. A
+    // watcher too far behind drops its backlog for one fresh keyframe.
+    void broadcast(const ScreenFrame& frame) {
+        shared_ptr<const string> diff;
+        if (haveFrame) diff = make_shared<const string>(encodeFrameDiff(shown, frame));
+        shown.rows = frame.rows;
+        shown.text = frame.text;
+        shown.color = frame.color;
+        keyframe.reset();
+        if (!haveFrame) {
+            haveFrame = true;
+            diff = currentKeyframe();
+        }
+        if (diff->empty()) return;
+        
+        for (auto& watcher : watchers) {
+            if (watcher.queue.size() < MAX_BACKLOG) {
+                watcher.queue.push_back(diff);
+                continue;
+            }
+            // Keep a half-sent update so the stream stays well formed
+            shared_ptr<const string> partial = watcher.offset > 0 ? watcher.queue.front() : nullptr;
+            watcher.queue.clear();
+            if (partial) watcher.queue.push_back(partial);
+            watcher.queue.push_back(currentKeyframe());
+        }
+    }
+
+    // Watchers only watch; anything they type is discarded
+    bool drainInput(Watcher& watcher) {
+        char scratch[256];
+        int got = recv(watcher.socket, scratch, sizeof(scratch), 0);
+        return got > 0 || (got < 0 && WSAGetLastError() == WSAEWOULDBLOCK);
+    }
+
+    bool flush(Watcher& watcher) {
+        while (!watcher.queue.empty()) {
+            const string& packet = *watcher.queue.front();
+            int sent = send(watcher.socket, packet.data() + watcher.offset, (int)(packet.size() - watcher.offset), 0);
+            if (sent < 0) return WSAGetLastError() == WSAEWOULDBLOCK;
+            watcher.offset += sent;
+            if (watcher.offset < packet.size()) return true;
+            watcher.queue.pop_front();
+            watcher.offset = 0;
+        }
+        return true;
+    }
+};
+
+// Session recording ----------------------------------------------------
+// --record writes the session as an asciicast v2 file: a JSON header line,
+// then one [seconds, "o", text] line per frame. The game thread only
+// copies the frame into a recycled slot; a background thread diffs it
+// against the previous one, escapes the ANSI text and writes it out in
+// large chunks, so a recording holds changes rather than full redraws.
+
+class SessionRecorder {
+public:
+    explicit SessionRecorder(const string& path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) return;
+        fprintf(file, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld, "
+                      "\"title\": \"Dungeon Crawler\", \"env\": {\"TERM\": \"xterm-256color\"}}\n",
+                FRAME_COLS, FRAME_ROWS, (long long)time(0));
+        start = chrono::steady_clock::now();
+        worker = thread(&SessionRecorder::run, this);
+    }
+
+    ~SessionRecorder() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+        if (file) fclose(file);
+    }
+
+    bool ok() const { return file != nullptr; }
+
+    // Game thread: stamp and queue a copy of the frame
+    void record(const ScreenFrame& frame) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        lock_guard<mutex> guard(lock);
+        if (spare.empty()) {
+            pending.emplace_back();
+        } else {
+            pending.push_back(move(spare.back()));
+            spare.pop_back();
+        }
+        Stamped& slot = pending.back();
+        slot.seconds = seconds;
+        slot.frame.rows = frame.rows;
+        slot.frame.text = frame.text;
+        slot.frame.color = frame.color;
+        wake.notify_one();
+    }
+
+private:
+    static const size_t WRITE_CHUNK = 1 << 16;
+
+    struct Stamped {
+        double seconds = 0;
+        ScreenFrame frame;
+    };
+
+    FILE* file = nullptr;
+    thread worker;
+    chrono::steady_clock::time_point start;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;      // guarded by lock
+    vector<Stamped> pending;    // guarded by lock
+    vector<Stamped> spare;      // guarded by lock, slots to reuse
+    
+    // Writer thread only
+    ScreenFrame last;
+    bool haveFrame = false;
+    string out;
+
+    void run() {
+        vector<Stamped> batch;
+        for (;;) {
+            bool finish;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait_for(guard, chrono::milliseconds(100), [this] { return stopping || !pending.empty(); });
+                finish = stopping;
+                for (auto& slot : batch) spare.push_back(move(slot));
+                batch.clear();
+                swap(batch, pending);
+            }
+            for (Stamped& slot : batch) {
+                append(slot);
+                if (out.size() >= WRITE_CHUNK) write();
+            }
+            write();
+            if (finish) return;
+        }
+    }
+
+    void append(Stamped& slot) {
+        string text = haveFrame ? encodeFrameDiff(last, slot.frame) : encodeKeyframe(slot.frame);
+        swap(last, slot.frame); // the slot is recycled anyway
+        haveFrame = true;
+        if (text.empty()) return;
+        
+        char stamp[32];
+        snprintf(stamp, sizeof(stamp), "[%.6f, \"o\", \"", slot.seconds);
+        out += stamp;
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += (char)c;
+            } else if (c < 0x20 || c >= 0x7f) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += (char)c;
+            }
+        }
+        out += "\"]\n";
+    }
+
+    void write() {
+        if (out.empty()) return;
+        fwrite(out.data(), 1, out.size(), file);
+        fflush(file);
+        out.clear();
+    }
+};
+
+// Search bot ----------------------------------------------------------
+// The bot plays on SimState, a cut-down copy of the game that forks in
+// microseconds: tiles live in copy-on-write chunks shared between forks,
+// and enemies are a flat array of small structs.
+
+const int COW_CHUNK = 16; // side of a copy-on-write tile chunk
+
+class CowGrid {
+public:
+    int width = 0;
+    int height = 0;
+
+    CowGrid() {}
+
+    explicit CowGrid(const vector<vector<char>>& map)
+        : width((int)map[0].size()), height((int)map.size()) {
+        chunksX = (width + COW_CHUNK - 1) / COW_CHUNK;
+        int chunksY = (height + COW_CHUNK - 1) / COW_CHUNK;
+        chunks.resize((size_t)chunksX * chunksY);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunks[i] = make_shared<Chunk>();
+            chunks[i]->fill(WALL);
+        }
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                (*chunks[chunkIndex(x, y)])[cellIndex(x, y)] = map[y][x];
+            }
+        }
+    }
+
+    char get(int x, int y) const {
+        if (x < 0 || x >= width || y < 0 || y >= height) return WALL;
+        return (*chunks[chunkIndex(x, y)])[cellIndex(x, y)];
+    }
+
+    // Copies the chunk first if another fork still shares it
+    void set(int x, int y, char tile) {
+        shared_ptr<Chunk>& chunk = chunks[chunkIndex(x, y)];
+        if (chunk.use_count() > 1) {
+            chunk = make_shared<Chunk>(*chunk);
+        }
+        (*chunk)[cellIndex(x, y)] = tile;
+    }
+
+private:
+    typedef array<char, COW_CHUNK * COW_CHUNK> Chunk;
+    int chunksX = 0;
+    vector<shared_ptr<Chunk>> chunks;
+
+    size_t chunkIndex(int x, int y) const {
+        return (size_t)(y / COW_CHUNK) * chunksX + x / COW_CHUNK;
+    }
+
+    static int cellIndex(int x, int y) {
+        return (y % COW_CHUNK) * COW_CHUNK + x % COW_CHUNK;
+    }
+};
+
+struct SimEnemy {
+    int16_t x, y;
+    int16_t health;
+    int16_t attack;
+    int16_t defense;
+    int16_t value; // score for the kill
+};
+
+enum BotAction {
+    BOT_NORTH,
+    BOT_SOUTH,
+    BOT_WEST,
+    BOT_EAST,
+    BOT_ATTACK,
+    BOT_POTION,
+    BOT_ACTIONS
+};
+
+const int BOT_DX[BOT_ACTIONS] = { 0, 0, -1, 1, 0, 0 };
+const int BOT_DY[BOT_ACTIONS] = { -1, 1, 0, 0, 0, 0 };
+const char BOT_KEYS[BOT_ACTIONS] = { 'w', 's', 'a', 'd', ' ', 'h' };
+const char* const BOT_NAMES[BOT_ACTIONS] = {
+    "move north", "move south", "move west", "move east", "attack", "drink a potion"
+};
+
+// Forward model of the current level. Rules are simplified: every enemy is
+// a melee chaser, traps always spike, and found gear adds a flat bonus.
+struct SimState {
+    CowGrid tiles;
+    vector<SimEnemy> enemies;
+    int px = 0, py = 0;
+    int health = 0, maxHealth = 0;
+    int attack = 0, defense = 0;
+    int gold = 0, score = 0;
+    int potions = 0;
+    int level = 1;
+    bool hasKey = false;
+    bool dead = false;
+    bool descended = false;
+    uint64_t rng = 1;
+
+    uint32_t random() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return (uint32_t)(rng >> 32);
+    }
+
+    int enemyAt(int x, int y) const {
+        for (size_t i = 0; i < enemies.size(); i++) {
+            if (enemies[i].x == x && enemies[i].y == y) return (int)i;
+        }
+        return -1;
+    }
+
+    int adjacentEnemy() const {
+        for (size_t i = 0; i < enemies.size(); i++) {
+            if (abs(enemies[i].x - px) <= 1 && abs(enemies[i].y - py) <= 1) return (int)i;
+        }
+        return -1;
+    }
+
+    bool legal(BotAction action) const {
+        if (action == BOT_ATTACK) return adjacentEnemy() >= 0;
+        if (action == BOT_POTION) return potions > 0 && health < maxHealth;
+        return tiles.get(px + BOT_DX[action], py + BOT_DY[action]) != WALL;
+    }
+
+    void step(BotAction action) {
+        if (dead || descended) return;
+        switch (action) {
+            case BOT_ATTACK:
+                {
+                    int target = adjacentEnemy();
+                    if (target < 0) break;
+                    SimEnemy& enemy = enemies[target];
+                    int damage = attack * (random() % 10 == 0 ? 2 : 1);
+                    enemy.health -= max(1, damage - enemy.defense / 2);
+                    if (enemy.health <= 0) {
+                        score += enemy.value;
+                        enemy = enemies.back();
+                        enemies.pop_back();
+                    }
+                }
+                break;
+            case BOT_POTION:
+                if (potions > 0) {
+                    potions--;
+                    health = min(maxHealth, health + 30);
+                }
+                break;
+            default:
+                {
+                    int nx = px + BOT_DX[action];
+                    int ny = py + BOT_DY[action];
+                    if (tiles.get(nx, ny) != WALL && enemyAt(nx, ny) < 0) {
+                        px = nx;
+                        py = ny;
+                        pickUp();
+                    }
+                }
+        }
+        moveEnemies();
+        if (health <= 0) dead = true;
+    }
+
+    void pickUp() {
+        char tile = tiles.get(px, py);
+        switch (tile) {
+            case KEY: hasKey = true; break;
+            case HEALTH: potions++; break;
+            case GOLD:
+                {
+                    int amount = 5 + random() % (10 * level);
+                    gold += amount;
+                    score += amount;
+                }
+                break;
+            case WEAPON: attack += 2; break;
+            case ARMOR: defense += 1; break;
+            case TRAP: health -= 5 + random() % (5 * level); break;
+            case DOOR:
+                if (!hasKey) return;
+                hasKey = false;
+                score += 100 * level;
+                break;
+            case STAIRS: descended = true; return;
+            default: return;
+        }
+        tiles.set(px, py, FLOOR);
+    }
+
+    void moveEnemies() {
+        for (size_t i = 0; i < enemies.size(); i++) {
+            SimEnemy& enemy = enemies[i];
+            int dx = px - enemy.x, dy = py - enemy.y;
+            if (abs(dx) <= 1 && abs(dy) <= 1) {
+                health -= max(1, enemy.attack - defense / 2);
+                continue;
+            }
+            if (abs(dx) > 12 || abs(dy) > 12) continue; // out of earshot
+            int sx = (dx > 0) - (dx < 0), sy = (dy > 0) - (dy < 0);
+            if (abs(dx) >= abs(dy) && tryEnemyStep(enemy, sx, 0)) continue;
+            if (sy != 0 && tryEnemyStep(enemy, 0, sy)) continue;
+            if (sx != 0) tryEnemyStep(enemy, sx, 0);
+        }
+    }
+
+    bool tryEnemyStep(SimEnemy& enemy, int dx, int dy) {
+        int nx = enemy.x + dx, ny = enemy.y + dy;
+        if (tiles.get(nx, ny) == WALL || enemyAt(nx, ny) >= 0) return false;
+        if (nx == px && ny == py) return false;
+        enemy.x = (int16_t)nx;
+        enemy.y = (int16_t)ny;
+        return true;
+    }
+};
+
+// Picks moves by Monte Carlo tree search: UCB1 over the legal first moves,
+// each playout a short rollout on a fork of the root state
+class SearchBot {
+public:
+    int iterations = 1500;
+    int rolloutDepth = 16;
+    long long forks = 0;
+
+    // goalDistance: BFS steps from each tile to the nearest thing worth
+    // walking to, row-major over the map; it steers rollouts and scoring
+    BotAction choose(const SimState& root, const vector<int>& goalDistance) {
+        goals = &goalDistance;
+        rng = root.rng ^ 0x9E3779B97F4A7C15ULL;
+        
+        BotAction legal[BOT_ACTIONS];
+        int legalCount = 0;
+        for (int a = 0; a < BOT_ACTIONS; a++) {
+            if (root.legal((BotAction)a)) legal[legalCount++] = (BotAction)a;
+        }
+        if (legalCount == 0) return BOT_ATTACK;
+        
+        double total[BOT_ACTIONS] = {};
+        int visits[BOT_ACTIONS] = {};
+        for (int i = 0; i < iterations; i++) {
+            int pick = 0;
+            double bestUcb = -1e300;
+            for (int j = 0; j < legalCount; j++) {
+                int a = legal[j];
+                if (visits[a] == 0) { pick = j; break; }
+                double ucb = total[a] / visits[a] + 40.0 * sqrt(log((double)i) / visits[a]);
+                if (ucb > bestUcb) { bestUcb = ucb; pick = j; }
+            }
+            BotAction action = legal[pick];
+            
+            SimState state = root;
+            forks++;
+            state.rng ^= nextRandom() | 1;
+            state.step(action);
+            for (int d = 0; d < rolloutDepth && !state.dead && !state.descended; d++) {
+                state.step(rolloutMove(state));
+            }
+            total[action] += evaluate(state);
+            visits[action]++;
+        }
+        
+        BotAction best = legal[0];
+        for (int j = 1; j < legalCount; j++) {
+            if (visits[legal[j]] > visits[best]) best = legal[j];
+        }
+        return best;
+    }
+
+private:
+    const vector<int>* goals = nullptr;
+    uint64_t rng = 1;
+
+    uint32_t nextRandom() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return (uint32_t)(rng >> 32);
+    }
+
+    int goalDistanceAt(const SimState& state) const {
+        return (*goals)[(size_t)state.py * state.tiles.width + state.px];
+    }
+
+    // Mostly greedy: fight what is adjacent, heal when low, otherwise walk
+    // downhill on the goal distance; a quarter of moves are random
+    BotAction rolloutMove(SimState& state) {
+        uint32_t roll = nextRandom();
+        if (roll % 4 == 0) {
+            return (BotAction)(nextRandom() % BOT_POTION);
+        }
+        if (state.health * 3 < state.maxHealth && state.potions > 0) return BOT_POTION;
+        if (state.adjacentEnemy() >= 0) return BOT_ATTACK;
+        
+        BotAction best = (BotAction)(roll % 4);
+        int bestDistance = INT32_MAX;
+        for (int a = 0; a < BOT_ATTACK; a++) {
+            int nx = state.px + BOT_DX[a], ny = state.py + BOT_DY[a];
+            if (state.tiles.get(nx, ny) == WALL) continue;
+            int distance = (*goals)[(size_t)ny * state.tiles.width + nx];
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = (BotAction)a;
+            }
+        }
+        return best;
+    }
+
+    double evaluate(const SimState& state) const {
+        if (state.dead) return state.score - 1000.0;
+        double value = state.score + state.health * 2.0 + state.potions * 15.0
+                     + state.attack * 5.0 + state.defense * 5.0 + (state.hasKey ? 40.0 : 0.0);
+        if (state.descended) return value + 300.0;
+        int distance = goalDistanceAt(state);
+        return value - 2.0 * min(distance, 100);
+    }
+};
+
+// Rewind journal. Each turn appends what it changed as fixed-size delta
+// entries and closes with a JOURNAL_TURN marker; stepping back applies a
+// turn's `before` values newest first, stepping forward its `after`
+// values oldest first. The entries live in a ring, so once it is full the
+// oldest whole turn is dropped and memory stays at capacity * 16 bytes.
+enum JournalKind : uint8_t {
+    JOURNAL_TURN,
+    JOURNAL_TILE,         // target = tile index, values are tile chars
+    JOURNAL_PLAYER,       // field = player stat, see GameManager::journalStat
+    JOURNAL_INVENTORY,    // target = slot, values are item codes, 0 = empty
+    JOURNAL_ENEMY_POS,    // target = enemy id, values are tile indices
+    JOURNAL_ENEMY_HEALTH,
+    JOURNAL_ENEMY_DEATH,  // target = enemy id, kept alive until evicted
+    JOURNAL_ITEM          // target = tile, field 0 = dropped (after), 1 = taken (before)
+};
+
+struct JournalEntry {
+    uint8_t kind;
+    uint8_t field;
+    int32_t target;
+    int32_t before;
+    int32_t after;
+};
+
+class DeltaJournal {
+public:
+    // Called for every entry that falls off the back of the ring
+    function<void(const JournalEntry&)> onEvict;
+
+    explicit DeltaJournal(size_t capacity = 0) : ring(capacity) {}
+
+    bool enabled() const { return !ring.empty(); }
+    size_t size() const { return (size_t)(end - begin); }
+    size_t capacity() const { return ring.size(); }
+    int turnsBack() const { return undoable; }
+    int turnsForward() const { return redoable; }
+
+    void record(JournalKind kind, int field, int target, int before, int after) {
+        if (!enabled()) return;
+        if (cursor != end) {
+            end = cursor; // a new turn after rewinding drops the old future
+            redoable = 0;
+        }
+        if (end - begin == ring.size()) {
+            evictOldestTurn();
+        }
+        JournalEntry& entry = ring[end % ring.size()];
+        entry.kind = kind;
+        entry.field = (uint8_t)field;
+        entry.target = target;
+        entry.before = before;
+        entry.after = after;
+        cursor = ++end;
+    }
+
+    void endTurn() {
+        if (!enabled()) return;
+        if (truncated) {
+            // The turn did not fit in the ring, so it cannot be undone either
+            while (begin != end) evict();
+            cursor = end;
+            truncated = false;
+            return;
+        }
+        record(JOURNAL_TURN, 0, 0, 0, 0);
+        undoable++;
+    }
+
+    // Applies one turn's entries, newest first; false if nothing is left
+    template <typename Apply>
+    bool stepBack(Apply apply) {
+        if (undoable == 0) return false;
+        uint64_t i = cursor - 1; // this turn's marker
+        while (i > begin && ring[(i - 1) % ring.size()].kind != JOURNAL_TURN) {
+            i--;
+            apply(ring[i % ring.size()], false);
+        }
+        cursor = i;
+        undoable--;
+        redoable++;
+        return true;
+    }
+
+    template <typename Apply>
+    bool stepForward(Apply apply) {
+        if (redoable == 0) return false;
+        while (ring[cursor % ring.size()].kind != JOURNAL_TURN) {
+            apply(ring[cursor % ring.size()], true);
+            cursor++;
+        }
+        cursor++;
+        undoable++;
+        redoable--;
+        return true;
+    }
+
+    void clear() {
+        while (begin != end) evict();
+        cursor = end;
+        undoable = redoable = 0;
+        truncated = false;
+    }
+
+    // Calls visit(entry) for every entry held, oldest first
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (uint64_t i = begin; i < end; i++) visit(ring[i % ring.size()]);
+    }
+
+    // Frees the ring while the game hibernates; restore() puts back what
+    // forEach() saw. Nothing may be recorded in between.
+    void release() {
+        released = ring.size();
+        vector<JournalEntry>().swap(ring);
+    }
+
+    void restore(const vector<JournalEntry>& entries) {
+        ring.resize(released);
+        for (size_t i = 0; i < entries.size(); i++) {
+            ring[(begin + i) % ring.size()] = entries[i];
+        }
+    }
+
+private:
+    vector<JournalEntry> ring;
+    size_t released = 0;                     // ring size while it is released
+    uint64_t begin = 0, cursor = 0, end = 0; // logical positions, wrapped on access
+    int undoable = 0, redoable = 0;
+    bool truncated = false;
+
+    void evict() {
+        const JournalEntry& entry = ring[begin % ring.size()];
+        if (onEvict) onEvict(entry);
+        begin++;
+    }
+
+    void evictOldestTurn() {
+        if (undoable == 0) {
+            truncated = true; // the turn in progress alone overflows the ring
+        } else {
+            undoable--;
+        }
+        while (begin != end) {
+            bool marker = ring[begin % ring.size()].kind == JOURNAL_TURN;
+            evict();
+            if (marker) break;
+        }
+        cursor = max(cursor, begin);
+    }
+};
+
+// Hibernation -----------------------------------------------------------
+// A game left waiting for a key longer than --hibernate seconds writes its
+// level out to a file and frees it: tiles, enemies, floor items, the rewind
+// journal and the message log, plus the caches built from them. The player
+// and the small per-game bookkeeping stay in memory. The next key reads the
+// file back and rebuilds the caches before the key is handled.
+
+const uint32_t HIBERNATE_MAGIC = 0x4E424948; // "HIBN"
+
+enum HibernateFlag : uint8_t {
+    HIBERNATE_ATTACKED = 1,
+    HIBERNATE_HOLDS_DISTANCE = 2,
+    HIBERNATE_REGENERATES = 4,
+    HIBERNATE_REGEN_PAUSED = 8,
+    HIBERNATE_JOURNAL_DIRTY = 16,
+    HIBERNATE_BURIED = 32        // dead, kept for the rewind journal
+};
+
+struct HibernateHeader {
+    uint32_t magic;
+    int32_t mapWidth, mapHeight;
+    uint32_t tileRuns;     // (count, tile) byte pairs, row-major
+    uint32_t enemies;      // HibernatedEnemy records, the living in turn order first
+    uint32_t enemyIds;     // size of enemyById
+    uint32_t buriedIds;    // size of buried
+    uint32_t items;        // (tile, packed item) pairs, pile order
+    uint32_t journal;      // JournalEntry records, oldest first
+    uint32_t messages;     // length-prefixed strings
+};
+
+struct HibernatedEnemy {
+    int32_t id, x, y, health, maxHealth, attack, defense, experienceValue, goldValue;
+    int32_t moveCooldown, range, reloadTime, reload, journalPos, journalHealth, overviewBlock, light;
+    uint64_t hashKey;
+    uint8_t tier;
+    char symbol;
+    uint8_t flags; // HibernateFlag bits
+};
+
+template <typename T>
+void putRaw(vector<uint8_t>& out, const T* values, size_t count) {
+    const uint8_t* bytes = (const uint8_t*)values;
+    out.insert(out.end(), bytes, bytes + sizeof(T) * count);
+}
+
+// Bounds-checked reads over a loaded file
+struct ByteReader {
+    const vector<uint8_t>& data;
+    size_t pos = 0;
+
+    template <typename T>
+    bool get(T* values, size_t count) {
+        if (data.size() - pos < sizeof(T) * count) return false;
+        memcpy(values, data.data() + pos, sizeof(T) * count);
+        pos += sizeof(T) * count;
+        return true;
+    }
+};
+
+// Game Manager
+class GameManager {
+private:
+    GameConfig config;
+    int mapWidth;
+    int mapHeight;
+    vector<vector<char>> map;
+    Player player;
+    vector<Enemy*> enemies;
+    bool gameOver;
+    vector<string> messages;
+    int maxMessages = 5;
+    int turns = 0;
+    int kills[ENEMY_KINDS] = {}; // enemies defeated this run, by kind
+    GameRng rng;                 // everything random in this game, seeded from config.seed
+    shared_ptr<TelemetryRing> telemetry; // this game's event buffer, null if telemetry is off
+    ScreenFrame screen;                  // last frame drawn
+    chrono::steady_clock::duration inputWait{0}; // time blocked in prompts, for real-time ticks
+    HANDLE consoleHandle;
+    
+    // Bitboard layers over `map`
+    Bitboard wallBits;
+    Bitboard itemBits;      // tiles with loot lying on them
+    Bitboard reachableBits; // tiles walkable from the player's start
+    Bitboard openBits;      // ~wallBits, what line of sight passes through
+    bool classicSize;       // the map is WIDTH x HEIGHT, so classicGrid is the one kept
+    TileGrid<ClassicSize> classicGrid;
+    TileGrid<RuntimeSize> sizedGrid;
+    
+    LineOfSight lineOfSight;
+    vector<int> sightQuery; // per-enemy query index for this turn, -1 if none
+    vector<Projectile> projectiles;
+    DamageBatch damageBatch;
+    vector<Enemy*> blastTargets;
+    
+    TimerWheel timers;
+    vector<TimerEvent> firedTimers;
+    uint32_t levelEpoch = 0;     // bumped on every new level, stale timers are dropped
+    vector<Enemy*> enemyById;    // this level's enemies by id, null once dead
+    
+    // Two-phase enemy turns: plans are made in parallel, then committed in id order
+    WorkerPool workers;
+    uint64_t levelSeed = 0;
+    vector<EnemyPlan> plans;
+    vector<int> occupant;        // enemy id per tile, -1 if free
+    bool enemiesHurt = false;    // set when damage was dealt, so dead ones need sweeping
+    
+    // Level-of-detail bookkeeping, see SimTier
+    bool lodEnabled;
+    vector<int> activeIds;              // TIER_ACTIVE enemy ids
+    bool activeUnsorted = false;
+    vector<Enemy*> turnEnemies;         // this turn's active enemies, in id order
+    vector<vector<int>> distantBuckets; // TIER_DISTANT ids, bucket = id % DISTANT_INTERVAL
+    vector<vector<int>> dormantBlocks;  // TIER_DORMANT ids per LOD_BLOCK square
+    vector<BlockSummary> overview;      // per OVERVIEW_BLOCK square, for the map overview
+    LightMap lights;
+    int torchLight = -1;                // the player's torch in `lights`
+    bool playerLit = true;              // whether the player stood in light this enemy turn
+    vector<array<int, 3>> roomLights;   // x, y, radius of the lit rooms generateLayout made
+    int overviewBlocksX = 0;
+    int overviewScale = 0;              // 0 = normal view, else tiles per overview cell
+    int blocksX = 0;
+    int lastPlayerBlock = -1;
+    vector<int> flowDistance;           // BFS steps to the player, window around flowX/flowY
+    int flowX = 0, flowY = 0, flowTurn = 0;
+    uint32_t flowEpoch = 0;
+    
+    // Incremental Zobrist hash of tiles, player, and enemies
+    static const int HASHED_STATS = 13;
+    uint64_t stateHash = 0;
+    int hashedStats[HASHED_STATS] = {};
+    int hashedPlayerX = 0, hashedPlayerY = 0;
+    
+    // Level layout: how far apart the objectives start out, and the rerolls
+    // allowed before that is halved
+    static const int OBJECTIVE_SPREAD = 14;
+    static const int LAYOUT_ATTEMPTS = 50;
+    int failedLevel = 0; // the level that could not be laid out, if any
+    GameMemory heapUsage; // what this game holds, for its memory budgets
+    
+    FloorItems floorItems;
+    int standingTile = -1;  // where the player ended last turn; loot is picked up on arrival
+    
+    SearchBot bot;
+    vector<int> goalDistance; // per tile, BFS steps to something the bot wants
+    vector<int> gridDistance; // per tile grid cell, scratch for walkDistances
+    
+    // Rewind journal and the state it was last brought up to date with
+    static const int JOURNAL_STATS = 16 + ENEMY_KINDS;
+    DeltaJournal journal;
+    bool replaying = false;         // applying journal entries, don't record them
+    vector<Enemy*> buried;          // by id, dead enemies the journal can still revive
+    vector<int> journalTouched;     // ids of enemies changed this turn
+    int journalStats[JOURNAL_STATS] = {};
+    vector<int> journalInventory;   // item code per inventory slot
+    
+    // Event bus subscribers, in the order each turn's events reach them.
+    // Score comes first so the later ones see this turn's kills and gold.
+    struct ScoreKeeper {
+        GameManager& game;
+        void handle(const GameEvent* events, size_t count) {
+            Player& player = game.player;
+            for (size_t i = 0; i < count; i++) {
+                const GameEvent& event = events[i];
+                if (event.type == EVENT_KILL) {
+                    game.kills[event.subject]++;
+                    player.gainExperience(event.value);
+                    player.gold += event.extra;
+                    player.score += event.value * 10;
+                } else if (event.type == EVENT_PICKUP && event.subject == LOOT_GOLD) {
+                    player.gold += event.value;
+                    player.score += event.value;
+                } else if (event.type == EVENT_DOOR) {
+                    player.score += event.value;
+                }
+            }
+        }
+    };
+    
+    // Turns events into lines in the message log; a run of kills from one
+    // blow is summarised in a single line
+    struct MessageLog {
+        GameManager& game;
+        void handle(const GameEvent* events, size_t count) {
+            MemoryScope scope(MEM_MESSAGES);
+            for (size_t i = 0; i < count; i++) {
+                const GameEvent& event = events[i];
+                string name = ENEMY_NAMES[event.subject % ENEMY_KINDS];
+                switch (event.type) {
+                    case EVENT_PLAYER_HIT:
+                        if (event.flags & EVENT_THROWN) {
+                            game.addMessage("Your knife hits the " + name + " for " + to_string(event.value) + " damage!");
+                        } else if (event.flags & EVENT_CRITICAL) {
+                            game.addMessage("Critical hit! You strike the " + name + " for " + to_string(event.value) + " damage!");
+                        } else {
+                            game.addMessage("You hit the " + name + " for " + to_string(event.value) + " damage!");
+                        }
+                        break;
+                    case EVENT_ENEMY_HIT:
+                        if (event.flags & EVENT_RANGED) {
+                            game.addMessage("The " + name + " " + ENEMY_RANGED_VERBS[event.subject % ENEMY_KINDS] +
+                                            " you for " + to_string(event.value) + " damage!");
+                        } else {
+                            game.addMessage("The " + name + " attacks you for " + to_string(event.value) + " damage!");
+                        }
+                        break;
+                    case EVENT_SPELL:
+                        game.addMessage("You cast " + string(SPELLS[event.subject].name) + "! It hits " + to_string(event.value) +
+                                        (event.value == 1 ? " enemy." : " enemies."));
+                        break;
+                    case EVENT_KILL:
+                        {
+                            int killed = 0, exp = 0, gold = 0;
+                            for (; i < count && events[i].type == EVENT_KILL; i++) {
+                                killed++;
+                                exp += events[i].value;
+                                gold += events[i].extra;
+                            }
+                            i--;
+                            game.addMessage((killed == 1 ? "You defeated the " + name + "!" :
+                                             "You defeated " + to_string(killed) + " enemies!") +
+                                            " Gained " + to_string(exp) + " XP and " + to_string(gold) + " gold.");
+                        }
+                        break;
+                    case EVENT_PICKUP:
+                        if (event.subject == LOOT_KEY) {
+                            game.addMessage("You picked up the key!");
+                        } else if (event.subject == LOOT_GOLD) {
+                            game.addMessage("You found " + to_string(event.value) + " gold!");
+                        } else if (event.subject == LOOT_POTION) {
+                            game.addMessage(event.variant == 1 ? "You found a haste potion!" :
+                                            event.variant == 2 ? "You found a regeneration potion!" :
+                                            "You found a health potion!");
+                        }
+                        break;
+                    case EVENT_TRAP:
+                        game.addMessage(event.subject == 0 ? "You stepped on a spike trap! Took " + to_string(event.value) + " damage!" :
+                                        event.subject == 1 ? string("You triggered a poison gas trap! You are poisoned!") :
+                                        string("You triggered an alarm! Nearby enemies are alerted!"));
+                        break;
+                    case EVENT_LEVEL:
+                        game.addMessage("Welcome to dungeon level " + to_string(event.value) + "!");
+                        break;
+                    case EVENT_DOOR:
+                        game.addMessage(event.subject == 0 ? "You unlocked the door! +" + to_string(event.value) + " score points!" :
+                                        string("The door is locked. You need a key!"));
+                        break;
+                    case EVENT_MISS:
+                        game.addMessage("You swing at nothing!");
+                        break;
+                }
+            }
+        }
+    };
+    
+    // Every melee hit wears the equipped weapon down; thrown knives don't
+    struct WeaponWear {
+        GameManager& game;
+        void handle(const GameEvent* events, size_t count) {
+            MemoryScope scope(MEM_ITEMS);
+            Player& player = game.player;
+            for (size_t i = 0; i < count; i++) {
+                if (events[i].type != EVENT_PLAYER_HIT || (events[i].flags & EVENT_THROWN)) continue;
+                if (player.equippedWeapon && player.equippedWeapon->durability > 0) {
+                    player.equippedWeapon->durability--;
+                    if (player.equippedWeapon->durability <= 0) {
+                        game.addMessage("Your " + player.equippedWeapon->name + " broke!");
+                        delete player.equippedWeapon;
+                        player.equippedWeapon = new Weapon("Fists", 3, -1); // -1 for infinite durability
+                    }
+                }
+            }
+        }
+    };
+    
+    // One-off milestones for the run, announced in the message log
+    enum Achievement {
+        ACH_FIRST_BLOOD, ACH_SLIME_BANE, ACH_TROLL_HUNTER, ACH_CENTURION,
+        ACH_CROWD_CONTROL, ACH_DEEP_DELVER, ACH_TREASURE_HUNTER, ACHIEVEMENTS
+    };
+    struct Achievements {
+        GameManager& game;
+        uint32_t unlocked = 0; // bit per Achievement
+        
+        void handle(const GameEvent* events, size_t count) {
+            const int* kills = game.kills;
+            for (size_t i = 0; i < count; i++) {
+                const GameEvent& event = events[i];
+                switch (event.type) {
+                    case EVENT_KILL:
+                        {
+                            int total = 0;
+                            for (int k = 0; k < ENEMY_KINDS; k++) total += kills[k];
+                            unlock(ACH_FIRST_BLOOD, "First Blood");
+                            if (kills[KIND_SLIME] >= 25) unlock(ACH_SLIME_BANE, "Slime Bane (25 slimes)");
+                            if (kills[KIND_TROLL] + kills[KIND_THROWER] >= 5) unlock(ACH_TROLL_HUNTER, "Troll Hunter (5 trolls)");
+                            if (total >= 100) unlock(ACH_CENTURION, "Centurion (100 kills)");
+                        }
+                        break;
+                    case EVENT_SPELL:
+                        if (event.value >= 3) unlock(ACH_CROWD_CONTROL, "Crowd Control (one spell, 3 enemies)");
+                        break;
+                    case EVENT_LEVEL:
+                        if (event.value >= 5) unlock(ACH_DEEP_DELVER, "Deep Delver (dungeon level 5)");
+                        break;
+                    case EVENT_PICKUP:
+                        if (game.player.gold >= 500) unlock(ACH_TREASURE_HUNTER, "Treasure Hunter (500 gold)");
+                        break;
+                }
+            }
+        }
+        
+        void unlock(Achievement achievement, const char* name) {
+            if (unlocked & (1u << achievement)) return;
+            unlocked |= 1u << achievement;
+            game.addMessage(string("Achievement unlocked: ") + name + "!");
+        }
+    };
+    
+    // Passes events through to the telemetry session, if there is one
+    struct TelemetryFeed {
+        GameManager& game;
+        void handle(const GameEvent* events, size_t count) {
+            if (!game.telemetry) return;
+            for (size_t i = 0; i < count; i++) {
+                game.logEvent((TelemetryType)events[i].type, events[i].subject, events[i].x, events[i].y, events[i].value);
+            }
+        }
+    };
+    
+    // At most one system sound per turn, for the most important event in it
+    struct SoundCues {
+        GameManager& game;
+        void handle(const GameEvent* events, size_t count) {
+            if (!game.config.sound || game.config.headless) return;
+            int cue = -1;
+            for (size_t i = 0; i < count; i++) {
+                switch (events[i].type) {
+                    case EVENT_DEATH: cue = max(cue, 3); break;
+                    case EVENT_LEVEL: cue = max(cue, 2); break;
+                    case EVENT_ENEMY_HIT:
+                    case EVENT_TRAP: cue = max(cue, 1); break;
+                    case EVENT_KILL: cue = max(cue, 0); break;
+                }
+            }
+            static const UINT SOUNDS[4] = { MB_OK, MB_ICONASTERISK, MB_ICONEXCLAMATION, MB_ICONHAND };
+            if (cue >= 0) MessageBeep(SOUNDS[cue]);
+        }
+    };
+    
+    ScoreKeeper scoreKeeper{*this};
+    MessageLog messageLog{*this};
+    WeaponWear weaponWear{*this};
+    Achievements achievements{*this};
+    TelemetryFeed telemetryFeed{*this};
+    SoundCues soundCues{*this};
+    EventBus<ScoreKeeper, MessageLog, WeaponWear, Achievements, TelemetryFeed, SoundCues> events{
+        scoreKeeper, messageLog, weaponWear, achievements, telemetryFeed, soundCues };
+
+public:
+    GameManager(const GameConfig& cfg = GameConfig())
+        : config(cfg), mapWidth(max(cfg.mapWidth, WIDTH)), mapHeight(max(cfg.mapHeight, HEIGHT)),
+          player(1, 1), gameOver(false), workers(cfg.threads), journal(max(cfg.rewind, 0)) {
+        GameMemoryScope tally(&heapUsage);
+        bot.iterations = cfg.botIterations;
+        if (cfg.telemetry) telemetry = cfg.telemetry->openSession();
+        if (cfg.metrics) cfg.metrics->sessionStarted();
+        journal.onEvict = [this](const JournalEntry& entry) {
+            if (entry.kind == JOURNAL_ENEMY_DEATH && buried[entry.target]) {
+                delete buried[entry.target];
+                buried[entry.target] = nullptr;
+            }
+        };
+        lodEnabled = mapWidth * mapHeight > WIDTH * HEIGHT;
+        classicSize = mapWidth == WIDTH && mapHeight == HEIGHT;
+        consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+        rng.reseed(cfg.seed ? cfg.seed : (uint64_t)time(0)); // Initialize random seed
+        
+        // Slow natural regeneration of health and mana
+        TimerEvent regen;
+        regen.kind = TIMER_PLAYER_REGEN;
+        regen.amount = 1;
+        regen.period = 10;
+        timers.schedule(regen.period, regen);
+        regen.kind = TIMER_MANA_REGEN;
+        regen.period = 2;
+        timers.schedule(regen.period, regen);
+        
+        if (!initializeMap(max(1, cfg.startLevel))) gameOver = true;
+        flushEvents();
+    }
+    
+    ~GameManager() {
+        GameMemoryScope tally(&heapUsage);
+        for (auto enemy : enemies) {
+            delete enemy;
+        }
+        journal.clear();
+        if (telemetry) telemetry->closed.store(true, memory_order_release);
+        if (config.metrics) config.metrics->sessionEnded();
+    }
+
+    // False if the level could not be laid out; see layoutError
+    bool initializeMap(int dungeonLevel) {
+        flushEvents(); // the old level's rewards and messages land before it is reset
+        MetricsTimer timer(config.metrics, METRIC_LEVEL);
+        MemoryScope scope(MEM_LEVEL_CACHE);
         player.dungeonLevel = dungeonLevel;
         
-        // Clear previous map and enemies
-        map = vector<vector<char>>(HEIGHT, vector<char>(WIDTH, FLOOR));
-        for (auto enemy : enemies) {
-            delete enemy;
+        // Clear previous enemies
+        for (auto enemy : enemies) {
+            delete enemy;
+        }
+        enemies.clear();
+        enemyById.clear();
+        occupant.assign((size_t)mapWidth * mapHeight, -1);
+        activeIds.clear();
+        distantBuckets.assign(DISTANT_INTERVAL, vector<int>());
+        blocksX = (mapWidth + LOD_BLOCK - 1) / LOD_BLOCK;
+        dormantBlocks.assign((size_t)blocksX * ((mapHeight + LOD_BLOCK - 1) / LOD_BLOCK), vector<int>());
+        lastPlayerBlock = -1;
+        overviewBlocksX = (mapWidth + OVERVIEW_BLOCK - 1) / OVERVIEW_BLOCK;
+        overview.assign((size_t)overviewBlocksX * ((mapHeight + OVERVIEW_BLOCK - 1) / OVERVIEW_BLOCK), BlockSummary());
+        lights.reset(mapWidth, mapHeight, &openBits);
+        levelEpoch++;
+        levelSeed = ((uint64_t)rng.next() << 32) ^ (uint64_t)rng.next() ^ ((uint64_t)dungeonLevel << 48);
+        
+        // Reroll the layout until the key, door, and stairs all fit somewhere
+        // reachable. A map that keeps walling the player in gets its
+        // objectives spread less far apart, then gives up.
+        int spread = OBJECTIVE_SPREAD;
+        for (int attempt = 1; !generateLayout(dungeonLevel, spread); attempt++) {
+            if (attempt % LAYOUT_ATTEMPTS != 0) continue;
+            if (spread == 0) {
+                failedLevel = dungeonLevel;
+                return false;
+            }
+            spread /= 2;
+        }
+        for (const auto& room : roomLights) {
+            lights.add(room[0], room[1], room[2], ROOM_LIGHT);
+        }
+        torchLight = lights.add(player.x, player.y, TORCH_RADIUS, player.torchLit ? TORCH_LIGHT : 0);
+        
+        // Place items
+        placeItems();
+        
+        // Spawn enemies appropriate to level
+        spawnEnemies(dungeonLevel);
+        
+        rebuildBitboards();
+        
+        projectiles.clear();
+        standingTile = -1;
+        
+        // Reset key if changing levels
+        if (dungeonLevel > 1) {
+            player.hasKey = false;
+        }
+        
+        resetStateHash();
+        resetJournal();
+        exploreAround();
+        publish(EVENT_LEVEL, 0, player.x, player.y, dungeonLevel);
+        return true;
+    }
+
+    // Builds walls, rooms, the player start, key, door, and stairs.
+    // Returns false if the objectives could not be placed reachably.
+    // Objectives keep `spread` steps (Manhattan) from the player and the
+    // door from the key; false if they don't fit
+    bool generateLayout(int dungeonLevel, int spread) {
+        {
+            MemoryScope scope(MEM_MAP);
+            map = vector<vector<char>>(mapHeight, vector<char>(mapWidth, FLOOR));
+        }
+        floorItems.clear();
+        itemBits = Bitboard(mapWidth, mapHeight);
+        roomLights.clear();
+        vector<int> roomLoot; // tiles for room loot, placed once later rooms can't wall them over
+        
+        // Create walls around the edges
+        for (int i = 0; i < mapWidth; i++) {
+            map[0][i] = WALL;
+            map[mapHeight-1][i] = WALL;
+        }
+        for (int i = 0; i < mapHeight; i++) {
+            map[i][0] = WALL;
+            map[i][mapWidth-1] = WALL;
+        }
+        
+        // Generate interior walls based on dungeon level; bigger maps get more of everything
+        int numWalls = (10 + dungeonLevel * 2) * areaScale();
+        for (int i = 0; i < numWalls; i++) {
+            int wallLength = 5 + rng.next() % 10;
+            int startX = 2 + rng.next() % (mapWidth - 4);
+            int startY = 2 + rng.next() % (mapHeight - 4);
+            int direction = rng.next() % 2; // 0 for horizontal, 1 for vertical
+            
+            for (int j = 0; j < wallLength; j++) {
+                int x = startX + (direction == 0 ? j : 0);
+                int y = startY + (direction == 1 ? j : 0);
+                if (x < mapWidth - 1 && y < mapHeight - 1) {
+                    map[y][x] = WALL;
+                }
+            }
+            
+            // Create openings/doorways
+            if (wallLength > 3 && wallLength < 10) {
+                int doorPosition = rng.next() % wallLength;
+                int x = startX + (direction == 0 ? doorPosition : 0);
+                int y = startY + (direction == 1 ? doorPosition : 0);
+                if (x < mapWidth - 1 && y < mapHeight - 1) {
+                    map[y][x] = FLOOR;
+                }
+            }
+        }
+        
+        // Create some rooms
+        int numRooms = (3 + dungeonLevel) * areaScale();
+        for (int i = 0; i < numRooms; i++) {
+            int roomWidth = 5 + rng.next() % 8;
+            int roomHeight = 5 + rng.next() % 5;
+            int startX = 2 + rng.next() % (mapWidth - roomWidth - 2);
+            int startY = 2 + rng.next() % (mapHeight - roomHeight - 2);
+            
+            // Clear room area
+            for (int y = startY; y < startY + roomHeight; y++) {
+                for (int x = startX; x < startX + roomWidth; x++) {
+                    if (x < mapWidth - 1 && y < mapHeight - 1 && x > 0 && y > 0) {
+                        map[y][x] = FLOOR;
+                    }
+                }
+            }
+            
+            // Create walls around room
+            for (int y = startY; y < startY + roomHeight; y++) {
+                if (y < mapHeight - 1 && y > 0) {
+                    map[y][startX] = WALL;
+                    map[y][startX + roomWidth - 1] = WALL;
+                }
+            }
+            for (int x = startX; x < startX + roomWidth; x++) {
+                if (x < mapWidth - 1 && x > 0) {
+                    map[startY][x] = WALL;
+                    map[startY + roomHeight - 1][x] = WALL;
+                }
+            }
+            
+            // Add doors
+            int doorSide = rng.next() % 4;
+            int doorPos;
+            switch (doorSide) {
+                case 0: // North
+                    doorPos = startX + 1 + rng.next() % (roomWidth - 2);
+                    map[startY][doorPos] = FLOOR;
+                    break;
+                case 1: // East
+                    doorPos = startY + 1 + rng.next() % (roomHeight - 2);
+                    map[doorPos][startX + roomWidth - 1] = FLOOR;
+                    break;
+                case 2: // South
+                    doorPos = startX + 1 + rng.next() % (roomWidth - 2);
+                    map[startY + roomHeight - 1][doorPos] = FLOOR;
+                    break;
+                case 3: // West
+                    doorPos = startY + 1 + rng.next() % (roomHeight - 2);
+                    map[doorPos][startX] = FLOOR;
+                    break;
+            }
+            
+            // About half the rooms are lit; decided without the rng so a seed keeps its layout
+            if (zobristKey(levelSeed, i, 0) & 1) {
+                roomLights.push_back({ startX + roomWidth / 2, startY + roomHeight / 2, max(roomWidth, roomHeight) / 2 + 1 });
+            }
+            
+            // Add some items in the room
+            if (rng.next() % 3 == 0) {
+                int itemX = startX + 1 + rng.next() % (roomWidth - 2);
+                int itemY = startY + 1 + rng.next() % (roomHeight - 2);
+                roomLoot.push_back(itemY * mapWidth + itemX);
+            }
+        }
+        
+        for (int tile : roomLoot) {
+            if (map[tile / mapWidth][tile % mapWidth] == WALL) continue;
+            placeLoot(tile % mapWidth, tile / mapWidth, rollLoot(rng.next() % 2 == 0 ? LOOT_POTION : LOOT_GOLD));
+        }
+        
+        // Place player in a safe spot
+        Bitboard startArea(mapWidth, mapHeight);
+        for (int y = 2; y <= 6; y++) {
+            startArea.setSpan(y, 2, 6);
+        }
+        if (!pickRandomTile(tileMask(FLOOR) & startArea, player.x, player.y)) {
+            player.x = 2 + rng.next() % 5;
+            player.y = 2 + rng.next() % 5;
+            map[player.y][player.x] = FLOOR;
+        }
+        
+        wallBits = tileMask(WALL);
+        reachableBits = Bitboard::floodFill(player.x, player.y, ~wallBits);
+        
+        // Objectives go in the inner window, on floor the player can walk to
+        Bitboard window(mapWidth, mapHeight);
+        for (int y = 5; y < mapHeight - 5; y++) {
+            window.setSpan(y, 5, mapWidth - 6);
+        }
+        Bitboard open = tileMask(FLOOR) & window & reachableBits;
+        Bitboard nearPlayer = Bitboard::diamond(mapWidth, mapHeight, player.x, player.y, spread);
+        
+        // Place key, must be far from player
+        int keyX, keyY;
+        if (!pickRandomTile(Bitboard(open).andNot(nearPlayer), keyX, keyY)) return false;
+        FloorItem key;
+        key.kind = LOOT_KEY;
+        placeLoot(keyX, keyY, key);
+        open.reset(keyX, keyY);
+        
+        // Place door, must be far from both player and key
+        int doorX, doorY;
+        Bitboard nearKey = Bitboard::diamond(mapWidth, mapHeight, keyX, keyY, spread);
+        if (!pickRandomTile(Bitboard(open).andNot(nearPlayer).andNot(nearKey), doorX, doorY)) return false;
+        map[doorY][doorX] = DOOR;
+        open.reset(doorX, doorY);
+        
+        // Place stairs to next level
+        if (dungeonLevel < 5) {
+            int stairsX, stairsY;
+            if (!pickRandomTile(Bitboard(open).andNot(nearPlayer), stairsX, stairsY)) return false;
+            map[stairsY][stairsX] = STAIRS;
+        }
+        return true;
+    }
+
+    void placeItems() {
+        int scale = areaScale();
+        
+        // Health potions
+        scatterLoot(LOOT_POTION, (3 + rng.next() % 3) * scale);
+        
+        // Gold
+        scatterLoot(LOOT_GOLD, (5 + rng.next() % 5) * scale);
+        
+        // Weapons
+        scatterLoot(LOOT_WEAPON, (1 + player.dungeonLevel / 2) * scale);
+        
+        // Armor
+        scatterLoot(LOOT_ARMOR, (player.dungeonLevel / 2) * scale);
+        
+        // Traps
+        scatterTiles(TRAP, (2 + player.dungeonLevel) * scale, 4);
+    }
+    
+    // How many classic-size maps fit in this one
+    int areaScale() const {
+        return max(1, (mapWidth * mapHeight) / (WIDTH * HEIGHT));
+    }
+    
+    // Put `count` copies of a tile on reachable floor, keeping `minDistance`
+    // (Manhattan) from the player
+    void scatterTiles(char tile, int count, int minDistance) {
+        Bitboard open = tileMask(FLOOR) & reachableBits;
+        open.andNot(Bitboard::diamond(mapWidth, mapHeight, player.x, player.y, minDistance));
+        open.reset(player.x, player.y);
+        for (int i = 0; i < count; i++) {
+            int x, y;
+            if (!pickRandomTile(open, x, y)) break;
+            map[y][x] = tile;
+            open.reset(x, y);
+        }
+    }
+
+    // Like scatterTiles, but into the loot layer, one item per free tile
+    void scatterLoot(LootKind kind, int count) {
+        Bitboard open = tileMask(FLOOR) & reachableBits;
+        open.andNot(itemBits);
+        open.reset(player.x, player.y);
+        for (int i = 0; i < count && withinBudget(MEM_ITEMS); i++) {
+            int x, y;
+            if (!pickRandomTile(open, x, y)) break;
+            placeLoot(x, y, rollLoot(kind));
+            open.reset(x, y);
+        }
+    }
+    
+    // Generation-time placement; the hash and journal are set up afterwards
+    void placeLoot(int x, int y, const FloorItem& item) {
+        MemoryScope scope(MEM_ITEMS);
+        floorItems.push(y * mapWidth + x, item);
+        itemBits.set(x, y);
+    }
+    
+    // A new item of the given kind with stats for the current dungeon level
+    FloorItem rollLoot(LootKind kind) {
+        FloorItem item;
+        item.kind = kind;
+        int level = player.dungeonLevel;
+        switch (kind) {
+            case LOOT_POTION:
+                // Now and then it is something rarer
+                switch (rng.next() % 8) {
+                    case 0: item.variant = 1; break;
+                    case 1: item.variant = 2; break;
+                    default: item.amount = 20 + rng.next() % 21; // 20-40 healing
+                }
+                break;
+            case LOOT_GOLD:
+                item.amount = 5 + rng.next() % (10 * level);
+                break;
+            case LOOT_WEAPON:
+                {
+                    int type = rng.next() % 5;
+                    int quality = rng.next() % 4;
+                    item.variant = type * 4 + quality;
+                    item.amount = WEAPON_DAMAGE[type] + level * 2 + (quality - 1) * 2;
+                    item.durability = WEAPON_DURABILITY[type] + level * WEAPON_WEAR[type] + (quality == 3 ? 10 : 0);
+                }
+                break;
+            case LOOT_ARMOR:
+                {
+                    int type = rng.next() % 4;
+                    int quality = rng.next() % 4;
+                    item.variant = type * 4 + quality;
+                    item.amount = ARMOR_DEFENSE[type] + level + (quality - 1);
+                }
+                break;
+            default:
+                break;
+        }
+        return item;
+    }
+    
+    // What a defeated enemy leaves behind, if anything
+    bool rollDrop(const Enemy* enemy, FloorItem& item) {
+        if (!dynamic_cast<const Troll*>(enemy) && rng.next() % 4 != 0) return false;
+        int roll = rng.next() % 10;
+        item = rollLoot(roll < 5 ? LOOT_GOLD : roll < 8 ? LOOT_POTION : roll < 9 ? LOOT_WEAPON : LOOT_ARMOR);
+        return true;
+    }
+    
+    void spawnEnemies(int dungeonLevel) {
+        MemoryScope scope(MEM_ENEMIES);
+        // Number of enemies scales with dungeon level and map size;
+        // swarm levels add a horde of slimes and goblins on top
+        int scale = areaScale();
+        int numSlimes = (4 + dungeonLevel) * scale + config.swarm * 2 / 3;
+        int numGoblins = (2 + dungeonLevel) * scale + config.swarm / 3;
+        int numTrolls = (dungeonLevel / 2) * scale;
+        int numArchers = (dungeonLevel - 1) * scale;
+        int numThrowers = ((dungeonLevel - 1) / 2) * scale;
+        
+        // Enemies start on free reachable floor at least 10 steps from the player
+        Bitboard spawnable = tileMask(FLOOR) & reachableBits;
+        spawnable.andNot(Bitboard::diamond(mapWidth, mapHeight, player.x, player.y, 9));
+        int x, y;
+        
+        // Spawn slimes
+        for (int i = 0; i < numSlimes && withinBudget(MEM_ENEMIES) && takeSpawnTile(spawnable, x, y); i++) {
+            addEnemy(new Slime(x, y));
+        }
+        
+        // Spawn goblins
+        for (int i = 0; i < numGoblins && withinBudget(MEM_ENEMIES) && takeSpawnTile(spawnable, x, y); i++) {
+            addEnemy(new Goblin(x, y));
+        }
+        
+        // Spawn trolls
+        for (int i = 0; i < numTrolls && withinBudget(MEM_ENEMIES) && takeSpawnTile(spawnable, x, y); i++) {
+            addEnemy(new Troll(x, y));
+        }
+        
+        // Spawn ranged enemies from level 2 onwards
+        for (int i = 0; i < numArchers && withinBudget(MEM_ENEMIES) && takeSpawnTile(spawnable, x, y); i++) {
+            addEnemy(new GoblinArcher(x, y));
+        }
+        for (int i = 0; i < numThrowers && withinBudget(MEM_ENEMIES) && takeSpawnTile(spawnable, x, y); i++) {
+            addEnemy(new BoulderTroll(x, y));
+        }
+    }
+    
+    void addEnemy(Enemy* enemy) {
+        enemy->id = (int)enemyById.size();
+        enemyById.push_back(enemy);
+        enemies.push_back(enemy);
+        occupant[enemy->y * mapWidth + enemy->x] = enemy->id;
+        if (enemy->symbol == SLIME) enemy->light = lights.add(enemy->x, enemy->y, SLIME_GLOW_RADIUS, SLIME_GLOW);
+        rehashEnemy(enemy);
+        assignTier(enemy);
+        if (enemy->regenerates) {
+            scheduleRegeneration(enemy);
+        }
+    }
+    
+    void scheduleRegeneration(Enemy* enemy) {
+        TimerEvent regen;
+        regen.kind = TIMER_ENEMY_REGEN;
+        regen.epoch = levelEpoch;
+        regen.target = enemy->id;
+        regen.amount = 2;
+        regen.period = 4;
+        timers.schedule(regen.period, regen);
+    }
+    
+    bool takeSpawnTile(Bitboard& spawnable, int& x, int& y) {
+        if (!pickRandomTile(spawnable, x, y)) return false;
+        spawnable.reset(x, y);
+        return true;
+    }
+    
+    // Uniformly pick one set tile of `candidates`
+    bool pickRandomTile(const Bitboard& candidates, int& x, int& y) {
+        int n = candidates.count();
+        if (n == 0) return false;
+        return candidates.nthSet(rng.next() % n, x, y);
+    }
+    
+    Bitboard tileMask(char tile) const {
+        Bitboard mask(mapWidth, mapHeight);
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; x++) {
+                if (map[y][x] == tile) mask.set(x, y);
+            }
+        }
+        return mask;
+    }
+    
+    void rebuildBitboards() {
+        MemoryScope scope(MEM_LEVEL_CACHE);
+        wallBits = tileMask(WALL);
+        openBits = ~wallBits;
+        if (classicSize) classicGrid.load(map);
+        else sizedGrid.load(map);
+    }
+    
+    // Runs kernel(grid) on whichever tile grid this map size keeps
+    template <class Kernel>
+    void withGrid(Kernel kernel) {
+        if (classicSize) kernel(classicGrid);
+        else kernel(sizedGrid);
+    }
+    
+    // All map writes after generation go through here to keep the layers in sync
+    void setTile(int x, int y, char tile) {
+        if (!replaying) journal.record(JOURNAL_TILE, 0, y * mapWidth + x, map[y][x], tile);
+        stateHash ^= tileKey(x, y, map[y][x]) ^ tileKey(x, y, tile);
+        if ((map[y][x] == WALL) != (tile == WALL)) lights.wallsChanged(x, y);
+        map[y][x] = tile;
+        if (classicSize) classicGrid.set(x, y, tile);
+        else sizedGrid.set(x, y, tile);
+        wallBits.assign(x, y, tile == WALL);
+        openBits.assign(x, y, tile != WALL);
+        overview[overviewBlockOf(x, y)].dirty = true;
+    }
+    
+    // Loot changes after generation go through these two, for the same reason
+    void dropItem(int tile, const FloorItem& item) {
+        MemoryScope scope(MEM_ITEMS);
+        floorItems.push(tile, item);
+        itemBits.set(tile % mapWidth, tile / mapWidth);
+        overview[overviewBlockOf(tile % mapWidth, tile / mapWidth)].dirty = true;
+        stateHash ^= lootKey(tile, item);
+        if (!replaying) journal.record(JOURNAL_ITEM, 0, tile, 0, (int)item.pack());
+    }
+    
+    FloorItem takeItem(int tile, int node) {
+        FloorItem item = floorItems.remove(tile, node);
+        if (floorItems.head(tile) < 0) itemBits.reset(tile % mapWidth, tile / mapWidth);
+        overview[overviewBlockOf(tile % mapWidth, tile / mapWidth)].dirty = true;
+        stateHash ^= lootKey(tile, item);
+        if (!replaying) journal.record(JOURNAL_ITEM, 1, tile, (int)item.pack(), 0);
+        return item;
+    }
+    
+    uint64_t lootKey(int tile, const FloorItem& item) const {
+        return zobristKey(HASH_ITEM, tile, item.pack());
+    }
+    
+    uint64_t tileKey(int x, int y, char tile) const {
+        return tile == FLOOR ? 0 : zobristKey(HASH_TILE, (uint64_t)y * mapWidth + x, (uint8_t)tile);
+    }
+    
+    uint64_t enemyKey(const Enemy* enemy) const {
+        return zobristKey(HASH_ENEMY_POS, enemy->id, (uint64_t)enemy->y * mapWidth + enemy->x) ^
+               zobristKey(HASH_ENEMY_HEALTH, enemy->id, (uint32_t)enemy->health);
+    }
+    
+    void playerStats(int stats[HASHED_STATS]) const {
+        stats[0] = player.health;
+        stats[1] = player.maxHealth;
+        stats[2] = player.attack;
+        stats[3] = player.defense;
+        stats[4] = player.mana;
+        stats[5] = player.maxMana;
+        stats[6] = player.gold;
+        stats[7] = player.score;
+        stats[8] = player.level;
+        stats[9] = player.experience;
+        stats[10] = player.hasKey;
+        stats[11] = player.dungeonLevel;
+        stats[12] = player.torchLit;
+    }
+    
+    // Call after an enemy moved or its health changed
+    void rehashEnemy(Enemy* enemy) {
+        stateHash ^= enemy->hashKey;
+        enemy->hashKey = enemyKey(enemy);
+        stateHash ^= enemy->hashKey;
+        int block = overviewBlockOf(enemy->x, enemy->y);
+        if (block != enemy->overviewBlock) {
+            if (enemy->overviewBlock >= 0) overview[enemy->overviewBlock].enemies--;
+            overview[block].enemies++;
+            enemy->overviewBlock = block;
+        }
+        if (enemy->light >= 0) lights.move(enemy->light, enemy->x, enemy->y);
+        if (!enemy->journalDirty && !replaying && journal.enabled()) {
+            enemy->journalDirty = true;
+            journalTouched.push_back(enemy->id);
+        }
+    }
+    
+    void rehashPlayerPosition() {
+        stateHash ^= zobristKey(HASH_PLAYER_POS, hashedPlayerX, hashedPlayerY);
+        hashedPlayerX = player.x;
+        hashedPlayerY = player.y;
+        stateHash ^= zobristKey(HASH_PLAYER_POS, hashedPlayerX, hashedPlayerY);
+    }
+    
+    // Player stats are touched in too many places to hook each one, so they
+    // are diffed against the last hashed values; only changed stats cost work
+    void rehashPlayer() {
+        rehashPlayerPosition();
+        int stats[HASHED_STATS];
+        playerStats(stats);
+        for (int i = 0; i < HASHED_STATS; i++) {
+            if (stats[i] == hashedStats[i]) continue;
+            stateHash ^= zobristKey(HASH_PLAYER_STAT, i, (uint32_t)hashedStats[i]);
+            stateHash ^= zobristKey(HASH_PLAYER_STAT, i, (uint32_t)stats[i]);
+            hashedStats[i] = stats[i];
+        }
+    }
+    
+    // Full recompute, used when a level is built and to check the running hash
+    uint64_t computeStateHash() const {
+        uint64_t h = 0;
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; x++) {
+                h ^= tileKey(x, y, map[y][x]);
+            }
+        }
+        h ^= zobristKey(HASH_PLAYER_POS, player.x, player.y);
+        int stats[HASHED_STATS];
+        playerStats(stats);
+        for (int i = 0; i < HASHED_STATS; i++) {
+            h ^= zobristKey(HASH_PLAYER_STAT, i, (uint32_t)stats[i]);
+        }
+        for (auto enemy : enemies) {
+            h ^= enemyKey(enemy);
+        }
+        floorItems.forEach([&](int tile, const FloorItem& item) { h ^= lootKey(tile, item); });
+        return h;
+    }
+    
+    void resetStateHash() {
+        for (auto enemy : enemies) {
+            enemy->hashKey = enemyKey(enemy);
+        }
+        hashedPlayerX = player.x;
+        hashedPlayerY = player.y;
+        playerStats(hashedStats);
+        stateHash = computeStateHash();
+    }
+    
+    void movePlayer(int dx, int dy) {
+        withGrid([&](const auto& grid) { player.move(dx, dy, grid); });
+        rehashPlayerPosition();
+    }
+    
+    bool isEnemyAt(int x, int y) const {
+        if (x < 0 || x >= mapWidth || y < 0 || y >= mapHeight) return false;
+        return occupant[y * mapWidth + x] >= 0;
+    }
+    
+    Enemy* getEnemyAt(int x, int y) {
+        if (!isEnemyAt(x, y)) return nullptr;
+        return enemyById[occupant[y * mapWidth + x]];
+    }
+
+    void setConsoleColor(Color textColor, Color bgColor = BLACK) {
+        SetConsoleTextAttribute(consoleHandle, textColor + (bgColor << 4));
+    }
+
+    void resetConsoleColor() {
+        SetConsoleTextAttribute(consoleHandle, WHITE);
+    }
+
+    // Colour of a map character on screen
+    static Color tileColor(char tile) {
+        switch (tile) {
+            case WALL: return DARKGRAY;
+            case FLOOR: return LIGHTGRAY;
+            case KEY: return YELLOW;
+            case DOOR: return BROWN;
+            case HEALTH: return LIGHTGREEN;
+            case WEAPON: return CYAN;
+            case ARMOR: return BLUE;
+            case TRAP: return RED;
+            case GOLD: return YELLOW;
+            case STAIRS: return MAGENTA;
+            case SLIME: return GREEN;
+            case GOBLIN: return LIGHTRED;
+            case TROLL: return RED;
+            case ARCHER: return LIGHTMAGENTA;
+            case THROWER: return BROWN;
+            case PLAYER: return YELLOW;
+            default: return WHITE;
+        }
+    }
+    
+    // Map through a window that follows the player on large levels; returns the next row
+    int renderViewport(ScreenFrame& frame, int row) {
+        int viewW = min(mapWidth, WIDTH);
+        int viewH = min(mapHeight, HEIGHT);
+        int left = max(0, min(player.x - viewW / 2, mapWidth - viewW));
+        int top = max(0, min(player.y - viewH / 2, mapHeight - viewH));
+        
+        for (int y = top; y < top + viewH; y++, row++) {
+            for (int x = left; x < left + viewW; x++) {
+                char shown;
+                Enemy* enemy = getEnemyAt(x, y);
+                if (x == player.x && y == player.y) {
+                    shown = PLAYER;
+                } else if (!canSee(x, y)) {
+                    // Only the lie of the land shows in the dark
+                    frame.put(row, x - left, map[y][x], DARKGRAY);
+                    continue;
+                } else if (enemy) {
+                    shown = enemy->symbol;
+                } else if (isProjectileAt(x, y)) {
+                    shown = PROJECTILE;
+                } else {
+                    // Loot shows on top of the floor it lies on
+                    shown = map[y][x];
+                    int pile = floorItems.head(y * mapWidth + x);
+                    if (pile >= 0) shown = lootSymbol(floorItems.item(pile));
+                }
+                frame.put(row, x - left, shown, tileColor(shown));
+            }
+        }
+        return row;
+    }
+
+    
+    // Bring the light map up to date with the torch and every source that moved
+    void refreshLights() {
+        lights.move(torchLight, player.x, player.y);
+        lights.setIntensity(torchLight, player.torchLit ? TORCH_LIGHT : 0);
+        lights.refresh();
+    }
+    
+    // Lit tiles can be seen, and so can anything within arm's reach
+    bool canSee(int x, int y) const {
+        return lights.at(x, y) >= LIGHT_VISIBLE || (abs(x - player.x) <= 1 && abs(y - player.y) <= 1);
+    }
+    
+    void toggleTorch() {
+        player.torchLit = !player.torchLit;
+        addMessage(player.torchLit ? "You light your torch." : "You douse your torch. Goblins and trolls will find you harder to spot.");
+    }
+    
+    int overviewBlockOf(int x, int y) const {
+        return (y / OVERVIEW_BLOCK) * overviewBlocksX + x / OVERVIEW_BLOCK;
+    }
+    
+    // Marks the summary blocks near the player as explored
+    void exploreAround() {
+        int x0 = max(0, player.x - EXPLORE_RADIUS) / OVERVIEW_BLOCK;
+        int x1 = min(mapWidth - 1, player.x + EXPLORE_RADIUS) / OVERVIEW_BLOCK;
+        int y0 = max(0, player.y - EXPLORE_RADIUS) / OVERVIEW_BLOCK;
+        int y1 = min(mapHeight - 1, player.y + EXPLORE_RADIUS) / OVERVIEW_BLOCK;
+        for (int by = y0; by <= y1; by++) {
+            for (int bx = x0; bx <= x1; bx++) {
+                overview[by * overviewBlocksX + bx].explored = true;
+            }
+        }
+    }
+    
+    // Recounts a dirty block from its tiles; enemy counts are kept elsewhere
+    const BlockSummary& summary(int bx, int by) {
+        BlockSummary& block = overview[by * overviewBlocksX + bx];
+        if (!block.dirty) return block;
+        block.tiles = block.walls = block.loot = block.features = 0;
+        for (int y = by * OVERVIEW_BLOCK; y < min(mapHeight, (by + 1) * OVERVIEW_BLOCK); y++) {
+            for (int x = bx * OVERVIEW_BLOCK; x < min(mapWidth, (bx + 1) * OVERVIEW_BLOCK); x++) {
+                block.tiles++;
+                if (itemBits.test(x, y)) {
+                    block.loot++;
+                    // The key lies in the loot layer, not on the map
+                    for (int node = floorItems.head(y * mapWidth + x); node >= 0; node = floorItems.next(node)) {
+                        if (floorItems.item(node).kind == LOOT_KEY) block.features |= FEATURE_KEY;
+                    }
+                }
+                switch (map[y][x]) {
+                    case WALL: block.walls++; break;
+                    case STAIRS: block.features |= FEATURE_STAIRS; break;
+                    case DOOR: block.features |= FEATURE_DOOR; break;
+                    case TRAP: block.features |= FEATURE_TRAP; break;
+                }
+            }
+        }
+        block.dirty = false;
+        return block;
+    }
+    
+    // Whether every open tile of a summary block can be seen. Only then do
+    // its enemies and loot show on the overview, as in the normal view.
+    bool blockLit(int bx, int by) const {
+        for (int y = by * OVERVIEW_BLOCK; y < min(mapHeight, (by + 1) * OVERVIEW_BLOCK); y++) {
+            for (int x = bx * OVERVIEW_BLOCK; x < min(mapWidth, (bx + 1) * OVERVIEW_BLOCK); x++) {
+                if (map[y][x] != WALL && !canSee(x, y)) return false;
+            }
+        }
+        return true;
+    }
+    
+    // One overview cell covers overviewScale tiles a side, so 1 or 2x2 summary
+    // blocks. The window follows the player like the normal view does.
+    int renderOverview(ScreenFrame& frame, int row) {
+        int span = overviewScale / OVERVIEW_BLOCK; // summary blocks per cell side
+        int blocksY = (int)overview.size() / overviewBlocksX;
+        int cellsW = (overviewBlocksX + span - 1) / span;
+        int cellsH = (blocksY + span - 1) / span;
+        int viewW = min(cellsW, WIDTH);
+        int viewH = min(cellsH, HEIGHT);
+        int playerCellX = player.x / overviewScale;
+        int playerCellY = player.y / overviewScale;
+        int left = max(0, min(playerCellX - viewW / 2, cellsW - viewW));
+        int top = max(0, min(playerCellY - viewH / 2, cellsH - viewH));
+        
+        for (int cy = top; cy < top + viewH; cy++, row++) {
+            for (int cx = left; cx < left + viewW; cx++) {
+                BlockSummary cell;
+                for (int by = cy * span; by < min(blocksY, (cy + 1) * span); by++) {
+                    for (int bx = cx * span; bx < min(overviewBlocksX, (cx + 1) * span); bx++) {
+                        const BlockSummary& block = summary(bx, by);
+                        if (!block.explored) continue;
+                        cell.explored = true;
+                        cell.tiles += block.tiles;
+                        cell.walls += block.walls;
+                        cell.features |= block.features & ~FEATURE_KEY;
+                        if ((block.loot > 0 || block.enemies > 0) && blockLit(bx, by)) {
+                            cell.loot += block.loot;
+                            cell.enemies += block.enemies;
+                            cell.features |= block.features & FEATURE_KEY; // loot, so only when lit
+                        }
+                    }
+                }
+                char shown;
+                Color color;
+                if (cx == playerCellX && cy == playerCellY) {
+                    shown = PLAYER;
+                    color = YELLOW;
+                } else if (!cell.explored) {
+                    shown = ' ';
+                    color = BLACK;
+                } else if (cell.features & (FEATURE_STAIRS | FEATURE_DOOR | FEATURE_KEY)) {
+                    shown = cell.features & FEATURE_STAIRS ? STAIRS : cell.features & FEATURE_DOOR ? DOOR : KEY;
+                    color = tileColor(shown);
+                } else if (cell.enemies > 0) {
+                    shown = cell.enemies > 9 ? '*' : (char)('0' + cell.enemies);
+                    color = LIGHTRED;
+                } else if (cell.loot > 0) {
+                    shown = GOLD;
+                    color = YELLOW;
+                } else if (cell.walls * 4 >= cell.tiles * 3) {
+                    shown = WALL;
+                    color = DARKGRAY;
+                } else {
+                    shown = cell.walls * 4 >= cell.tiles ? ':' : FLOOR;
+                    color = LIGHTGRAY;
+                }
+                frame.put(row, cx - left, shown, color);
+            }
+        }
+        return row;
+    }
+    
+    void renderFrame(ScreenFrame& frame) {
+        refreshLights();
+        frame.clear();
+        
+        // Draw HUD at top
+        int row = frame.line(0, "=== DUNGEON CRAWLER Level " + to_string(player.dungeonLevel) + " ===", LIGHTCYAN);
+        
+        if (overviewScale > 0) {
+            frame.line(0, "=== DUNGEON CRAWLER Level " + to_string(player.dungeonLevel) +
+                       " === Overview 1:" + to_string(overviewScale), LIGHTCYAN);
+            row = renderOverview(frame, row);
+        } else {
+            row = renderViewport(frame, row);
+        }
+
+        // Draw player stats
+        row = frame.line(row + 1, "Health: " + to_string(player.health) + "/" + to_string(player.maxHealth) +
+                         " | Level: " + to_string(player.level) +
+                         " | XP: " + to_string(player.experience) + "/" + to_string(player.experienceToLevel) +
+                         " | Gold: " + to_string(player.gold) +
+                         " | Mana: " + to_string(player.mana) + "/" + to_string(player.maxMana) +
+                         " | Score: " + to_string(player.score), WHITE);
+        row = frame.line(row, "Weapon: " + (player.equippedWeapon ? player.equippedWeapon->name : string("None")) +
+                         " (ATK: " + to_string(player.getTotalAttack()) + ")" +
+                         " | Armor: " + (player.equippedArmor ? player.equippedArmor->name : string("None")) +
+                         " (DEF: " + to_string(player.getTotalDefense()) + ")" +
+                         " | Key: " + (player.hasKey ? "YES" : "NO") +
+                         " | Torch: " + (player.torchLit ? "LIT" : "OUT") +
+                         " | Status: " + statusText(), WHITE);
+        
+        // Draw messages
+        row = frame.line(row + 1, "--- Messages ---", LIGHTCYAN);
+        if (messages.empty()) {
+            row = frame.line(row, "No messages yet.", WHITE);
+        } else {
+            for (const auto& msg : messages) {
+                row = frame.line(row, msg, WHITE);
+            }
+        }
+        
+        // Draw controls
+        row = frame.line(row + 1, "--- Controls ---", LIGHTCYAN);
+        frame.line(row, "Move: WASD | Attack: Space | Throw: F | Spells: 1-3 | Inventory: I | Use Health Potion: H | Torch: L | Map: M | Quit: Q", WHITE);
+    }
+    
+    void draw() {
+        if (config.headless && !config.spectators && !config.recorder) return;
+        MetricsTimer timer(config.metrics, METRIC_DRAW);
+        renderFrame(screen);
+        showScreen();
+    }
+    
+    // Hand the current screen to whoever is looking: console, spectators, recording
+    void showScreen() {
+        if (config.spectators) config.spectators->publish(screen);
+        if (config.recorder) config.recorder->record(screen);
+        if (!config.headless) printFrame(screen);
+    }
+    
+    // Queue a telemetry event; never blocks, drops the event if the buffer is full
+    void logEvent(TelemetryType type, int subject, int x, int y, int value) {
+        if (!telemetry) return;
+        TelemetryEvent event;
+        event.turn = (uint32_t)turns;
+        event.type = type;
+        event.subject = (uint8_t)subject;
+        event.depth = (uint16_t)player.dungeonLevel;
+        event.x = (int16_t)x;
+        event.y = (int16_t)y;
+        event.value = value;
+        telemetry->push(event);
+    }
+    
+    // Queue an event for the end of the turn
+    void publish(GameEventType type, int subject, int x, int y, int value, int extra = 0, int flags = 0, int variant = 0) {
+        GameEvent event;
+        event.type = type;
+        event.subject = (uint8_t)subject;
+        event.variant = (uint8_t)variant;
+        event.flags = (uint8_t)flags;
+        event.x = (int16_t)x;
+        event.y = (int16_t)y;
+        event.value = value;
+        event.extra = extra;
+        events.publish(event);
+    }
+    
+    // Hand the turn's events to the subscribers: score, messages, weapon wear,
+    // achievements, telemetry, sound
+    void flushEvents() {
+        events.dispatch();
+    }
+    
+    void addMessage(const string& message) {
+        MemoryScope scope(MEM_MESSAGES);
+        messages.push_back(message);
+        while (messages.size() > maxMessages || (messages.size() > 1 && !withinBudget(MEM_MESSAGES))) {
+            messages.erase(messages.begin());
+        }
+    }
+    
+    // Whether a subsystem may grow; only messages, enemies, and items are held to a budget
+    bool withinBudget(MemorySubsystem subsystem) const {
+        return config.memoryBudget[subsystem] <= 0 || heapUsage.bytes[subsystem] < config.memoryBudget[subsystem];
+    }
+
+    void playerAttack() {
+        bool hitEnemy = false;
+        int x = player.x;
+        int y = player.y;
+        
+        // Check all adjacent positions for enemies
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if (dx == 0 && dy == 0) continue; // Skip player's own position
+                
+                int targetX = x + dx;
+                int targetY = y + dy;
+                Enemy* target = getEnemyAt(targetX, targetY);
+                
+                if (target) {
+                    hitEnemy = true;
+                    int damage = player.getTotalAttack();
+                    int flags = 0;
+                    // Chance for critical hit
+                    if (rng.next() % 10 == 0) {
+                        damage *= 2;
+                        flags = EVENT_CRITICAL;
+                    }
+                    
+                    target->takeDamage(damage);
+                    rehashEnemy(target);
+                    publish(EVENT_PLAYER_HIT, enemyKind(target->symbol), target->x, target->y, damage, 0, flags);
+                    enemiesHurt = true;
+                    makeNoise(x, y, 8);
+                    break;
+                }
+            }
+            if (hitEnemy) break;
+        }
+
+        removeDeadEnemies();
+
+        if (!hitEnemy) {
+            publish(EVENT_MISS, 0, x, y, 0);
+        }
+    }
+    
+    // Single compaction pass over `enemies`; rewards for the kills are
+    // handed out when the turn's events are dispatched
+    void removeDeadEnemies() {
+        if (!enemiesHurt) return;
+        enemiesHurt = false;
+        size_t kept = 0;
+        for (size_t i = 0; i < enemies.size(); i++) {
+            Enemy* enemy = enemies[i];
+            if (enemy->health > 0) {
+                enemies[kept++] = enemy;
+                continue;
+            }
+            publish(EVENT_KILL, enemyKind(enemy->symbol), enemy->x, enemy->y, enemy->experienceValue, enemy->goldValue);
+            FloorItem drop;
+            if (rollDrop(enemy, drop) && withinBudget(MEM_ITEMS)) {
+                dropItem(enemy->y * mapWidth + enemy->x, drop);
+            }
+            if (journal.enabled()) {
+                journalEnemy(enemy);
+                journal.record(JOURNAL_ENEMY_DEATH, 0, enemy->id, 1, 0);
+            }
+            retireEnemy(enemy);
+        }
+        enemies.resize(kept);
+    }
+    
+    // Take a dead enemy off the level; with rewinding on it is kept so an
+    // undo can bring it back
+    void retireEnemy(Enemy* enemy) {
+        enemyById[enemy->id] = nullptr;
+        occupant[enemy->y * mapWidth + enemy->x] = -1;
+        stateHash ^= enemy->hashKey;
+        if (enemy->overviewBlock >= 0) overview[enemy->overviewBlock].enemies--;
+        enemy->overviewBlock = -1;
+        if (enemy->light >= 0) lights.remove(enemy->light);
+        enemy->light = -1;
+        if (journal.enabled()) {
+            if (buried.size() <= (size_t)enemy->id) buried.resize(enemyById.size(), nullptr);
+            buried[enemy->id] = enemy;
+        } else {
+            delete enemy;
+        }
+    }
+    
+    void reviveEnemy(Enemy* enemy) {
+        buried[enemy->id] = nullptr;
+        enemyById[enemy->id] = enemy;
+        // Keep `enemies` in id order, the order enemy turns are committed in
+        enemies.insert(lower_bound(enemies.begin(), enemies.end(), enemy,
+                                   [](const Enemy* a, const Enemy* b) { return a->id < b->id; }),
+                       enemy);
+        occupant[enemy->y * mapWidth + enemy->x] = enemy->id;
+        if (enemy->symbol == SLIME) enemy->light = lights.add(enemy->x, enemy->y, SLIME_GLOW_RADIUS, SLIME_GLOW);
+        enemy->hashKey = 0;
+        rehashEnemy(enemy);
+        if (lodEnabled) {
+            enemy->tier = TIER_ACTIVE; // settles into its proper tier next turn
+            activeIds.push_back(enemy->id);
+            activeUnsorted = true;
+        }
+        if (enemy->regenerates) {
+            scheduleRegeneration(enemy);
+        }
+    }
+    
+    // Player state covered by the journal. Status effects are left out:
+    // they run on the timer wheel, which keeps going forward.
+    int journalStat(int field) const {
+        switch (field) {
+            case 0: return player.x;
+            case 1: return player.y;
+            case 2: return player.health;
+            case 3: return player.maxHealth;
+            case 4: return player.attack;
+            case 5: return player.defense;
+            case 6: return player.mana;
+            case 7: return player.maxMana;
+            case 8: return player.gold;
+            case 9: return player.score;
+            case 10: return player.level;
+            case 11: return player.experience;
+            case 12: return player.experienceToLevel;
+            case 13: return player.hasKey;
+            case 14: return (player.facingY + 1) * 3 + player.facingX + 1;
+            case 15: return player.torchLit;
+            default: return kills[field - 16];
+        }
+    }
+    
+    void setJournalStat(int field, int value) {
+        switch (field) {
+            case 0: player.x = value; break;
+            case 1: player.y = value; break;
+            case 2: player.health = value; break;
+            case 3: player.maxHealth = value; break;
+            case 4: player.attack = value; break;
+            case 5: player.defense = value; break;
+            case 6: player.mana = value; break;
+            case 7: player.maxMana = value; break;
+            case 8: player.gold = value; break;
+            case 9: player.score = value; break;
+            case 10: player.level = value; break;
+            case 11: player.experience = value; break;
+            case 12: player.experienceToLevel = value; break;
+            case 13: player.hasKey = value != 0; break;
+            case 14:
+                player.facingX = value % 3 - 1;
+                player.facingY = value / 3 - 1;
+                break;
+            case 15: player.torchLit = value != 0; break;
+            default: kills[field - 16] = value;
+        }
+    }
+    
+    // Inventory items as small integers: heal amount for health potions,
+    // negative codes for the others
+    static int itemCode(const Item* item) {
+        if (auto potion = dynamic_cast<const HealthPotion*>(item)) return potion->healAmount;
+        if (dynamic_cast<const HastePotion*>(item)) return -1;
+        return -2;
+    }
+    
+    static Item* makeItem(int code) {
+        if (code == -1) return new HastePotion();
+        if (code == -2) return new RegenerationPotion();
+        return new HealthPotion(code);
+    }
+    
+    // Take the starting point for the journal; a new level starts it over
+    void resetJournal() {
+        if (!journal.enabled()) return;
+        journal.clear();
+        buried.assign(enemyById.size(), nullptr);
+        journalTouched.clear();
+        for (auto enemy : enemies) {
+            enemy->journalDirty = false;
+            enemy->journalPos = enemy->y * mapWidth + enemy->x;
+            enemy->journalHealth = enemy->health;
+        }
+        for (int i = 0; i < JOURNAL_STATS; i++) {
+            journalStats[i] = journalStat(i);
+        }
+        journalInventory.assign(player.inventorySize, 0);
+        for (size_t i = 0; i < player.inventory.size(); i++) {
+            journalInventory[i] = itemCode(player.inventory[i]);
+        }
+    }
+    
+    void journalEnemy(Enemy* enemy) {
+        int pos = enemy->y * mapWidth + enemy->x;
+        if (pos != enemy->journalPos) {
+            journal.record(JOURNAL_ENEMY_POS, 0, enemy->id, enemy->journalPos, pos);
+            enemy->journalPos = pos;
+        }
+        if (enemy->health != enemy->journalHealth) {
+            journal.record(JOURNAL_ENEMY_HEALTH, 0, enemy->id, enemy->journalHealth, enemy->health);
+            enemy->journalHealth = enemy->health;
+        }
+        enemy->journalDirty = false;
+    }
+    
+    // Close the turn in the journal. Tiles and deaths were recorded as they
+    // happened; enemies are written once per turn however often they
+    // changed, and the player is diffed like rehashPlayer does.
+    void recordTurn() {
+        if (!journal.enabled()) return;
+        for (int id : journalTouched) {
+            if (enemyById[id]) journalEnemy(enemyById[id]);
+        }
+        journalTouched.clear();
+        for (int i = 0; i < JOURNAL_STATS; i++) {
+            int value = journalStat(i);
+            if (value == journalStats[i]) continue;
+            journal.record(JOURNAL_PLAYER, i, 0, journalStats[i], value);
+            journalStats[i] = value;
+        }
+        for (int i = 0; i < player.inventorySize; i++) {
+            int code = i < (int)player.inventory.size() ? itemCode(player.inventory[i]) : 0;
+            if (code == journalInventory[i]) continue;
+            journal.record(JOURNAL_INVENTORY, 0, i, journalInventory[i], code);
+            journalInventory[i] = code;
+        }
+        journal.endTurn();
+    }
+    
+    void applyJournalEntry(const JournalEntry& entry, bool forward) {
+        int value = forward ? entry.after : entry.before;
+        switch (entry.kind) {
+            case JOURNAL_TILE:
+                setTile(entry.target % mapWidth, entry.target / mapWidth, (char)value);
+                break;
+            case JOURNAL_PLAYER:
+                setJournalStat(entry.field, value);
+                journalStats[entry.field] = value;
+                break;
+            case JOURNAL_INVENTORY:
+                journalInventory[entry.target] = value;
+                break;
+            case JOURNAL_ENEMY_POS:
+                {
+                    Enemy* enemy = enemyById[entry.target];
+                    int& from = occupant[enemy->y * mapWidth + enemy->x];
+                    if (from == enemy->id) from = -1;
+                    enemy->x = value % mapWidth;
+                    enemy->y = value / mapWidth;
+                    occupant[value] = enemy->id;
+                    enemy->journalPos = value;
+                    rehashEnemy(enemy);
+                }
+                break;
+            case JOURNAL_ENEMY_HEALTH:
+                {
+                    Enemy* enemy = enemyById[entry.target];
+                    enemy->health = value;
+                    enemy->journalHealth = value;
+                    rehashEnemy(enemy);
+                }
+                break;
+            case JOURNAL_ITEM:
+                {
+                    bool dropped = entry.field == 0;
+                    uint32_t bits = (uint32_t)(dropped ? entry.after : entry.before);
+                    if (dropped == forward) {
+                        dropItem(entry.target, FloorItem::unpack(bits));
+                        break;
+                    }
+                    int node = floorItems.head(entry.target);
+                    while (floorItems.item(node).pack() != bits) node = floorItems.next(node);
+                    takeItem(entry.target, node);
+                }
+                break;
+            case JOURNAL_ENEMY_DEATH:
+                if (forward) {
+                    Enemy* enemy = enemyById[entry.target];
+                    enemies.erase(find(enemies.begin(), enemies.end(), enemy));
+                    retireEnemy(enemy);
+                } else {
+                    reviveEnemy(buried[entry.target]);
+                }
+                break;
+        }
+    }
+    
+    // Step the level one turn back or forward through the journal
+    void rewindTurn(bool forward) {
+        if (!journal.enabled()) {
+            addMessage("Rewinding is off; start the game with --rewind N to use it.");
+            return;
+        }
+        replaying = true;
+        auto apply = [this](const JournalEntry& entry, bool fwd) { applyJournalEntry(entry, fwd); };
+        bool stepped = forward ? journal.stepForward(apply) : journal.stepBack(apply);
+        replaying = false;
+        if (!stepped) {
+            addMessage(forward ? "Nothing to redo." : "Can't rewind any further on this level.");
+            return;
+        }
+        
+        // Rebuild the inventory from the journaled item codes
+        for (auto item : player.inventory) {
+            delete item;
         }
-        enemies.clear();
+        player.inventory.clear();
+        for (int code : journalInventory) {
+            if (code != 0) player.inventory.push_back(makeItem(code));
+        }
+        projectiles.clear();
+        standingTile = player.y * mapWidth + player.x;
+        rehashPlayer();
+        addMessage(string(forward ? "Replayed" : "Rewound") + " a turn (" + to_string(journal.turnsBack()) +
+                   " back, " + to_string(journal.turnsForward()) + " forward).");
+    }
+    
+    // Where a spell lands: on the player, or along the facing direction
+    // until it meets a wall or an enemy
+    void spellCentre(const SpellInfo& spell, int& cx, int& cy) {
+        cx = player.x;
+        cy = player.y;
+        for (int step = 0; step < spell.reach; step++) {
+            int nx = cx + player.facingX;
+            int ny = cy + player.facingY;
+            if (!openBits.test(nx, ny)) break;
+            cx = nx;
+            cy = ny;
+            if (isEnemyAt(cx, cy)) break;
+        }
+    }
+    
+    void castSpell(SpellType type) {
+        const SpellInfo& spell = SPELLS[type];
+        if (player.mana < spell.manaCost) {
+            addMessage("Not enough mana for " + string(spell.name) + "!");
+            return;
+        }
+        player.mana -= spell.manaCost;
         
-        // Create walls around the edges
-        for (int i = 0; i < WIDTH; i++) {
-            map[0][i] = WALL;
-            map[HEIGHT-1][i] = WALL;
+        int cx, cy;
+        spellCentre(spell, cx, cy);
+        Bitboard area(mapWidth, mapHeight);
+        for (int y = cy - spell.radius; y <= cy + spell.radius; y++) {
+            area.setSpan(y, cx - spell.radius, cx + spell.radius);
         }
-        for (int i = 0; i < HEIGHT; i++) {
-            map[i][0] = WALL;
-            map[i][WIDTH-1] = WALL;
+        area &= openBits;
+        area = Bitboard::floodFill(cx, cy, area); // walls stop the blast; it spreads round them within its square
+        
+        // Only enemies inside the blast's bounding box can be hit
+        blastTargets.clear();
+        for (int y = cy - spell.radius; y <= cy + spell.radius; y++) {
+            for (int x = cx - spell.radius; x <= cx + spell.radius; x++) {
+                Enemy* enemy = getEnemyAt(x, y);
+                if (enemy) blastTargets.push_back(enemy);
+            }
         }
         
-        // Generate interior walls based on dungeon level
-        int numWalls = 10 + dungeonLevel * 2;
-        for (int i = 0; i < numWalls; i++) {
-            int wallLength = 5 + rand() % 10;
-            int startX = 2 + rand() % (WIDTH - 4);
-            int startY = 2 + rand() % (HEIGHT - 4);
-            int direction = rand() % 2; // 0 for horizontal, 1 for vertical
-            
-            for (int j = 0; j < wallLength; j++) {
-                int x = startX + (direction == 0 ? j : 0);
-                int y = startY + (direction == 1 ? j : 0);
-                if (x < WIDTH - 1 && y < HEIGHT - 1) {
-                    map[y][x] = WALL;
+        int damage = player.getTotalAttack() / 2 + spell.baseDamage;
+        damageBatch.gather(blastTargets);
+        int hits = damageBatch.mark(area);
+        if (hits > 0) {
+            enemiesHurt = true;
+            damageBatch.apply(damage);
+            for (size_t i = 0; i < blastTargets.size(); i++) {
+                if (!damageBatch.hit[i]) continue;
+                Enemy* enemy = blastTargets[i];
+                enemy->health = damageBatch.health[i];
+                rehashEnemy(enemy);
+                if (enemy->health > 0 && spell.lingering != STATUS_NONE) {
+                    applyStatus(enemy->id, spell.lingering, spell.lingerDamage, spell.lingerTurns);
+                }
+            }
+        }
+        
+        makeNoise(cx, cy, 12);
+        publish(EVENT_SPELL, type, cx, cy, hits);
+        removeDeadEnemies();
+    }
+    
+    void playerThrow() {
+        Projectile knife;
+        knife.x = player.x;
+        knife.y = player.y;
+        knife.dx = player.facingX;
+        knife.dy = player.facingY;
+        knife.range = 8;
+        knife.damage = max(1, player.getTotalAttack() / 2);
+        projectiles.push_back(knife);
+        addMessage("You throw a knife!");
+    }
+    
+    bool isProjectileAt(int x, int y) const {
+        for (const auto& p : projectiles) {
+            if (p.x == x && p.y == y) return true;
+        }
+        return false;
+    }
+    
+    // Fly each projectile up to PROJECTILE_SPEED tiles, stopping at walls and enemies
+    void updateProjectiles() {
+        auto it = projectiles.begin();
+        while (it != projectiles.end()) {
+            bool spent = false;
+            for (int step = 0; step < PROJECTILE_SPEED && !spent; step++) {
+                int nx = it->x + it->dx;
+                int ny = it->y + it->dy;
+                if (!openBits.test(nx, ny)) {
+                    spent = true;
+                    break;
+                }
+                it->x = nx;
+                it->y = ny;
+                Enemy* target = getEnemyAt(nx, ny);
+                if (target) {
+                    target->takeDamage(it->damage);
+                    rehashEnemy(target);
+                    publish(EVENT_PLAYER_HIT, enemyKind(target->symbol), target->x, target->y, it->damage, 0, EVENT_THROWN);
+                    enemiesHurt = true;
+                    spent = true;
+                } else if (--it->range <= 0) {
+                    spent = true;
+                }
+            }
+            if (spent) {
+                it = projectiles.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        removeDeadEnemies();
+    }
+    
+    // Start a status effect on the player (target -1) or an enemy.
+    // Damage/heal effects tick every turn for `turns` turns.
+    void applyStatus(int target, StatusEffect status, int amount, int turns) {
+        TimerEvent event;
+        event.status = (uint8_t)status;
+        event.target = target;
+        event.epoch = target < 0 ? 0 : levelEpoch;
+        event.amount = amount;
+        if (status == STATUS_HASTE) {
+            event.kind = TIMER_STATUS_END;
+            timers.schedule(turns, event);
+        } else {
+            event.kind = TIMER_STATUS_TICK;
+            event.period = 1;
+            event.remaining = turns;
+            timers.schedule(1, event);
+        }
+        if (target < 0) player.statusCount[status]++;
+    }
+    
+    void handleTimer(TimerEvent& event) {
+        if (event.epoch != 0 && event.epoch != levelEpoch) return; // from a previous level
+        Enemy* enemy = nullptr;
+        if (event.target >= 0 && event.kind != TIMER_TRAP_REARM) {
+            enemy = event.target < (int)enemyById.size() ? enemyById[event.target] : nullptr;
+            if (!enemy) return; // already dead
+        }
+        
+        switch (event.kind) {
+            case TIMER_PLAYER_REGEN:
+                if (player.health < player.maxHealth) {
+                    player.health = min(player.maxHealth, player.health + event.amount);
+                }
+                break;
+            case TIMER_MANA_REGEN:
+                if (player.mana < player.maxMana) {
+                    player.mana = min(player.maxMana, player.mana + event.amount);
+                }
+                break;
+            case TIMER_ENEMY_REGEN:
+                if (enemy->tier == TIER_DORMANT) {
+                    enemy->regenPaused = true; // rescheduled when it wakes
+                    return;
+                }
+                enemy->health = min(enemy->maxHealth, enemy->health + event.amount);
+                rehashEnemy(enemy);
+                break;
+            case TIMER_STATUS_TICK:
+                if (event.status == STATUS_REGENERATION) {
+                    player.health = min(player.maxHealth, player.health + event.amount);
+                } else if (enemy) {
+                    enemy->health -= event.amount;
+                    enemiesHurt = true;
+                    rehashEnemy(enemy);
+                } else {
+                    player.health -= event.amount;
+                    addMessage(string(event.status == STATUS_POISON ? "Poison" : "Fire") +
+                               " deals " + to_string(event.amount) + " damage!");
+                }
+                if (event.remaining > 0 && --event.remaining == 0) {
+                    if (!enemy) player.statusCount[event.status]--;
+                    return;
                 }
+                break;
+            case TIMER_STATUS_END:
+                player.statusCount[event.status]--;
+                if (event.status == STATUS_HASTE && player.statusCount[STATUS_HASTE] == 0) {
+                    addMessage("You slow back down.");
+                }
+                return;
+            case TIMER_TRAP_REARM:
+                {
+                    int x = event.target % mapWidth;
+                    int y = event.target / mapWidth;
+                    if (map[y][x] == TRAP) return; // already put back by a rewind
+                    if (map[y][x] == FLOOR && !(player.x == x && player.y == y)) {
+                        setTile(x, y, TRAP);
+                    } else {
+                        timers.schedule(5, event); // something is in the way, try again later
+                    }
+                }
+                return;
+        }
+        if (event.period > 0) {
+            timers.schedule(event.period, event);
+        }
+    }
+    
+    void updateTimers() {
+        firedTimers.clear();
+        timers.advance(firedTimers);
+        for (size_t i = 0; i < firedTimers.size(); i++) {
+            handleTimer(firedTimers[i]);
+        }
+        removeDeadEnemies();
+    }
+    
+    string statusText() const {
+        static const char* names[STATUS_COUNT] = { "Poisoned", "Burning", "Hasted", "Regenerating" };
+        string text;
+        for (int i = 0; i < STATUS_COUNT; i++) {
+            if (player.statusCount[i] > 0) {
+                text += (text.empty() ? "" : " ") + string(names[i]);
+            }
+        }
+        return text.empty() ? "Normal" : text;
+    }
+    
+    void useInventoryItem(int index) {
+        Item* item = player.inventory[index];
+        string name = item->name;
+        StatusEffect effect = item->statusEffect();
+        player.useItem(index);
+        if (effect == STATUS_HASTE) {
+            applyStatus(-1, STATUS_HASTE, 0, 10);
+        } else if (effect == STATUS_REGENERATION) {
+            applyStatus(-1, STATUS_REGENERATION, 3, 8);
+        }
+        addMessage("You used " + name);
+    }
+    
+    void showInventory() {
+        system("cls");
+        cout << "=== INVENTORY ===" << endl;
+        cout << "Items: " << player.inventory.size() << "/" << player.inventorySize << endl << endl;
+        
+        if (player.inventory.empty()) {
+            cout << "Your inventory is empty." << endl;
+        } else {
+            for (size_t i = 0; i < player.inventory.size(); i++) {
+                cout << (i + 1) << ". " << player.inventory[i]->name << " - " 
+                     << player.inventory[i]->description << endl;
             }
             
-            // Create openings/doorways
-            if (wallLength > 3 && wallLength < 10) {
-                int doorPosition = rand() % wallLength;
-                int x = startX + (direction == 0 ? doorPosition : 0);
-                int y = startY + (direction == 1 ? doorPosition : 0);
-                if (x < WIDTH - 1 && y < HEIGHT - 1) {
-                    map[y][x] = FLOOR;
+            cout << "\nEnter the number of the item to use, or 0 to return: ";
+            int choice;
+            chrono::steady_clock::time_point asked = chrono::steady_clock::now();
+            cin >> choice;
+            inputWait += chrono::steady_clock::now() - asked;
+
+            if (choice > 0 && choice <= player.inventory.size()) {
+                useInventoryItem(choice - 1);
+            }
+        }
+        
+        cout << "\nPress any key to return to the game...";
+        waitKey();
+    }
+    
+    // Blocking key read for prompts and menus. Time spent here is the
+    // player's, so real-time mode does not count it against a tick.
+    char waitKey() {
+        chrono::steady_clock::time_point asked = chrono::steady_clock::now();
+        char key = (char)_getch();
+        inputWait += chrono::steady_clock::now() - asked;
+        return key;
+    }
+    
+    // Y/N question shown over the map; headless games take the given answer
+    bool askYesNo(const string& question, bool headlessAnswer) {
+        if (config.headless) return headlessAnswer;
+        flushEvents(); // so the prompt shows this turn's messages
+        draw();
+        cout << "\n" << question << " (Y/N): ";
+        char choice = waitKey();
+        return tolower(choice) == 'y';
+    }
+    
+    void useHealthPotion() {
+        // Find a health potion in inventory
+        for (size_t i = 0; i < player.inventory.size(); i++) {
+            if (dynamic_cast<HealthPotion*>(player.inventory[i])) {
+                player.useItem(i);
+                addMessage("You used a Health Potion. Health restored!");
+                return;
+            }
+        }
+        addMessage("You don't have any health potions!");
+    }
+
+    // Pick up whatever lies on the player's tile. Returns false for items
+    // the player leaves where they are.
+    bool pickUp(const FloorItem& item) {
+        MemoryScope scope(MEM_ITEMS);
+        switch (item.kind) {
+            case LOOT_KEY:
+                player.hasKey = true;
+                return true;
+                
+            case LOOT_POTION:
+                if (player.inventory.size() >= player.inventorySize) {
+                    addMessage("Your pack is full, you leave the " + lootName(item) + ".");
+                    return false;
+                }
+                switch (item.variant) {
+                    case 1:
+                        player.addToInventory(new HastePotion());
+                        break;
+                    case 2:
+                        player.addToInventory(new RegenerationPotion());
+                        break;
+                    default:
+                        player.addToInventory(new HealthPotion(item.amount));
+                }
+                return true;
+                
+            case LOOT_GOLD:
+                return true; // the score keeper banks it
+                
+            case LOOT_WEAPON:
+                {
+                    Weapon* newWeapon = new Weapon(lootName(item), item.amount, item.durability);
+                    
+                    // Compare with current weapon
+                    string currentWeaponInfo = player.equippedWeapon ? 
+                        player.equippedWeapon->name + " (DMG: " + to_string(player.equippedWeapon->damage) + ")" : "None";
+                    
+                    addMessage("Found: " + newWeapon->name + " (DMG: " + to_string(newWeapon->damage) + 
+                              "). Current: " + currentWeaponInfo);
+                    
+                    // Ask player if they want to equip the new weapon
+                    int currentDamage = player.equippedWeapon ? player.equippedWeapon->damage : 0;
+                    if (askYesNo("Equip " + newWeapon->name + "?", newWeapon->damage > currentDamage)) {
+                        player.equipWeapon(newWeapon);
+                        addMessage("Equipped " + newWeapon->name + "!");
+                        return true;
+                    }
+                    delete newWeapon;
+                    addMessage("You leave the " + string(WEAPON_TYPES[item.variant / 4]) + " behind.");
+                    return false;
+                }
+                
+            default:
+                {
+                    Armor* newArmor = new Armor(lootName(item), item.amount);
+                    
+                    // Compare with current armor
+                    string currentArmorInfo = player.equippedArmor ? 
+                        player.equippedArmor->name + " (DEF: " + to_string(player.equippedArmor->defense) + ")" : "None";
+                    
+                    addMessage("Found: " + newArmor->name + " (DEF: " + to_string(newArmor->defense) + 
+                              "). Current: " + currentArmorInfo);
+                    
+                    // Ask player if they want to equip the new armor
+                    int currentDefense = player.equippedArmor ? player.equippedArmor->defense : 0;
+                    if (askYesNo("Equip " + newArmor->name + "?", newArmor->defense > currentDefense)) {
+                        player.equipArmor(newArmor);
+                        addMessage("Equipped " + newArmor->name + "!");
+                        return true;
+                    }
+                    delete newArmor;
+                    addMessage("You leave the " + string(ARMOR_TYPES[item.variant / 4]) + " behind.");
+                    return false;
+                }
+        }
+    }
+    
+    void pickUpItems() {
+        int tile = player.y * mapWidth + player.x;
+        for (int node = floorItems.head(tile); node >= 0; ) {
+            int next = floorItems.next(node);
+            FloorItem item = floorItems.item(node);
+            if (pickUp(item)) {
+                takeItem(tile, node);
+                publish(EVENT_PICKUP, item.kind, player.x, player.y, item.amount, 0, 0, item.variant);
+            }
+            node = next;
+        }
+    }
+
+    // Events are dispatched at the end of each phase of the turn (the
+    // player's action, the tile and timers, projectiles, the enemies), so a
+    // level-up's heal lands before the next phase can hurt the player
+    void update() {
+        MetricsTimer timer(config.metrics, METRIC_UPDATE, &inputWait); // not the player's time at prompts
+        MemoryScope scope(MEM_LEVEL_CACHE); // the turn's working sets, unless charged elsewhere
+        flushEvents();
+        turns++;
+        
+        // Pick up loot when arriving on a tile, then check what the tile itself holds
+        int tile = player.y * mapWidth + player.x;
+        if (tile != standingTile && floorItems.head(tile) >= 0) {
+            pickUpItems();
+        }
+        standingTile = tile;
+        
+        switch (map[player.y][player.x]) {
+            case TRAP:
+                {
+                    // Different trap effects
+                    int trapType = rng.next() % 3;
+                    switch (trapType) {
+                        case 0: // Damage trap
+                            {
+                                int damage = 5 + rng.next() % (5 * player.dungeonLevel);
+                                player.health -= damage;
+                                publish(EVENT_TRAP, 0, player.x, player.y, damage);
+                            }
+                            break;
+                        case 1: // Poison trap
+                            {
+                                publish(EVENT_TRAP, 1, player.x, player.y, 0);
+                                applyStatus(-1, STATUS_POISON, 1, 3 + player.dungeonLevel);
+                            }
+                            break;
+                        case 2: // Alarm trap
+                            {
+                                publish(EVENT_TRAP, 2, player.x, player.y, 0);
+                                // Make nearby enemies move faster towards player
+                                for (int y = player.y - 9; y <= player.y + 9; y++) {
+                                    for (int x = player.x - 9; x <= player.x + 9; x++) {
+                                        Enemy* enemy = getEnemyAt(x, y);
+                                        if (enemy && abs(enemy->x - player.x) + abs(enemy->y - player.y) < 10) {
+                                            enemy->moveCooldown = 0;
+                                        }
+                                    }
+                                }
+                                makeNoise(player.x, player.y, 40);
+                            }
+                            break;
+                    }
+                    setTile(player.x, player.y, FLOOR);
+                    
+                    // The mechanism resets itself after a while
+                    TimerEvent rearm;
+                    rearm.kind = TIMER_TRAP_REARM;
+                    rearm.epoch = levelEpoch;
+                    rearm.target = player.y * mapWidth + player.x;
+                    timers.schedule(25 + rng.next() % 25, rearm);
+                }
+                break;
+                
+            case DOOR:
+                if (player.hasKey) {
+                    setTile(player.x, player.y, FLOOR);
+                    player.hasKey = false;
+                    publish(EVENT_DOOR, 0, player.x, player.y, 100 * player.dungeonLevel);
+                } else {
+                    publish(EVENT_DOOR, 1, player.x, player.y, 0);
+                }
+                break;
+                
+            case STAIRS:
+                // Ask player if they want to go to the next level
+                if (askYesNo("Descend to the next level?", true)) {
+                    player.dungeonLevel++;
+                    if (!initializeMap(player.dungeonLevel)) {
+                        gameOver = true;
+                        return;
+                    }
+                } else {
+                    addMessage("You decide to stay on this level for now.");
                 }
+                break;
+        }
+
+        updateTimers();
+        flushEvents();
+
+        // Check if player died
+        if (player.health <= 0) {
+            gameOver = true;
+            publish(EVENT_DEATH, 0, player.x, player.y, player.score);
+            flushEvents();
+            string placement = config.headless ? "" : recordRun(true);
+            if (config.headless && !config.spectators && !config.recorder) return;
+            renderGameOver(placement);
+            showScreen();
+            if (!config.headless) waitKey();
+            return;
+        }
+
+        updateProjectiles();
+        flushEvents();
+        
+        // Hasted players get a free move every other turn
+        if (player.statusCount[STATUS_HASTE] > 0 && turns % 2 == 1) {
+            endTurn();
+            return;
+        }
+        
+        // Batch the line-of-sight checks for every ranged enemy in reach
+        updateSimulationTiers();
+        refreshLights();
+        playerLit = lights.at(player.x, player.y) >= LIGHT_VISIBLE;
+        lineOfSight.beginTurn(&openBits);
+        sightQuery.assign(turnEnemies.size(), -1);
+        for (size_t i = 0; i < turnEnemies.size(); i++) {
+            Enemy* enemy = turnEnemies[i];
+            if (enemy->reload > 0) enemy->reload--;
+            if (enemy->inRange(player.x, player.y) && !enemy->isAdjacent(player.x, player.y) && noticesPlayer(enemy)) {
+                sightQuery[i] = lineOfSight.request(enemy->x, enemy->y, player.x, player.y);
+            }
+        }
+        lineOfSight.resolve();
+        
+        withGrid([&](const auto& grid) { planEnemyTurns(grid); });
+        commitEnemyMoves();
+        
+        // Attacks resolve in id order
+        for (size_t i = 0; i < turnEnemies.size(); i++) {
+            Enemy* enemy = turnEnemies[i];
+            // Reset attack flag at the start of each turn
+            enemy->hasAttacked = false;
+            
+            if (plans[i].action == ACTION_SHOOT) {
+                int damage = enemy->rangedAttack(player, rng);
+                publish(EVENT_ENEMY_HIT, enemyKind(enemy->symbol), enemy->x, enemy->y, damage, 0, EVENT_RANGED);
+                continue;
+            }
+            
+            // Check if enemy can attack player
+            if (enemy->isAdjacent(player.x, player.y) && !enemy->hasAttacked) {
+                int damage = enemy->attackPlayer(player, rng);
+                publish(EVENT_ENEMY_HIT, enemyKind(enemy->symbol), enemy->x, enemy->y, damage);
             }
         }
-        
-        // Create some rooms
-        int numRooms = 3 + dungeonLevel;
-        for (int i = 0; i < numRooms; i++) {
-            int roomWidth = 5 + rand() % 8;
-            int roomHeight = 5 + rand() % 5;
-            int startX = 2 + rand() % (WIDTH - roomWidth - 2);
-            int startY = 2 + rand() % (HEIGHT - roomHeight - 2);
-            
-            // Clear room area
-            for (int y = startY; y < startY + roomHeight; y++) {
-                for (int x = startX; x < startX + roomWidth; x++) {
-                    if (x < WIDTH - 1 && y < HEIGHT - 1 && x > 0 && y > 0) {
-                        map[y][x] = FLOOR;
+        endTurn();
+    }
+    
+    // Bring the state hash up to date with the player's stats and, when
+    // asked to, check it against a full recompute
+    void endTurn() {
+        flushEvents();
+        if (config.metrics) {
+            config.metrics->endTurn(enemies.size());
+        } else if (memoryAccounting()) {
+            memoryTotals(); // samples the memory peaks
+        }
+        rehashPlayer();
+        exploreAround();
+        recordTurn();
+        if (config.verifyHash && stateHash != computeStateHash()) {
+            addMessage("State hash mismatch on turn " + to_string(turns) + "!");
+            resetStateHash();
+        }
+    }
+    
+    uint64_t getStateHash() const {
+        return stateHash;
+    }
+    
+    // Phase one: every enemy decides what to do from the state at the start
+    // of the enemy turn. Nothing is written except its own plan, so the work
+    // is split across the worker pool; randomness comes from IntentRng, so
+    // the result is the same for any number of threads.
+    template <class Grid>
+    void planEnemyTurns(const Grid& grid) {
+        plans.assign(turnEnemies.size(), EnemyPlan());
+        workers.parallelFor(turnEnemies.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const Enemy* enemy = turnEnemies[i];
+                EnemyPlan& plan = plans[i];
+                
+                // Ranged enemies with a clear shot fire instead of moving
+                if (sightQuery[i] >= 0 && lineOfSight.result(sightQuery[i])) {
+                    if (enemy->reload == 0) {
+                        plan.action = ACTION_SHOOT;
+                        continue;
+                    }
+                    if (enemy->holdsDistance) {
+                        plan.action = ACTION_HOLD;
+                        continue;
                     }
                 }
-            }
-            
-            // Create walls around room
-            for (int y = startY; y < startY + roomHeight; y++) {
-                if (y < HEIGHT - 1 && y > 0) {
-                    map[y][startX] = WALL;
-                    map[y][startX + roomWidth - 1] = WALL;
+                
+                // Only move if not adjacent to player
+                if (!enemy->isAdjacent(player.x, player.y)) {
+                    plan.action = ACTION_MOVE;
+                    IntentRng rng(levelSeed, (uint32_t)turns, enemy->id);
+                    if (noticesPlayer(enemy)) {
+                        enemy->planMove(player.x, player.y, grid, rng, plan.intent);
+                    } else {
+                        enemy->planWander(grid, rng, plan.intent);
+                    }
                 }
             }
-            for (int x = startX; x < startX + roomWidth; x++) {
-                if (x < WIDTH - 1 && x > 0) {
-                    map[startY][x] = WALL;
-                    map[startY + roomHeight - 1][x] = WALL;
-                }
+        });
+    }
+    
+    // Phase two: apply the planned steps in id order. Each enemy takes the
+    // first of its candidate tiles that nobody occupies at that point, so
+    // two monsters never share a tile and lower ids win ties.
+    void commitEnemyMoves() {
+        for (size_t i = 0; i < turnEnemies.size(); i++) {
+            Enemy* enemy = turnEnemies[i];
+            const EnemyPlan& plan = plans[i];
+            if (plan.action != ACTION_MOVE) continue;
+            if (plan.intent.waitsOnCooldown) {
+                enemy->moveCooldown--;
+                continue;
             }
-            
-            // Add doors
-            int doorSide = rand() % 4;
-            int doorPos;
-            switch (doorSide) {
-                case 0: // North
-                    doorPos = startX + 1 + rand() % (roomWidth - 2);
-                    map[startY][doorPos] = FLOOR;
-                    break;
-                case 1: // East
-                    doorPos = startY + 1 + rand() % (roomHeight - 2);
-                    map[doorPos][startX + roomWidth - 1] = FLOOR;
-                    break;
-                case 2: // South
-                    doorPos = startX + 1 + rand() % (roomWidth - 2);
-                    map[startY + roomHeight - 1][doorPos] = FLOOR;
-                    break;
-                case 3: // West
-                    doorPos = startY + 1 + rand() % (roomHeight - 2);
-                    map[doorPos][startX] = FLOOR;
-                    break;
+            for (int c = 0; c < plan.intent.count; c++) {
+                int nx = plan.intent.xs[c];
+                int ny = plan.intent.ys[c];
+                int index = ny * mapWidth + nx;
+                if (occupant[index] >= 0 || (nx == player.x && ny == player.y)) continue;
+                occupant[enemy->y * mapWidth + enemy->x] = -1;
+                occupant[index] = enemy->id;
+                enemy->x = nx;
+                enemy->y = ny;
+                rehashEnemy(enemy);
+                break;
             }
-            
-            // Add some items in the room
-            if (rand() % 3 == 0) {
-                int itemX = startX + 1 + rand() % (roomWidth - 2);
-                int itemY = startY + 1 + rand() % (roomHeight - 2);
-                if (rand() % 2 == 0) {
-                    map[itemY][itemX] = HEALTH;
-                } else {
-                    map[itemY][itemX] = GOLD;
+        }
+    }
+
+    // Goblins and trolls hunt by sight, so a player standing in the dark
+    // goes unnoticed unless they come close; slimes find you regardless
+    bool noticesPlayer(const Enemy* enemy) const {
+        return enemy->symbol == SLIME || playerLit || chebyshevToPlayer(enemy) <= DARK_SENSE;
+    }
+    
+    int chebyshevToPlayer(const Enemy* enemy) const {
+        return max(abs(enemy->x - player.x), abs(enemy->y - player.y));
+    }
+    
+    // Put a new or newly woken enemy in the tier its distance calls for
+    void assignTier(Enemy* enemy) {
+        int d = lodEnabled ? chebyshevToPlayer(enemy) : 0;
+        if (d <= ACTIVE_RADIUS) {
+            enemy->tier = TIER_ACTIVE;
+            if (!activeIds.empty() && activeIds.back() > enemy->id) activeUnsorted = true;
+            activeIds.push_back(enemy->id);
+        } else if (d <= DORMANT_RADIUS) {
+            enemy->tier = TIER_DISTANT;
+            distantBuckets[enemy->id % DISTANT_INTERVAL].push_back(enemy->id);
+        } else {
+            enemy->tier = TIER_DORMANT;
+            dormantBlocks[(enemy->y / LOD_BLOCK) * blocksX + enemy->x / LOD_BLOCK].push_back(enemy->id);
+        }
+    }
+    
+    // Wake every dormant enemy in the blocks overlapping the square around (x, y)
+    void makeNoise(int x, int y, int radius) {
+        if (!lodEnabled) return;
+        int bx0 = max(0, (x - radius) / LOD_BLOCK), bx1 = min(blocksX - 1, (x + radius) / LOD_BLOCK);
+        int by0 = max(0, (y - radius) / LOD_BLOCK);
+        int by1 = min((int)dormantBlocks.size() / blocksX - 1, (y + radius) / LOD_BLOCK);
+        for (int by = by0; by <= by1; by++) {
+            for (int bx = bx0; bx <= bx1; bx++) {
+                vector<int> sleepers;
+                sleepers.swap(dormantBlocks[by * blocksX + bx]);
+                for (int id : sleepers) {
+                    Enemy* enemy = enemyById[id];
+                    if (!enemy || enemy->tier != TIER_DORMANT) continue;
+                    // Anything that heard it at least starts heading over
+                    if (chebyshevToPlayer(enemy) <= ACTIVE_RADIUS) {
+                        assignTier(enemy);
+                    } else {
+                        enemy->tier = TIER_DISTANT;
+                        distantBuckets[enemy->id % DISTANT_INTERVAL].push_back(enemy->id);
+                    }
+                    if (enemy->regenPaused) {
+                        enemy->regenPaused = false;
+                        scheduleRegeneration(enemy);
+                    }
                 }
             }
         }
-        
-        // Place player in a safe spot
-        player.x = 2 + rand() % 5;
-        player.y = 2 + rand() % 5;
-        
-        // Place key, must be far from player
-        int keyX, keyY;
-        do {
-            keyX = 5 + rand() % (WIDTH - 10);
-            keyY = 5 + rand() % (HEIGHT - 10);
-        } while (map[keyY][keyX] != FLOOR || abs(keyX - player.x) + abs(keyY - player.y) < 15);
-        map[keyY][keyX] = KEY;
-        
-        // Place door, must be far from both player and key
-        int doorX, doorY;
-        do {
-            doorX = 5 + rand() % (WIDTH - 10);
-            doorY = 5 + rand() % (HEIGHT - 10);
-        } while (map[doorY][doorX] != FLOOR || 
-                 (abs(doorX - player.x) + abs(doorY - player.y) < 15) || 
-                 (abs(doorX - keyX) + abs(doorY - keyY) < 15));
-        map[doorY][doorX] = DOOR;
-        
-        // Place stairs to next level
-        if (dungeonLevel < 5) {
-            int stairsX, stairsY;
-            do {
-                stairsX = 5 + rand() % (WIDTH - 10);
-                stairsY = 5 + rand() % (HEIGHT - 10);
-            } while (map[stairsY][stairsX] != FLOOR || 
-                     (abs(stairsX - player.x) + abs(stairsY - player.y) < 15));
-            map[stairsY][stairsX] = STAIRS;
+    }
+    
+    // Work out which enemies get full AI this turn, and give a slice of the
+    // distant ones their coarse update. Cost is proportional to the active
+    // set plus 1/DISTANT_INTERVAL of the distant set; dormant enemies are
+    // only looked at when the player walks near their block or makes noise.
+    void updateSimulationTiers() {
+        turnEnemies.clear();
+        if (!lodEnabled) {
+            turnEnemies = enemies;
+            return;
         }
         
-        // Place items
-        placeItems();
-        
-        // Spawn enemies appropriate to level
-        spawnEnemies(dungeonLevel);
-        
-        // Reset key if changing levels
-        if (dungeonLevel > 1) {
-            player.hasKey = false;
+        // Walking into a new block counts as being seen by whatever sleeps nearby
+        int playerBlock = (player.y / LOD_BLOCK) * blocksX + player.x / LOD_BLOCK;
+        if (playerBlock != lastPlayerBlock) {
+            lastPlayerBlock = playerBlock;
+            makeNoise(player.x, player.y, DORMANT_RADIUS);
         }
         
-        addMessage("Welcome to dungeon level " + to_string(dungeonLevel) + "!");
-    }
-
-    void placeItems() {
-        // Health potions
-        int numHealthPotions = 3 + rand() % 3;
-        for (int i = 0; i < numHealthPotions; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR);
-            map[y][x] = HEALTH;
+        // Distant enemies whose turn it is shuffle along the flow field
+        vector<int>& bucket = distantBuckets[turns % DISTANT_INTERVAL];
+        if (!bucket.empty()) {
+            refreshFlowField();
+            size_t kept = 0;
+            for (size_t i = 0; i < bucket.size(); i++) {
+                Enemy* enemy = enemyById[bucket[i]];
+                if (!enemy || enemy->tier != TIER_DISTANT) continue;
+                stepAlongFlow(enemy, DISTANT_INTERVAL);
+                int d = chebyshevToPlayer(enemy);
+                if (d <= ACTIVE_RADIUS || d > DORMANT_RADIUS) {
+                    assignTier(enemy);
+                } else {
+                    bucket[kept++] = enemy->id;
+                }
+            }
+            bucket.resize(kept);
         }
         
-        // Gold
-        int numGold = 5 + rand() % 5;
-        for (int i = 0; i < numGold; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR);
-            map[y][x] = GOLD;
+        // Active enemies that fell far behind drop to the coarse tier
+        if (activeUnsorted) {
+            sort(activeIds.begin(), activeIds.end());
+            activeUnsorted = false;
         }
-        
-        // Weapons
-        int numWeapons = 1 + player.dungeonLevel / 2;
-        for (int i = 0; i < numWeapons; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR);
-            map[y][x] = WEAPON;
+        size_t kept = 0;
+        for (size_t i = 0; i < activeIds.size(); i++) {
+            Enemy* enemy = enemyById[activeIds[i]];
+            if (!enemy || enemy->tier != TIER_ACTIVE) continue;
+            if (chebyshevToPlayer(enemy) > ACTIVE_RADIUS + 4) {
+                enemy->tier = TIER_DISTANT;
+                distantBuckets[enemy->id % DISTANT_INTERVAL].push_back(enemy->id);
+                continue;
+            }
+            activeIds[kept++] = enemy->id;
+            turnEnemies.push_back(enemy);
         }
-        
-        // Armor
-        int numArmor = player.dungeonLevel / 2;
-        for (int i = 0; i < numArmor; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR);
-            map[y][x] = ARMOR;
+        activeIds.resize(kept);
+    }
+    
+    // Breadth-first distances from the player over a window of FLOW_RADIUS,
+    // rebuilt only once the player has wandered off or it has gone stale
+    void refreshFlowField() {
+        if (flowEpoch == levelEpoch && abs(player.x - flowX) <= 8 && abs(player.y - flowY) <= 8 &&
+            turns - flowTurn < 16) {
+            return;
         }
-        
-        // Traps
-        int numTraps = 2 + player.dungeonLevel;
-        for (int i = 0; i < numTraps; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR || (abs(x - player.x) + abs(y - player.y) < 5));
-            map[y][x] = TRAP;
+        flowEpoch = levelEpoch;
+        flowX = player.x;
+        flowY = player.y;
+        flowTurn = turns;
+        int side = 2 * FLOW_RADIUS + 1;
+        flowDistance.assign((size_t)side * side, -1);
+        vector<int> frontier, next;
+        flowDistance[FLOW_RADIUS * side + FLOW_RADIUS] = 0;
+        frontier.push_back(FLOW_RADIUS * side + FLOW_RADIUS);
+        for (int dist = 1; !frontier.empty(); dist++) {
+            next.clear();
+            for (int cell : frontier) {
+                int cx = cell % side, cy = cell / side;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = cx + dx, ny = cy + dy;
+                        if (nx < 0 || ny < 0 || nx >= side || ny >= side) continue;
+                        int index = ny * side + nx;
+                        if (flowDistance[index] >= 0) continue;
+                        if (!openBits.test(flowX - FLOW_RADIUS + nx, flowY - FLOW_RADIUS + ny)) continue;
+                        flowDistance[index] = dist;
+                        next.push_back(index);
+                    }
+                }
+            }
+            frontier.swap(next);
         }
     }
-
-    void spawnEnemies(int dungeonLevel) {
-        // Number of enemies scales with dungeon level
-        int numSlimes = 4 + dungeonLevel;
-        int numGoblins = 2 + dungeonLevel;
-        int numTrolls = dungeonLevel / 2;
-        
-        // Spawn slimes
-        for (int i = 0; i < numSlimes; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR || 
-                    (abs(x - player.x) + abs(y - player.y) < 10) ||
-                    isEnemyAt(x, y));
-            enemies.push_back(new Slime(x, y));
+    
+    int flowAt(int x, int y) const {
+        int fx = x - flowX + FLOW_RADIUS, fy = y - flowY + FLOW_RADIUS;
+        int side = 2 * FLOW_RADIUS + 1;
+        if (fx < 0 || fy < 0 || fx >= side || fy >= side) return -1;
+        return flowDistance[fy * side + fx];
+    }
+    
+    // Up to `steps` moves downhill on the flow field, into free tiles only
+    void stepAlongFlow(Enemy* enemy, int steps) {
+        for (int s = 0; s < steps; s++) {
+            int best = flowAt(enemy->x, enemy->y);
+            if (best < 0) return; // outside the field, wait for it to come closer
+            int bestX = -1, bestY = -1;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = enemy->x + dx, ny = enemy->y + dy;
+                    int d = flowAt(nx, ny);
+                    if (d < 0 || d >= best || isEnemyAt(nx, ny) || (nx == player.x && ny == player.y)) continue;
+                    best = d;
+                    bestX = nx;
+                    bestY = ny;
+                }
+            }
+            if (bestX < 0) return;
+            occupant[enemy->y * mapWidth + enemy->x] = -1;
+            occupant[bestY * mapWidth + bestX] = enemy->id;
+            enemy->x = bestX;
+            enemy->y = bestY;
+            rehashEnemy(enemy);
         }
-        
-        // Spawn goblins
-        for (int i = 0; i < numGoblins; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR || 
-                    (abs(x - player.x) + abs(y - player.y) < 10) ||
-                    isEnemyAt(x, y));
-            enemies.push_back(new Goblin(x, y));
+    }
+
+    // Copies what the search bot needs out of the live game
+    SimState snapshot() const {
+        SimState state;
+        state.tiles = CowGrid(map);
+        floorItems.forEach([&](int tile, const FloorItem& item) {
+            state.tiles.set(tile % mapWidth, tile / mapWidth, lootSymbol(item));
+        });
+        state.enemies.reserve(enemies.size());
+        for (auto enemy : enemies) {
+            if (enemy->health <= 0 || chebyshevToPlayer(enemy) > ACTIVE_RADIUS) continue;
+            SimEnemy sim;
+            sim.x = (int16_t)enemy->x;
+            sim.y = (int16_t)enemy->y;
+            sim.health = (int16_t)enemy->health;
+            sim.attack = (int16_t)enemy->attack;
+            sim.defense = (int16_t)enemy->defense;
+            sim.value = (int16_t)(enemy->experienceValue * 10);
+            state.enemies.push_back(sim);
         }
-        
-        // Spawn trolls
-        for (int i = 0; i < numTrolls; i++) {
-            int x, y;
-            do {
-                x = 1 + rand() % (WIDTH - 2);
-                y = 1 + rand() % (HEIGHT - 2);
-            } while (map[y][x] != FLOOR || 
-                    (abs(x - player.x) + abs(y - player.y) < 10) ||
-                    isEnemyAt(x, y));
-            enemies.push_back(new Troll(x, y));
+        state.px = player.x;
+        state.py = player.y;
+        state.health = player.health;
+        state.maxHealth = player.maxHealth;
+        state.attack = player.getTotalAttack();
+        state.defense = player.getTotalDefense();
+        state.gold = player.gold;
+        state.score = player.score;
+        for (auto item : player.inventory) {
+            if (dynamic_cast<HealthPotion*>(item)) state.potions++;
         }
+        state.level = player.dungeonLevel;
+        state.hasKey = player.hasKey;
+        state.rng = (stateHash ^ (uint64_t)turns * 0x9E3779B97F4A7C15ULL) | 1;
+        return state;
     }
     
-    bool isEnemyAt(int x, int y) const {
-        for (const auto& enemy : enemies) {
-            if (enemy->x == x && enemy->y == y) return true;
+    // Multi-source BFS from every item, enemy, and the exit, so the bot
+    // knows how far each tile is from something worth doing
+    void computeGoalDistance() {
+        withGrid([&](const auto& grid) { computeGoalDistance(grid); });
+    }
+    
+    template <class Grid>
+    void computeGoalDistance(const Grid& grid) {
+        vector<int>& dist = gridDistance;
+        dist.assign(grid.cellCount(), -1);
+        vector<int> queue;
+        queue.reserve(dist.size());
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; x++) {
+                char tile = map[y][x];
+                bool goal = itemBits.test(x, y) || tile == STAIRS || (tile == DOOR && player.hasKey);
+                if (goal || isEnemyAt(x, y)) {
+                    dist[grid.index(x, y)] = 0;
+                    queue.push_back(grid.index(x, y));
+                }
+            }
+        }
+        walkDistances(grid, queue, dist);
+        goalDistance.resize((size_t)mapWidth * mapHeight);
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; x++) {
+                int d = dist[grid.index(x, y)];
+                goalDistance[y * mapWidth + x] = d < 0 ? INT32_MAX : d;
+            }
         }
-        return false;
     }
     
-    Enemy* getEnemyAt(int x, int y) {
-        for (auto& enemy : enemies) {
-            if (enemy->x == x && enemy->y == y) return enemy;
+    BotAction botChoice() {
+        computeGoalDistance();
+        return bot.choose(snapshot(), goalDistance);
+    }
+    
+    void showHint() {
+        BotAction action = botChoice();
+        addMessage(string("Hint: ") + BOT_NAMES[action] + ".");
+    }
+    
+    // Lets the bot play until it dies or runs out of turns
+    void autoplay(int maxTurns) {
+        GameMemoryScope tally(&heapUsage);
+        while (!gameOver && turns < maxTurns) {
+            processInput(BOT_KEYS[botChoice()]);
+            draw(); // for spectators
         }
-        return nullptr;
     }
+    
+    // Builds level `level` of `seed` the way a new game would with --seed
+    // and --level, and measures it for the seed index. Nothing outside this
+    // GameManager is touched, so each thread can mine with its own.
+    // False if the level could not be laid out.
+    bool generateLevel(uint32_t seed, int level, LevelFeatures& features) {
+        GameMemoryScope tally(&heapUsage);
+        timers.clear(); // only the map is wanted, not the previous level's timers
+        rng.reseed(seed);
+        if (!initializeMap(level)) return false;
 
-    void setConsoleColor(Color textColor, Color bgColor = BLACK) {
-        SetConsoleTextAttribute(consoleHandle, textColor + (bgColor << 4));
+        features = {};
+        features.seed = seed;
+        features.level = (uint8_t)level;
+
+        // Walking distances from the start; the door doesn't block a walk
+        vector<uint16_t> steps((size_t)mapWidth * mapHeight, UNREACHABLE);
+        withGrid([&](const auto& grid) {
+            vector<int>& dist = gridDistance;
+            dist.assign(grid.cellCount(), -1);
+            vector<int> queue(1, grid.index(player.x, player.y));
+            dist[queue[0]] = 0;
+            walkDistances(grid, queue, dist);
+            for (int y = 0; y < mapHeight; y++) {
+                for (int x = 0; x < mapWidth; x++) {
+                    int d = dist[grid.index(x, y)];
+                    if (d >= 0) steps[y * mapWidth + x] = (uint16_t)min(d, UNREACHABLE - 1);
+                }
+            }
+        });
+
+        // Without the door, what can still be reached tells what it guards
+        Bitboard passable = ~wallBits;
+        int door = -1, stairs = -1, key = -1;
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; x++) {
+                if (map[y][x] == DOOR) {
+                    door = y * mapWidth + x;
+                    passable.reset(x, y);
+                } else if (map[y][x] == STAIRS) {
+                    stairs = y * mapWidth + x;
+                }
+            }
+        }
+        Bitboard open = Bitboard::floodFill(player.x, player.y, passable);
+
+        floorItems.forEach([&](int tile, const FloorItem& item) {
+            switch (item.kind) {
+                case LOOT_KEY: key = tile; break;
+                case LOOT_POTION: features.potions++; break;
+                case LOOT_WEAPON: features.weapons++; break;
+                case LOOT_ARMOR: features.armor++; break;
+                case LOOT_GOLD: features.gold = (uint16_t)min(features.gold + item.amount, 0xFFFF); break;
+            }
+        });
+        features.stairsSteps = stairs >= 0 ? steps[stairs] : UNREACHABLE;
+        features.keySteps = key >= 0 ? steps[key] : UNREACHABLE;
+        features.doorSteps = door >= 0 ? steps[door] : UNREACHABLE;
+        if (key >= 0 && features.keySteps != UNREACHABLE && !open.test(key % mapWidth, key / mapWidth)) {
+            features.flags |= LEVEL_KEY_BEHIND_DOOR;
+        }
+        if (stairs >= 0 && features.stairsSteps != UNREACHABLE && !open.test(stairs % mapWidth, stairs / mapWidth)) {
+            features.flags |= LEVEL_STAIRS_BEHIND_DOOR;
+        }
+        for (const Enemy* enemy : enemies) {
+            uint8_t& count = features.enemies[enemyKind(enemy->symbol)];
+            if (count < 255) count++;
+        }
+        features.litRooms = (uint8_t)min(roomLights.size(), (size_t)255);
+        return true;
     }
 
-    void resetConsoleColor() {
-        SetConsoleTextAttribute(consoleHandle, WHITE);
+    int getTurns() const { return turns; }
+    bool isGameOver() const { return gameOver; }
+    bool layoutFailed() const { return failedLevel > 0; }
+    string layoutError() const {
+        return "Could not lay out level " + to_string(failedLevel) + " on a " + to_string(mapWidth) + "x" +
+               to_string(mapHeight) + " map; try another --size";
     }
+    const Player& getPlayer() const { return player; }
+    long long botForks() const { return bot.forks; }
 
-    void draw() {
-        system("cls");
+    void processInput(char input) {
+        GameMemoryScope tally(&heapUsage);
+        switch(tolower(input)) {
+            case 'w': movePlayer(0, -1); update(); break;
+            case 's': movePlayer(0, 1); update(); break;
+            case 'a': movePlayer(-1, 0); update(); break;
+            case 'd': movePlayer(1, 0); update(); break;
+            case ' ': playerAttack(); update(); break;
+            case 'f': playerThrow(); update(); break;
+            case '1': castSpell(FIREBALL); update(); break;
+            case '2': castSpell(SHOCKWAVE); update(); break;
+            case '3': castSpell(POISON_CLOUD); update(); break;
+            case 'i': showInventory(); break;
+            case 'h': useHealthPotion(); update(); break;
+            case '?': showHint(); break;
+            case 'u': rewindTurn(false); break;
+            case 'r': rewindTurn(true); break;
+            case 'l': toggleTorch(); update(); break;
+            case 'm': overviewScale = overviewScale == 0 ? 4 : overviewScale == 4 ? 8 : 0; break;
+            case 'q': 
+                cout << "\nAre you sure you want to quit? (Y/N): ";
+                char choice = waitKey();
+                if (tolower(choice) == 'y') {
+                    gameOver = true;
+                    cout << recordRun(false);
+                }
+                break;
+        }
+    }
+    
+    // Log the finished run to the leaderboard; returns where it placed, for display
+    string recordRun(bool died) {
+        RunRecord run = {};
+        memcpy(run.player, config.playerName.data(), min(config.playerName.size(), sizeof(run.player)));
+        run.time = (int64_t)time(0);
+        run.score = player.score;
+        run.gold = player.gold;
+        run.depth = player.dungeonLevel;
+        run.level = player.level;
+        run.turns = turns;
+        for (int i = 0; i < ENEMY_KINDS; i++) {
+            run.kills[i] = (uint16_t)min(kills[i], 65535);
+        }
+        run.died = died;
         
-        // Draw HUD at top
-        setConsoleColor(LIGHTCYAN);
-        cout << "=== DUNGEON CRAWLER Level " << player.dungeonLevel << " ===" << endl;
+        Leaderboard board(config.leaderboard);
+        size_t rank = board.append(run);
+        if (rank == 0) return "";
+        ostringstream placement;
+        placement << "\nYour run placed #" << rank << " of " << board.size() << " on the leaderboard." << endl;
+        printRuns(board.top(5), placement);
+        return placement.str();
+    }
+    
+    void renderGameOver(const string& placement) {
+        screen.clear();
+        int row = screen.lines(2,
+            "  #####     #    #     # #######    ####### #     # ####### ######  \n"
+            " #     #   # #   ##   ## #          #     # #     # #       #     # \n"
+            " #        #   #  # # # # #          #     # #     # #       #     # \n"
+            " #  #### #     # #  #  # #####      #     # #     # #####   ######  \n"
+            " #     # ####### #     # #          #     #  #   #  #       #   #   \n"
+            " #     # #     # #     # #          #     #   # #   #       #    #  \n"
+            "  #####  #     # #     # #######    #######    #    ####### #     # \n", RED);
         
-        // Draw map
-        for (int y = 0; y < HEIGHT; y++) {
-            for (int x = 0; x < WIDTH; x++) {
-                if (x == player.x && y == player.y) {
-                    setConsoleColor(YELLOW);
-                    cout << PLAYER;
-                } else {
-                    // Check for enemy
-                    bool isEnemyPos = false;
-                    for (const auto& enemy : enemies) {
-                        if (x == enemy->x && y == enemy->y) {
-                            switch (enemy->symbol) {
-                                case SLIME:
-                                    setConsoleColor(GREEN);
-                                    break;
-                                case GOBLIN:
-                                    setConsoleColor(LIGHTRED);
-                                    break;
-                                case TROLL:
-                                    setConsoleColor(RED);
-                                    break;
-                                default:
-                                    setConsoleColor(LIGHTGRAY);
-                            }
-                            cout << enemy->symbol;
-                            isEnemyPos = true;
-                            break;
-                        }
-                    }
-                    
-                    if (!isEnemyPos) {
-                        // Set color based on tile type
-                        switch (map[y][x]) {
-                            case WALL:
-                                setConsoleColor(DARKGRAY);
-                                break;
-                            case FLOOR:
-                                setConsoleColor(LIGHTGRAY);
-                                break;
-                            case KEY:
-                                setConsoleColor(YELLOW);
-                                break;
-                            case DOOR:
-                                setConsoleColor(BROWN);
-                                break;
-                            case HEALTH:
-                                setConsoleColor(LIGHTGREEN);
-                                break;
-                            case WEAPON:
-                                setConsoleColor(CYAN);
-                                break;
-                            case ARMOR:
-                                setConsoleColor(BLUE);
-                                break;
-                            case TRAP:
-                                setConsoleColor(RED);
-                                break;
-                            case GOLD:
-                                setConsoleColor(YELLOW);
-                                break;
-                            case STAIRS:
-                                setConsoleColor(MAGENTA);
-                                break;
-                            default:
-                                setConsoleColor(WHITE);
-                        }
-                        cout << map[y][x];
-                    }
+        int totalKills = 0;
+        for (int i = 0; i < ENEMY_KINDS; i++) totalKills += kills[i];
+        ostringstream summary;
+        summary << "You died on dungeon level " << player.dungeonLevel << "!\n";
+        summary << "Final score: " << player.score << endl;
+        summary << "Gold collected: " << player.gold << endl;
+        summary << "Player level: " << player.level << endl;
+        summary << "Enemies defeated: " << totalKills << endl;
+        for (int i = 0; i < ENEMY_KINDS; i++) {
+            if (kills[i] > 0) summary << "  " << ENEMY_KIND_NAMES[i] << ": " << kills[i] << endl;
+        }
+        summary << placement;
+        row = screen.lines(row + 2, summary.str(), WHITE);
+        if (!config.headless) screen.line(row + 1, "Press any key to exit...", WHITE);
+    }
+
+    void run() {
+        GameMemoryScope tally(&heapUsage);
+        if (config.tickRate > 0) {
+            runRealTime();
+            return;
+        }
+        while (!gameOver) {
+            draw();
+            processInput(nextKey());
+        }
+    }
+    
+    // The next key of turn-based play. With hibernation on, a wait longer
+    // than config.hibernateAfter moves the level to disk until the key comes.
+    char nextKey() {
+        if (config.hibernateAfter <= 0) return (char)_getch();
+        chrono::steady_clock::time_point idleSince = chrono::steady_clock::now();
+        while (!_kbhit()) {
+            if (chrono::steady_clock::now() - idleSince >= chrono::seconds(config.hibernateAfter)) {
+                bool hibernated = hibernate();
+                char key = (char)_getch();
+                if (hibernated && !resume()) {
+                    cout << "\nCould not restore the game from " << hibernatePath() << "." << endl;
+                    gameOver = true;
+                    return 0;
                 }
+                return key;
             }
-            cout << endl;
+            this_thread::sleep_for(chrono::milliseconds(50));
         }
-
-        // Draw player stats
-        setConsoleColor(WHITE);
-        cout << "\nHealth: " << player.health << "/" << player.maxHealth 
-             << " | Level: " << player.level 
-             << " | XP: " << player.experience << "/" << player.experienceToLevel 
-             << " | Gold: " << player.gold 
-             << " | Score: " << player.score << endl;
-        
-        cout << "Weapon: " << (player.equippedWeapon ? player.equippedWeapon->name : "None") 
-             << " (ATK: " << player.getTotalAttack() << ")" 
-             << " | Armor: " << (player.equippedArmor ? player.equippedArmor->name : "None") 
-             << " (DEF: " << player.getTotalDefense() << ")" 
-             << " | Key: " << (player.hasKey ? "YES" : "NO") << endl;
+        return (char)_getch();
+    }
+    
+    string hibernatePath() const {
+        return "crawler-" + to_string(GetCurrentProcessId()) + ".hib";
+    }
+    
+    static Enemy* makeEnemy(char symbol, int x, int y) {
+        switch (symbol) {
+            case SLIME: return new Slime(x, y);
+            case GOBLIN: return new Goblin(x, y);
+            case TROLL: return new Troll(x, y);
+            case ARCHER: return new GoblinArcher(x, y);
+            default: return new BoulderTroll(x, y);
+        }
+    }
+    
+    static void packEnemy(const Enemy* enemy, bool buried, vector<uint8_t>& out) {
+        HibernatedEnemy record = {};
+        record.id = enemy->id;
+        record.x = enemy->x;
+        record.y = enemy->y;
+        record.health = enemy->health;
+        record.maxHealth = enemy->maxHealth;
+        record.attack = enemy->attack;
+        record.defense = enemy->defense;
+        record.experienceValue = enemy->experienceValue;
+        record.goldValue = enemy->goldValue;
+        record.moveCooldown = enemy->moveCooldown;
+        record.range = enemy->range;
+        record.reloadTime = enemy->reloadTime;
+        record.reload = enemy->reload;
+        record.journalPos = enemy->journalPos;
+        record.journalHealth = enemy->journalHealth;
+        record.overviewBlock = enemy->overviewBlock;
+        record.light = enemy->light;
+        record.hashKey = enemy->hashKey;
+        record.tier = enemy->tier;
+        record.symbol = enemy->symbol;
+        record.flags = (enemy->hasAttacked ? HIBERNATE_ATTACKED : 0) |
+                       (enemy->holdsDistance ? HIBERNATE_HOLDS_DISTANCE : 0) |
+                       (enemy->regenerates ? HIBERNATE_REGENERATES : 0) |
+                       (enemy->regenPaused ? HIBERNATE_REGEN_PAUSED : 0) |
+                       (enemy->journalDirty ? HIBERNATE_JOURNAL_DIRTY : 0) |
+                       (buried ? HIBERNATE_BURIED : 0);
+        putRaw(out, &record, 1);
+    }
+    
+    static Enemy* unpackEnemy(const HibernatedEnemy& record) {
+        Enemy* enemy = makeEnemy(record.symbol, record.x, record.y);
+        enemy->id = record.id;
+        enemy->health = record.health;
+        enemy->maxHealth = record.maxHealth;
+        enemy->attack = record.attack;
+        enemy->defense = record.defense;
+        enemy->experienceValue = record.experienceValue;
+        enemy->goldValue = record.goldValue;
+        enemy->moveCooldown = record.moveCooldown;
+        enemy->range = record.range;
+        enemy->reloadTime = record.reloadTime;
+        enemy->reload = record.reload;
+        enemy->journalPos = record.journalPos;
+        enemy->journalHealth = record.journalHealth;
+        enemy->overviewBlock = record.overviewBlock;
+        enemy->light = record.light;
+        enemy->hashKey = record.hashKey;
+        enemy->tier = record.tier;
+        enemy->hasAttacked = (record.flags & HIBERNATE_ATTACKED) != 0;
+        enemy->holdsDistance = (record.flags & HIBERNATE_HOLDS_DISTANCE) != 0;
+        enemy->regenerates = (record.flags & HIBERNATE_REGENERATES) != 0;
+        enemy->regenPaused = (record.flags & HIBERNATE_REGEN_PAUSED) != 0;
+        enemy->journalDirty = (record.flags & HIBERNATE_JOURNAL_DIRTY) != 0;
+        return enemy;
+    }
+    
+    // Write the level to hibernatePath() and free it. False if the file
+    // could not be written, in which case nothing is freed.
+    bool hibernate() {
+        HibernateHeader header = {};
+        header.magic = HIBERNATE_MAGIC;
+        header.mapWidth = mapWidth;
+        header.mapHeight = mapHeight;
+        header.enemyIds = (uint32_t)enemyById.size();
+        header.buriedIds = (uint32_t)buried.size();
         
-        // Draw messages
-        setConsoleColor(LIGHTCYAN);
-        cout << "\n--- Messages ---" << endl;
-        setConsoleColor(WHITE);
-        if (messages.empty()) {
-            cout << "No messages yet." << endl;
-        } else {
-            for (const auto& msg : messages) {
-                cout << msg << endl;
+        vector<uint8_t> tiles, records, items, entries, log;
+        for (int y = 0; y < mapHeight; y++) {
+            for (int x = 0; x < mapWidth; ) {
+                char tile = map[y][x];
+                int run = 1;
+                while (x + run < mapWidth && run < 255 && map[y][x + run] == tile) run++;
+                tiles.push_back((uint8_t)run);
+                tiles.push_back((uint8_t)tile);
+                header.tileRuns++;
+                x += run;
             }
         }
+        for (const Enemy* enemy : enemies) packEnemy(enemy, false, records);
+        for (const Enemy* enemy : buried) {
+            if (enemy) packEnemy(enemy, true, records);
+        }
+        header.enemies = (uint32_t)(records.size() / sizeof(HibernatedEnemy));
+        floorItems.forEach([&](int tile, const FloorItem& item) {
+            int32_t pair[2] = { tile, (int32_t)item.pack() };
+            putRaw(items, pair, 2);
+            header.items++;
+        });
+        journal.forEach([&](const JournalEntry& entry) {
+            putRaw(entries, &entry, 1);
+            header.journal++;
+        });
+        for (const string& message : messages) {
+            uint16_t length = (uint16_t)min<size_t>(message.size(), 65535);
+            putRaw(log, &length, 1);
+            putRaw(log, message.data(), length);
+            header.messages++;
+        }
         
-        // Draw controls
-        setConsoleColor(LIGHTCYAN);
-        cout << "\n--- Controls ---" << endl;
-        setConsoleColor(WHITE);
-        cout << "Move: WASD | Attack: Space | Inventory: I | Use Health Potion: H | Quit: Q" << endl;
+        FILE* file = fopen(hibernatePath().c_str(), "wb");
+        if (!file) return false;
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const vector<uint8_t>* part : { &tiles, &records, &items, &entries, &log }) {
+            if (!part->empty()) written = written && fwrite(part->data(), part->size(), 1, file) == 1;
+        }
+        written = fclose(file) == 0 && written;
+        if (!written) {
+            ::remove(hibernatePath().c_str());
+            return false;
+        }
         
-        resetConsoleColor();
+        vector<vector<char>>().swap(map);
+        for (Enemy* enemy : enemies) delete enemy;
+        for (Enemy* enemy : buried) delete enemy;
+        vector<Enemy*>().swap(enemies);
+        vector<Enemy*>().swap(enemyById);
+        vector<Enemy*>().swap(buried);
+        vector<Enemy*>().swap(turnEnemies);
+        vector<Enemy*>().swap(blastTargets);
+        vector<EnemyPlan>().swap(plans);
+        vector<int>().swap(occupant);
+        vector<int>().swap(goalDistance);
+        floorItems = FloorItems();
+        lights.release();
+        journal.release();
+        vector<string>().swap(messages);
+        if (config.metrics) config.metrics->sessionHibernated();
+        return true;
     }
     
-    void addMessage(const string& message) {
-        messages.push_back(message);
-        if (messages.size() > maxMessages) {
-            messages.erase(messages.begin());
-        }
-    }
-
-    void playerAttack() {
-        bool hitEnemy = false;
-        int x = player.x;
-        int y = player.y;
+    // Read back what hibernate() wrote and rebuild the caches it freed
+    bool resume() {
+        string path = hibernatePath();
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        vector<uint8_t> data;
+        fseek(file, 0, SEEK_END);
+        data.resize((size_t)max(ftell(file), 0L));
+        fseek(file, 0, SEEK_SET);
+        bool read = data.empty() || fread(data.data(), data.size(), 1, file) == 1;
+        fclose(file);
         
-        // Check all adjacent positions for enemies
-        for (int dy = -1; dy <= 1; dy++) {
-            for (int dx = -1; dx <= 1; dx++) {
-                if (dx == 0 && dy == 0) continue; // Skip player's own position
-                
-                int targetX = x + dx;
-                int targetY = y + dy;
-                Enemy* target = getEnemyAt(targetX, targetY);
-                
-                if (target) {
-                    hitEnemy = true;
-                    int damage = player.getTotalAttack();
-                    // Chance for critical hit
-                    if (rand() % 10 == 0) {
-                        damage *= 2;
-                        addMessage("Critical hit! You strike the " + target->name + " for " + to_string(damage) + " damage!");
-                    } else {
-                        addMessage("You hit the " + target->name + " for " + to_string(damage) + " damage!");
-                    }
-                    
-                    target->takeDamage(damage);
-                    
-                    // Weapon durability
-                    if (player.equippedWeapon && player.equippedWeapon->durability > 0) {
-                        player.equippedWeapon->durability--;
-                        if (player.equippedWeapon->durability <= 0) {
-                            addMessage("Your " + player.equippedWeapon->name + " broke!");
-                            delete player.equippedWeapon;
-                            player.equippedWeapon = new Weapon("Fists", 3, -1); // -1 for infinite durability
-                        }
-                    }
-                    break;
-                }
+        ByteReader in{ data };
+        HibernateHeader header;
+        if (!read || !in.get(&header, 1) || header.magic != HIBERNATE_MAGIC ||
+            header.mapWidth != mapWidth || header.mapHeight != mapHeight) {
+            return false;
+        }
+        
+        // Every count must fit in what the file holds before anything is
+        // sized by it; enemies only spawn on distinct tiles of one level
+        uint64_t tiles = (uint64_t)mapWidth * mapHeight;
+        uint64_t needed = (uint64_t)header.tileRuns * 2 + (uint64_t)header.enemies * sizeof(HibernatedEnemy) +
+                          (uint64_t)header.items * 2 * sizeof(int32_t) + (uint64_t)header.journal * sizeof(JournalEntry) +
+                          (uint64_t)header.messages * sizeof(uint16_t);
+        if (needed > data.size() - in.pos || header.enemyIds > tiles || header.buriedIds > header.enemyIds) {
+            return false;
+        }
+        if (!restoreLevel(in, header)) {
+            discardLevel();
+            return false;
+        }
+        
+        MemoryScope scope(MEM_LEVEL_CACHE);
+        lights.restore();
+        ::remove(path.c_str());
+        if (config.metrics) config.metrics->sessionResumed();
+        if (config.verifyHash && stateHash != computeStateHash()) {
+            addMessage("State hash mismatch after resuming!");
+        }
+        return true;
+    }
+    
+    // The level part of resume(); false on a record that doesn't fit the map
+    bool restoreLevel(ByteReader& in, const HibernateHeader& header) {
+        MemoryScope scope(MEM_MAP);
+        map.assign(mapHeight, vector<char>(mapWidth, WALL));
+        int x = 0, y = 0;
+        for (uint32_t i = 0; i < header.tileRuns; i++) {
+            uint8_t run[2];
+            if (!in.get(run, 2) || y >= mapHeight || x + run[0] > mapWidth) return false;
+            memset(&map[y][x], (char)run[1], run[0]);
+            x += run[0];
+            if (x == mapWidth) {
+                x = 0;
+                y++;
             }
-            if (hitEnemy) break;
         }
-
-        // Remove dead enemies
-        auto it = enemies.begin();
-        while (it != enemies.end()) {
-            if ((*it)->health <= 0) {
-                addMessage("You defeated the " + (*it)->name + "! Gained " + 
-                           to_string((*it)->experienceValue) + " XP and " + 
-                           to_string((*it)->goldValue) + " gold.");
-                player.gainExperience((*it)->experienceValue);
-                player.gold += (*it)->goldValue;
-                player.score += (*it)->experienceValue * 10;
-                delete *it;
-                it = enemies.erase(it);
-            } else {
-                ++it;
+        
+        scope.switchTo(MEM_LEVEL_CACHE);
+        occupant.assign((size_t)mapWidth * mapHeight, -1);
+        scope.switchTo(MEM_ENEMIES);
+        enemyById.assign(header.enemyIds, nullptr);
+        buried.assign(header.buriedIds, nullptr);
+        for (uint32_t i = 0; i < header.enemies; i++) {
+            HibernatedEnemy record;
+            if (!in.get(&record, 1) || record.id < 0 || record.x < 0 || record.x >= mapWidth ||
+                record.y < 0 || record.y >= mapHeight) {
+                return false;
+            }
+            if (record.flags & HIBERNATE_BURIED) {
+                if ((uint32_t)record.id >= buried.size() || buried[record.id]) return false;
+                buried[record.id] = unpackEnemy(record);
+                continue;
             }
+            if ((uint32_t)record.id >= enemyById.size() || enemyById[record.id]) return false;
+            Enemy* enemy = unpackEnemy(record);
+            enemies.push_back(enemy);
+            enemyById[enemy->id] = enemy;
+            occupant[enemy->y * mapWidth + enemy->x] = enemy->id;
         }
-
-        if (!hitEnemy) {
-            addMessage("You swing at nothing!");
+        
+        // Piles were written head first and push() adds at the head
+        scope.switchTo(MEM_ITEMS);
+        vector<int32_t> items(header.items * 2);
+        if (!in.get(items.data(), items.size())) return false;
+        for (size_t i = 0; i < header.items; i++) {
+            if (items[2 * i] < 0 || items[2 * i] >= mapWidth * mapHeight) return false;
+        }
+        for (size_t i = header.items; i-- > 0; ) {
+            floorItems.push(items[2 * i], FloorItem::unpack((uint32_t)items[2 * i + 1]));
+        }
+        
+        scope.switchTo(MEM_LEVEL_CACHE);
+        vector<JournalEntry> entries(header.journal);
+        if (!in.get(entries.data(), entries.size())) return false;
+        journal.restore(entries);
+        
+        scope.switchTo(MEM_MESSAGES);
+        for (uint32_t i = 0; i < header.messages; i++) {
+            uint16_t length;
+            if (!in.get(&length, 1)) return false;
+            if (length > in.data.size() - in.pos) return false;
+            string message(length, ' ');
+            if (!in.get(&message[0], length)) return false;
+            messages.push_back(message);
         }
+        return true;
     }
     
-    void showInventory() {
-        system("cls");
-        cout << "=== INVENTORY ===" << endl;
-        cout << "Items: " << player.inventory.size() << "/" << player.inventorySize << endl << endl;
+    // Frees what a failed restoreLevel() unpacked, leaving the level as
+    // hibernate() left it
+    void discardLevel() {
+        for (Enemy* enemy : enemies) delete enemy;
+        for (Enemy* enemy : buried) delete enemy;
+        vector<Enemy*>().swap(enemies);
+        vector<Enemy*>().swap(enemyById);
+        vector<Enemy*>().swap(buried);
+        vector<int>().swap(occupant);
+        vector<vector<char>>().swap(map);
+        floorItems = FloorItems();
+        journal.release();
+        vector<string>().swap(messages);
+    }
+    
+    // Real-time play: the world ticks at config.tickRate whether or not a
+    // key is pressed, one queued key per tick, and a turn passes on its own
+    // after half a second without input. Ticks run against absolute
+    // deadlines so they never drift, and the screen is only redrawn when
+    // something changed and the draw fits before the next deadline.
+    void runRealTime() {
+        typedef chrono::steady_clock Clock;
+        const Clock::duration period = chrono::nanoseconds(1000000000LL / config.tickRate);
+        const Clock::duration spinMargin = chrono::microseconds(1500); // sleep overshoot to absorb by spinning
+        const int idleTicks = max(1, config.tickRate / 2);
+        const size_t maxQueuedKeys = 4;   // typing further ahead than this is dropped
+        const int maxSkippedDraws = 8;    // draw anyway if it has been put off this many ticks
         
-        if (player.inventory.empty()) {
-            cout << "Your inventory is empty." << endl;
-        } else {
-            for (size_t i = 0; i < player.inventory.size(); i++) {
-                cout << (i + 1) << ". " << player.inventory[i]->name << " - " 
-                     << player.inventory[i]->description << endl;
+        timeBeginPeriod(1); // millisecond sleep resolution while ticking
+        deque<char> keys;
+        vector<uint32_t> latencies; // microseconds from each deadline to the end of its tick
+        int missed = 0, idle = 0, skippedDraws = 0;
+        bool dirty = false;
+        Clock::duration drawCost(0);
+        draw();
+        Clock::time_point deadline = Clock::now() + period;
+        while (!gameOver) {
+            // Sleep most of the way to the deadline, then spin off the rest
+            if (Clock::now() < deadline - spinMargin) this_thread::sleep_until(deadline - spinMargin);
+            while (Clock::now() < deadline) this_thread::yield();
+            
+            while (_kbhit()) {
+                char key = (char)_getch();
+                if (keys.size() < maxQueuedKeys) keys.push_back(key);
+            }
+            inputWait = Clock::duration(0);
+            if (!keys.empty()) {
+                char key = keys.front();
+                keys.pop_front();
+                processInput(key);
+                idle = 0;
+                dirty = true;
+            } else if (++idle >= idleTicks) {
+                update();
+                idle = 0;
+                dirty = true;
             }
             
-            cout << "\nEnter the number of the item to use, or 0 to return: ";
-            int choice;
-            cin >> choice;
-
-            if (choice > 0 && choice <= player.inventory.size()) {
-                player.useItem(choice - 1);
-                addMessage("You used " + player.inventory[choice - 1]->name);
+            Clock::time_point finished = Clock::now();
+            latencies.push_back((uint32_t)chrono::duration_cast<chrono::microseconds>(finished - deadline - inputWait).count());
+            deadline += period;
+            if (inputWait > Clock::duration(0)) {
+                // A menu or prompt paused the game; pick the ticks up again from here
+                deadline = finished + period;
+            } else if (finished >= deadline) {
+                // Overran into the next tick: skip the ticks already missed instead of rushing them
+                missed++;
+                deadline += period * ((finished - deadline) / period + 1);
+            }
+            
+            if (dirty && !gameOver) {
+                Clock::time_point start = Clock::now();
+                if (start + drawCost < deadline || ++skippedDraws >= maxSkippedDraws) {
+                    draw();
+                    drawCost = Clock::now() - start;
+                    dirty = false;
+                    skippedDraws = 0;
+                }
             }
         }
+        timeEndPeriod(1);
         
-        cout << "\nPress any key to return to the game...";
-        _getch();
+        if (latencies.empty()) return;
+        sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))] / 1000.0; };
+        char report[192];
+        snprintf(report, sizeof(report), "%zu ticks at %d Hz: tick latency p50 %.2f ms, p99 %.2f ms, max %.2f ms, %d deadlines missed",
+                 latencies.size(), config.tickRate, percentile(0.50), percentile(0.99), latencies.back() / 1000.0, missed);
+        cout << "\n" << report << endl;
     }
-    
-    void useHealthPotion() {
-        // Find a health potion in inventory
-        for (size_t i = 0; i < player.inventory.size(); i++) {
-            if (dynamic_cast<HealthPotion*>(player.inventory[i])) {
-                player.useItem(i);
-                addMessage("You used a Health Potion. Health restored!");
-                return;
-            }
+};
+
+// Headless playtesting: the search bot plays whole games and reports how they went
+int runAutoplay(GameConfig config) {
+    config.headless = true;
+    long long totalTurns = 0, totalScore = 0, totalForks = 0;
+    int deepest = 0;
+    clock_t start = clock();
+    unsigned baseSeed = config.seed ? config.seed : (unsigned)time(0);
+    for (int game = 1; game <= config.autoplay; game++) {
+        config.seed = baseSeed + game;
+        GameManager manager(config);
+        manager.autoplay(2000);
+        if (manager.layoutFailed()) {
+            cout << manager.layoutError() << endl;
+            return 1;
         }
-        addMessage("You don't have any health potions!");
+        const Player& player = manager.getPlayer();
+        cout << "Game " << game << ": " << (player.health <= 0 ? "died" : "survived")
+             << " on level " << player.dungeonLevel << " after " << manager.getTurns()
+             << " turns, score " << player.score << endl;
+        totalTurns += manager.getTurns();
+        totalScore += player.score;
+        totalForks += manager.botForks();
+        deepest = max(deepest, player.dungeonLevel);
     }
+    double seconds = max(1e-9, (double)(clock() - start) / CLOCKS_PER_SEC);
+    cout << "Average score " << totalScore / config.autoplay << ", average turns "
+         << totalTurns / config.autoplay << ", deepest level " << deepest << endl;
+    cout << (long long)(totalForks / seconds) << " state forks per second" << endl;
+    printMemoryReport();
+    return 0;
+}
 
-    void update() {
-        turns++;
-        
-        // Check items at player's position
-        switch (map[player.y][player.x]) {
-            case KEY:
-                player.hasKey = true;
-                map[player.y][player.x] = FLOOR;
-                addMessage("You picked up the key!");
-                break;
-                
-            case HEALTH:
-                map[player.y][player.x] = FLOOR;
-                // Add potion to inventory
-                player.addToInventory(new HealthPotion(20 + rand() % 21)); // 20-40 healing
-                addMessage("You found a health potion!");
-                break;
-                
-            case GOLD:
-                {
-                    int goldAmount = 5 + rand() % (10 * player.dungeonLevel);
-                    player.gold += goldAmount;
-                    player.score += goldAmount;
-                    map[player.y][player.x] = FLOOR;
-                    addMessage("You found " + to_string(goldAmount) + " gold!");
-                }
-                break;
-                
-            case WEAPON:
-                {
-                    // Generate a weapon based on dungeon level
-                    string weaponName;
-                    int damage, durability;
-                    
-                    int weaponType = rand() % 5;
-                    switch (weaponType) {
-                        case 0:
-                            weaponName = "Sword";
-                            damage = 8 + player.dungeonLevel * 2;
-                            durability = 50 + player.dungeonLevel * 5;
-                            break;
-                        case 1:
-                            weaponName = "Axe";
-                            damage = 10 + player.dungeonLevel * 2;
-                            durability = 40 + player.dungeonLevel * 4;
-                            break;
-                        case 2:
-                            weaponName = "Mace";
-                            damage = 12 + player.dungeonLevel * 2;
-                            durability = 35 + player.dungeonLevel * 3;
-                            break;
-                        case 3:
-                            weaponName = "Spear";
-                            damage = 9 + player.dungeonLevel * 2;
-                            durability = 45 + player.dungeonLevel * 4;
-                            break;
-                        case 4:
-                            weaponName = "Dagger";
-                            damage = 6 + player.dungeonLevel * 2;
-                            durability = 60 + player.dungeonLevel * 6;
-                            break;
-                    }
-                    
-                    // Add quality prefix
-                    string prefix;
-                    int qualityBonus = rand() % 4;
-                    switch (qualityBonus) {
-                        case 0: prefix = "Rusty"; damage -= 2; break;
-                        case 1: prefix = "Normal"; break;
-                        case 2: prefix = "Sharp"; damage += 2; break;
-                        case 3: prefix = "Masterwork"; damage += 4; durability += 10; break;
-                    }
-                    
-                    Weapon* newWeapon = new Weapon(prefix + " " + weaponName, damage, durability);
-                    
-                    // Compare with current weapon
-                    string currentWeaponInfo = player.equippedWeapon ? 
-                        player.equippedWeapon->name + " (DMG: " + to_string(player.equippedWeapon->damage) + ")" : "None";
-                    
-                    addMessage("Found: " + newWeapon->name + " (DMG: " + to_string(newWeapon->damage) + 
-                              "). Current: " + currentWeaponInfo);
-                    
-                    // Ask player if they want to equip the new weapon
-                    draw();
-                    cout << "\nEquip " << newWeapon->name << "? (Y/N): ";
-                    char choice = _getch();
-                    if (tolower(choice) == 'y') {
-                        player.equipWeapon(newWeapon);
-                        addMessage("Equipped " + newWeapon->name + "!");
-                    } else {
-                        delete newWeapon;
-                        addMessage("You leave the " + weaponName + " behind.");
+// Generates levels 1 to MINED_LEVELS of `count` seeds from config.seed on
+// every core and writes their features to `path`, grouped by level
+int mineSeeds(GameConfig config, const string& path, uint32_t count) {
+    config.headless = true;
+    config.telemetry = nullptr;
+    config.spectators = nullptr;
+    config.recorder = nullptr;
+    config.metrics = nullptr;
+    config.rewind = 0;
+    config.startLevel = 1;
+    fill(begin(config.memoryBudget), end(config.memoryBudget), 0);
+    uint32_t firstSeed = config.seed ? config.seed : 1;
+    int threads = config.threads > 0 ? config.threads : max(1, (int)thread::hardware_concurrency());
+    config.threads = 1; // the parallelism is across seeds, not within a game
+
+    // Workers claim seeds in batches and keep their records per level
+    const uint32_t BATCH = 256;
+    atomic<uint32_t> nextSeed{ 0 };
+    vector<array<vector<LevelFeatures>, MINED_LEVELS>> found(threads);
+    mutex failureLock;
+    string failure; // the first layout error, which stops every worker
+    atomic<bool> failed{ false };
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t] {
+            GameManager game(config);
+            LevelFeatures features;
+            while (!game.layoutFailed() && !failed.load(memory_order_relaxed)) {
+                uint32_t from = nextSeed.fetch_add(BATCH);
+                if (from >= count) break;
+                uint32_t to = min(count, from + BATCH);
+                for (uint32_t i = from; i < to && !game.layoutFailed(); i++) {
+                    for (int level = 1; level <= MINED_LEVELS && game.generateLevel(firstSeed + i, level, features); level++) {
+                        found[t][level - 1].push_back(features);
                     }
-                    
-                    map[player.y][player.x] = FLOOR;
                 }
-                break;
-                
-            case ARMOR:
-                {
-                    // Generate armor based on dungeon level
-                    string armorName;
-                    int defense;
-                    
-                    int armorType = rand() % 4;
-                    switch (armorType) {
-                        case 0:
-                            armorName = "Leather Armor";
-                            defense = 3 + player.dungeonLevel;
-                            break;
-                        case 1:
-                            armorName = "Chain Mail";
-                            defense = 5 + player.dungeonLevel;
-                            break;
-                        case 2:
-                            armorName = "Plate Armor";
-                            defense = 7 + player.dungeonLevel;
-                            break;
-                        case 3:
-                            armorName = "Scale Mail";
-                            defense = 4 + player.dungeonLevel;
-                            break;
-                    }
-                    
-                    // Add quality prefix
-                    string prefix;
-                    int qualityBonus = rand() % 4;
-                    switch (qualityBonus) {
-                        case 0: prefix = "Tattered"; defense -= 1; break;
-                        case 1: prefix = "Standard"; break;
-                        case 2: prefix = "Reinforced"; defense += 1; break;
-                        case 3: prefix = "Mastercraft"; defense += 2; break;
-                    }
-                    
-                    Armor* newArmor = new Armor(prefix + " " + armorName, defense);
-                    
-                    // Compare with current armor
-                    string currentArmorInfo = player.equippedArmor ? 
-                        player.equippedArmor->name + " (DEF: " + to_string(player.equippedArmor->defense) + ")" : "None";
-                    
-                    addMessage("Found: " + newArmor->name + " (DEF: " + to_string(newArmor->defense) + 
-                              "). Current: " + currentArmorInfo);
-                    
-                    // Ask player if they want to equip the new armor
-                    draw();
-                    cout << "\nEquip " << newArmor->name << "? (Y/N): ";
-                    char choice = _getch();
-                    if (tolower(choice) == 'y') {
-                        player.equipArmor(newArmor);
-                        addMessage("Equipped " + newArmor->name + "!");
-                    } else {
-                        delete newArmor;
-                        addMessage("You leave the " + armorName + " behind.");
-                    }
-                    
-                    map[player.y][player.x] = FLOOR;
+            }
+            if (game.layoutFailed()) {
+                lock_guard<mutex> guard(failureLock);
+                if (!failed.exchange(true)) failure = game.layoutError();
+            }
+        }));
+    }
+    for (auto& worker : workers) worker.join();
+    if (failed) {
+        cout << failure << endl;
+        return 1;
+    }
+    double seconds = max(1e-9, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+    SeedIndexHeader header = {};
+    header.magic = SEED_INDEX_MAGIC;
+    header.mapWidth = max(config.mapWidth, WIDTH);
+    header.mapHeight = max(config.mapHeight, HEIGHT);
+    header.swarm = config.swarm;
+    header.firstSeed = firstSeed;
+    header.seeds = count;
+    vector<LevelFeatures> records;
+    records.reserve((size_t)count * MINED_LEVELS);
+    for (int level = 0; level < MINED_LEVELS; level++) {
+        header.levelStart[level] = (uint32_t)records.size();
+        size_t from = records.size();
+        for (auto& perThread : found) {
+            records.insert(records.end(), perThread[level].begin(), perThread[level].end());
+            vector<LevelFeatures>().swap(perThread[level]);
+        }
+        sort(records.begin() + from, records.end(),
+             [](const LevelFeatures& a, const LevelFeatures& b) { return a.seed < b.seed; });
+    }
+    header.levelStart[MINED_LEVELS] = (uint32_t)records.size();
+
+    FILE* file = fopen(path.c_str(), "wb");
+    bool written = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   (records.empty() || fwrite(records.data(), sizeof(LevelFeatures), records.size(), file) == records.size());
+    if (file) written = fclose(file) == 0 && written;
+    if (!written) {
+        cout << "Can't write " << path << endl;
+        return 1;
+    }
+    cout << records.size() << " levels from " << count << " seeds in " << seconds << "s on "
+         << threads << " threads, " << (long long)(records.size() / seconds) << " levels per second" << endl;
+    return 0;
+}
+
+// Prints the levels in a --mine-seeds file that match every term
+int findSeeds(const string& path, const vector<string>& terms) {
+    vector<SeedTerm> parsed;
+    int fromLevel = 1, toLevel = MINED_LEVELS;
+    for (const string& text : terms) {
+        SeedTerm term;
+        if (!parseSeedTerm(text, term)) {
+            cout << "Don't understand " << text << "; use a field with < <= > >= = or !=, or key-behind-door" << endl;
+            return 1;
+        }
+        // Level terms pick which part of the file is read at all
+        if (term.field && !strcmp(term.field->name, "level")) {
+            for (int level = fromLevel; level <= toLevel; level++) {
+                LevelFeatures probe = {};
+                probe.level = (uint8_t)level;
+                if (!term.matches(probe)) {
+                    if (level == fromLevel) fromLevel++;
+                    else { toLevel = level - 1; break; }
                 }
-                break;
-                
-            case TRAP:
-                {
-                    // Different trap effects
-                    int trapType = rand() % 3;
-                    switch (trapType) {
-                        case 0: // Damage trap
-                            {
-                                int damage = 5 + rand() % (5 * player.dungeonLevel);
-                                player.health -= damage;
-                                addMessage("You stepped on a spike trap! Took " + to_string(damage) + " damage!");
-                            }
-                            break;
-                        case 1: // Poison trap
-                            {
-                                int damage = 3 + player.dungeonLevel;
-                                player.health -= damage;
-                                addMessage("You triggered a poison gas trap! Took " + to_string(damage) + " damage!");
-                            }
-                            break;
-                        case 2: // Alarm trap
-                            {
-                                addMessage("You triggered an alarm! Nearby enemies are alerted!");
-                                // Make nearby enemies move faster towards player
-                                for (auto& enemy : enemies) {
-                                    if (abs(enemy->x - player.x) + abs(enemy->y - player.y) < 10) {
-                                        enemy->moveCooldown = 0;
-                                    }
-                                }
-                            }
-                            break;
-                    }
-                    map[player.y][player.x] = FLOOR; // Trap is triggered only once
+            }
+        }
+        parsed.push_back(term);
+    }
+
+    FILE* file = fopen(path.c_str(), "rb");
+    SeedIndexHeader header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1 || header.magic != SEED_INDEX_MAGIC) {
+        if (file) fclose(file);
+        cout << "Can't read a seed index from " << path << endl;
+        return 1;
+    }
+    cout << "Seeds " << header.firstSeed << " to " << header.firstSeed + header.seeds - 1 << " on a "
+         << header.mapWidth << "x" << header.mapHeight << " map, swarm " << header.swarm << endl;
+    uint64_t matches = 0;
+    if (fromLevel <= toLevel) {
+        uint32_t first = header.levelStart[fromLevel - 1], last = header.levelStart[toLevel];
+        _fseeki64(file, (int64_t)sizeof(header) + (int64_t)first * (int64_t)sizeof(LevelFeatures), SEEK_SET);
+        vector<LevelFeatures> chunk(4096);
+        for (uint32_t at = first; at < last; ) {
+            size_t want = min((size_t)(last - at), chunk.size());
+            if (fread(chunk.data(), sizeof(LevelFeatures), want, file) != want) break;
+            at += (uint32_t)want;
+            for (size_t i = 0; i < want; i++) {
+                const LevelFeatures& f = chunk[i];
+                bool match = true;
+                for (const SeedTerm& term : parsed) match = match && term.matches(f);
+                if (!match) continue;
+                if (++matches <= 20) {
+                    cout << "  --seed " << f.seed << " --level " << (int)f.level << ": stairs " << f.stairsSteps
+                         << ", key " << f.keySteps << (f.flags & LEVEL_KEY_BEHIND_DOOR ? " behind the door" : "")
+                         << ", door " << f.doorSteps << ", enemies";
+                    for (int k = 0; k < ENEMY_KINDS; k++) cout << " " << (int)f.enemies[k];
+                    cout << ", gold " << f.gold << endl;
                 }
-                break;
-                
-            case DOOR:
-                if (player.hasKey) {
-                    map[player.y][player.x] = FLOOR;
-                    player.hasKey = false;
-                    player.score += 100 * player.dungeonLevel;
-                    addMessage("You unlocked the door! +100 score points!");
+            }
+        }
+    }
+    fclose(file);
+    cout << matches << " matching levels" << endl;
+    return 0;
+}
+
+// Load testing ----------------------------------------------------------
+// --load N,N,... runs N headless games side by side in this process for
+// --load-seconds per step, each fed a key --load-rate times a second from
+// --load-script or at random. Turn latency is measured from when the key
+// was due, not when it was handled, so a core that can't keep up shows as
+// queueing in the tail instead of quietly playing fewer turns.
+
+struct LoadPlan {
+    vector<int> instances;  // game counts to step through
+    int rate = 10;          // keys per second per game, 0 = as fast as possible
+    int seconds = 10;       // per step
+    string script;          // keys cycled through, empty = random play
+};
+
+const char LOAD_KEYS[] = "wasdwasdwasd fhl123"; // random play, weighted towards walking
+
+// Resident set of the process in bytes
+inline size_t processMemory() {
+    PROCESS_MEMORY_COUNTERS counters = {};
+    counters.cb = sizeof(counters);
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+}
+
+// User plus kernel CPU time of the process in seconds
+inline double processCpuSeconds() {
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    auto ticks = [](const FILETIME& t) { return (uint64_t)t.dwHighDateTime << 32 | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e7; // 100 ns ticks
+}
+
+struct LoadGame {
+    unique_ptr<GameManager> game;
+    chrono::steady_clock::time_point due; // when its next key arrives
+    size_t scriptPos = 0;
+    uint64_t rng = 0;
+};
+
+// One step of the load test with `count` games; prints its row of the
+// table, or the error and false if a game's level could not be laid out
+bool runLoadStep(const GameConfig& config, const LoadPlan& plan, int count, unsigned baseSeed) {
+    typedef chrono::steady_clock Clock;
+    int threads = config.threads > 0 ? config.threads : max(1, (int)thread::hardware_concurrency());
+    threads = min(threads, count);
+    GameConfig gameConfig = config;
+    gameConfig.threads = 1; // the games are spread over the cores, each runs single-threaded
+
+    size_t memoryBefore = processMemory();
+    vector<LoadGame> games(count);
+    atomic<unsigned> nextSeed{ baseSeed + (unsigned)count };
+    for (int i = 0; i < count; i++) {
+        gameConfig.seed = baseSeed + i;
+        games[i].game.reset(new GameManager(gameConfig));
+        if (games[i].game->layoutFailed()) {
+            cout << games[i].game->layoutError() << endl;
+            return false;
+        }
+        games[i].scriptPos = plan.script.empty() ? 0 : (size_t)i * 7 % plan.script.size();
+        games[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+    size_t memoryGames = processMemory();
+
+    // Game i belongs to thread i % threads; its keys are spread evenly over
+    // the period so the thread never has to serve its games all at once
+    const Clock::duration period = plan.rate > 0 ? Clock::duration(chrono::nanoseconds(1000000000LL / plan.rate))
+                                                 : Clock::duration(0);
+    vector<vector<uint64_t>> latencies(threads); // nanoseconds from due to done, per turn
+    vector<long long> late(threads), restarts(threads);
+    mutex failureLock;
+    string failure; // the first layout error, which stops every worker
+    atomic<bool> failed{ false };
+    double cpuBefore = processCpuSeconds();
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::seconds(plan.seconds);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t] {
+            vector<LoadGame*> mine;
+            for (int i = t; i < count; i += threads) mine.push_back(&games[i]);
+            for (size_t k = 0; k < mine.size(); k++) mine[k]->due = start + period * (long long)k / (long long)mine.size();
+            latencies[t].reserve(plan.rate > 0 ? (size_t)plan.rate * plan.seconds * mine.size() + 16 : 1 << 16);
+            for (size_t k = 0; ; k = (k + 1) % mine.size()) {
+                LoadGame& load = *mine[k];
+                if (plan.rate > 0) {
+                    if (load.due >= end) break;
+                    if (Clock::now() < load.due) this_thread::sleep_until(load.due);
                 } else {
-                    addMessage("The door is locked. You need a key!");
+                    load.due = Clock::now();
+                    if (load.due >= end) break;
                 }
-                break;
-                
-            case STAIRS:
-                // Ask player if they want to go to the next level
-                draw();
-                cout << "\nDescend to the next level? (Y/N): ";
-                char choice = _getch();
-                if (tolower(choice) == 'y') {
-                    player.dungeonLevel++;
-                    initializeMap(player.dungeonLevel);
+                char key;
+                if (!plan.script.empty()) {
+                    key = plan.script[load.scriptPos];
+                    load.scriptPos = (load.scriptPos + 1) % plan.script.size();
                 } else {
-                    addMessage("You decide to stay on this level for now.");
+                    load.rng ^= load.rng << 13;
+                    load.rng ^= load.rng >> 7;
+                    load.rng ^= load.rng << 17;
+                    key = LOAD_KEYS[(load.rng >> 32) % (sizeof(LOAD_KEYS) - 1)];
                 }
-                break;
-        }
+                load.game->processInput(key);
+                Clock::time_point done = Clock::now();
+                latencies[t].push_back((uint64_t)chrono::duration_cast<chrono::nanoseconds>(done - load.due).count());
+                if (plan.rate > 0 && done >= load.due + period) late[t]++;
+                load.due += period;
+                if (load.game->isGameOver() && !load.game->layoutFailed()) {
+                    // A dead player's dungeon makes way for a new one; its first level is part of the load
+                    GameConfig again = gameConfig;
+                    again.seed = nextSeed.fetch_add(1);
+                    load.game.reset(new GameManager(again));
+                    restarts[t]++;
+                }
+                if (load.game->layoutFailed()) {
+                    lock_guard<mutex> guard(failureLock);
+                    if (!failed.exchange(true)) failure = load.game->layoutError();
+                }
+                if (failed.load(memory_order_relaxed)) break;
+            }
+        }));
+    }
+    for (auto& worker : workers) worker.join();
+    if (failed) {
+        cout << failure << endl;
+        return false;
+    }
+    double seconds = max(1e-9, chrono::duration<double>(Clock::now() - start).count());
+    double cpu = processCpuSeconds() - cpuBefore;
+    size_t memoryAfter = processMemory();
 
-        // Check if player died
-        if (player.health <= 0) {
-            gameOver = true;
-            system("cls");
-            setConsoleColor(RED);
-            cout << "\n\n";
-            cout << "  #####     #    #     # #######    ####### #     # ####### ######  \n";
-            cout << " #     #   # #   ##   ## #          #     # #     # #       #     # \n";
-            cout << " #        #   #  # # # # #          #     # #     # #       #     # \n";
-            cout << " #  #### #     # #  #  # #####      #     # #     # #####   ######  \n";
-            cout << " #     # ####### #     # #          #     #  #   #  #       #   #   \n";
-            cout << " #     # #     # #     # #          #     #   # #   #       #    #  \n";
-            cout << "  #####  #     # #     # #######    #######    #    ####### #     # \n";
-            cout << "\n\n";
-
-            resetConsoleColor();
-            cout << "You died on dungeon level " << player.dungeonLevel << "!\n";
-            cout << "Final score: " << player.score << endl;
-            cout << "Gold collected: " << player.gold << endl;
-            cout << "Player level: " << player.level << endl;
-            cout << "Enemies defeated: " << (player.score / 10) - (player.gold) - (100 * (player.dungeonLevel - 1)) << endl;
-            cout << "\nPress any key to exit...";
-            _getch();
-            return;
-        }
+    vector<uint64_t> all;
+    long long lateTurns = 0, restarted = 0;
+    size_t sampleBytes = 0; // the latencies themselves are no part of what a game costs
+    for (int t = 0; t < threads; t++) {
+        sampleBytes += latencies[t].capacity() * sizeof(uint64_t);
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        vector<uint64_t>().swap(latencies[t]);
+        lateTurns += late[t];
+        restarted += restarts[t];
+    }
+    games.clear();
+    if (all.empty()) return true;
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all[min(all.size() - 1, (size_t)(p * all.size()))] / 1e6; };
+    size_t gameMemory = max(memoryAfter, memoryGames) - min(memoryBefore, memoryGames);
+    double memoryPerGame = (double)(gameMemory - min(gameMemory, sampleBytes)) / count / 1024;
+    char row[256];
+    snprintf(row, sizeof(row), "%9d %10.0f %8.3f %8.3f %8.3f %8.3f %7.2f%% %9.1f %9.1f %8.2f%% %8lld",
+             count, all.size() / seconds, percentile(0.50), percentile(0.99), percentile(0.999),
+             all.back() / 1e6, 100.0 * lateTurns / all.size(), memoryAfter / 1048576.0, memoryPerGame,
+             100.0 * cpu / seconds / count, restarted);
+    cout << row << endl;
+    return true;
+}
 
-        // Enemy movement and combat
-        for (auto& enemy : enemies) {
-            // Reset attack flag at the start of each turn
-            enemy->hasAttacked = false;
+int runLoadTest(GameConfig config, const LoadPlan& plan) {
+    config.headless = true;
+    config.spectators = nullptr; // one screen can't show hundreds of games
+    config.recorder = nullptr;
+    unsigned baseSeed = config.seed ? config.seed : (unsigned)time(0);
+    int threads = config.threads > 0 ? config.threads : max(1, (int)thread::hardware_concurrency());
+    cout << "Load test: " << (plan.rate > 0 ? to_string(plan.rate) + " keys/s" : string("flat out"))
+         << " per game, " << plan.seconds << "s per step, " << threads << " threads, "
+         << (plan.script.empty() ? string("random keys") : "script \"" + plan.script + "\"") << endl;
+    cout << "    games    turns/s   p50 ms   p99 ms  p999 ms   max ms    late    RSS MB KB/game CPU/game restarts" << endl;
+    timeBeginPeriod(1); // millisecond sleep resolution while pacing keys
+    bool ok = true;
+    for (size_t i = 0; i < plan.instances.size() && ok; i++) {
+        if (plan.instances[i] > 0) ok = runLoadStep(config, plan, plan.instances[i], baseSeed);
+    }
+    timeEndPeriod(1);
+    return ok ? 0 : 1;
+}
+
+// Title screen with controls and the map legend
+void renderTitle(ScreenFrame& frame) {
+    frame.clear();
+    int row = frame.lines(2,
+        " ########  ##     ## ##    ##  ######   ########  #######  ##    ## \n"
+        " ##     ## ##     ## ###   ## ##    ##  ##       ##     ## ###   ## \n"
+        " ##     ## ##     ## ####  ## ##        ##       ##     ## ####  ## \n"
+        " ##     ## ##     ## ## ## ## ##   #### ######   ##     ## ## ## ## \n"
+        " ##     ## ##     ## ##  #### ##    ##  ##       ##     ## ##  #### \n"
+        " ##     ## ##     ## ##   ### ##    ##  ##       ##     ## ##   ### \n"
+        " ########   #######  ##    ##  ######   ########  #######  ##    ## \n"
+        "                         CRAWLER                                    \n", LIGHTCYAN);
+    
+    row = frame.lines(row + 2,
+        "Welcome to the Dungeon Crawler game!\n"
+        "Navigate the dangerous dungeons, defeat monsters, and collect treasures!\n"
+        "\nControls:\n"
+        "Move with WASD\n"
+        "Attack with SPACE\n"
+        "Throw a knife with F\n"
+        "Cast Fireball, Shockwave, or Poison Cloud with 1, 2, 3\n"
+        "Open inventory with I\n"
+        "Use health potion with H\n"
+        "Ask for a hint with ?\n"
+        "Rewind and replay turns with U and R (needs --rewind)\n"
+        "Light or douse your torch with L\n"
+        "Switch the map overview (1:4, 1:8, off) with M\n"
+        "Quit with Q\n", WHITE);
+    
+    static const struct { char symbol; Color color; const char* name; } legend[] = {
+        { PLAYER, YELLOW, "Player" }, { SLIME, GREEN, "Slime" }, { GOBLIN, LIGHTRED, "Goblin" },
+        { TROLL, RED, "Troll" }, { ARCHER, LIGHTMAGENTA, "Goblin Archer" }, { THROWER, BROWN, "Boulder Troll" },
+        { KEY, YELLOW, "Key" }, { DOOR, BROWN, "Door" }, { HEALTH, LIGHTGREEN, "Health Potion" },
+        { WEAPON, CYAN, "Weapon" }, { ARMOR, BLUE, "Armor" }, { TRAP, RED, "Trap" },
+        { GOLD, YELLOW, "Gold" }, { STAIRS, MAGENTA, "Stairs to next level" },
+    };
+    row = frame.line(row + 1, "Legend:", WHITE);
+    for (const auto& entry : legend) {
+        frame.line(row, string(1, entry.symbol) + " - " + entry.name, WHITE);
+        frame.put(row++, 0, entry.symbol, entry.color);
+    }
+    
+    frame.line(row + 1, "Press any key to start your adventure...", WHITE);
+}
 
-            // Only move if not adjacent to player
-            if (!enemy->isAdjacent(player.x, player.y)) {
-                enemy->move(player.x, player.y, map);
+int main(int argc, char* argv[]) {
+    GameConfig config;
+    if (const char* user = getenv("USERNAME")) {
+        config.playerName = user;
+    }
+    string scores, scoresFor; // leaderboard query to print instead of playing
+    string mineTo;            // seed index to write instead of playing
+    LoadPlan load;            // load test to run instead of playing, if it has instance counts
+    uint32_t mineCount = 0;
+    unique_ptr<TelemetryWriter> telemetry;
+    unique_ptr<SpectatorHub> spectators;
+    unique_ptr<SessionRecorder> recorder;
+    unique_ptr<MetricsExport> metrics;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            sscanf(argv[++i], "%dx%d", &config.mapWidth, &config.mapHeight);
+        } else if (arg == "--swarm" && i + 1 < argc) {
+            config.swarm = atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            config.threads = atoi(argv[++i]);
+        } else if (arg == "--verify-hash") {
+            config.verifyHash = true;
+        } else if (arg == "--autoplay" && i + 1 < argc) {
+            config.autoplay = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--level" && i + 1 < argc) {
+            config.startLevel = max(1, atoi(argv[++i]));
+        } else if (arg == "--rewind" && i + 1 < argc) {
+            config.rewind = atoi(argv[++i]);
+        } else if (arg == "--name" && i + 1 < argc) {
+            config.playerName = argv[++i];
+        } else if (arg == "--leaderboard" && i + 1 < argc) {
+            config.leaderboard = argv[++i];
+        } else if (arg == "--scores") {
+            scores = arg;
+        } else if ((arg == "--scores-depth" || arg == "--scores-player") && i + 1 < argc) {
+            scores = arg;
+            scoresFor = argv[++i];
+        } else if (arg == "--telemetry" && i + 1 < argc) {
+            telemetry.reset(new TelemetryWriter(argv[++i]));
+            config.telemetry = telemetry->ok() ? telemetry.get() : nullptr;
+        } else if (arg == "--spectate" && i + 1 < argc) {
+            spectators.reset(new SpectatorHub(atoi(argv[++i])));
+            config.spectators = spectators->ok() ? spectators.get() : nullptr;
+        } else if (arg == "--realtime" && i + 1 < argc) {
+            config.tickRate = max(0, min(atoi(argv[++i]), 1000));
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            if (!parseMemoryBudget(argv[++i], config.memoryBudget)) {
+                cout << "Ignoring memory budget " << argv[i] << "; use enemies=, items= or messages= and a size such as 512K" << endl;
             }
-            
-            // Check if enemy can attack player
-            if (enemy->isAdjacent(player.x, player.y) && !enemy->hasAttacked) {
-                int damage = enemy->attackPlayer(player);
-                addMessage("The " + enemy->name + " attacks you for " + to_string(damage) + " damage!");
+        } else if (arg == "--hibernate" && i + 1 < argc) {
+            config.hibernateAfter = max(0, atoi(argv[++i]));
+        } else if (arg == "--sound") {
+            config.sound = true;
+        } else if (arg == "--record" && i + 1 < argc) {
+            recorder.reset(new SessionRecorder(argv[++i]));
+            config.recorder = recorder->ok() ? recorder.get() : nullptr;
+        } else if (arg == "--export-metrics" && i + 1 < argc) {
+            metrics.reset(new MetricsExport(argv[++i]));
+            config.metrics = metrics->ok() ? metrics.get() : nullptr;
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            return watchMetrics(argv[++i]);
+        } else if (arg == "--load" && i + 1 < argc) {
+            stringstream counts(argv[++i]);
+            string count;
+            while (getline(counts, count, ',')) load.instances.push_back(atoi(count.c_str()));
+        } else if (arg == "--load-rate" && i + 1 < argc) {
+            load.rate = max(0, atoi(argv[++i]));
+        } else if (arg == "--load-seconds" && i + 1 < argc) {
+            load.seconds = max(1, atoi(argv[++i]));
+        } else if (arg == "--load-script" && i + 1 < argc) {
+            // Quitting and the inventory wait for a key, which a scripted game never sends
+            for (const char* key = argv[++i]; *key; key++) {
+                if (tolower(*key) != 'q' && tolower(*key) != 'i') load.script += *key;
             }
-        }
-        
-        // Regenerate small amount of health every few turns
-        if (turns % 10 == 0 && player.health < player.maxHealth) {
-            player.health = min(player.maxHealth, player.health + 1);
+        } else if (arg == "--mine-seeds" && i + 2 < argc) {
+            mineTo = argv[++i];
+            mineCount = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--find-seeds" && i + 1 < argc) {
+            return findSeeds(argv[i + 1], vector<string>(argv + i + 2, argv + argc));
+        } else if (arg == "--telemetry-summary" && i + 1 < argc) {
+            return summarizeTelemetry(argv[++i]);
+        } else if (arg == "--bot-iterations" && i + 1 < argc) {
+            config.botIterations = atoi(argv[++i]);
         }
     }
-
-    void run() {
-        while (!gameOver) {
-            draw();
-            
-            char input = _getch();
-            switch(tolower(input)) {
-                case 'w': player.move(0, -1, map); update(); break;
-                case 's': player.move(0, 1, map); update(); break;
-                case 'a': player.move(-1, 0, map); update(); break;
-                case 'd': player.move(1, 0, map); update(); break;
-                case ' ': playerAttack(); update(); break;
-                case 'i': showInventory(); break;
-                case 'h': useHealthPotion(); update(); break;
-                case 'q': 
-                    cout << "\nAre you sure you want to quit? (Y/N): ";
-                    char choice = _getch();
-                    if (tolower(choice) == 'y') {
-                        gameOver = true;
-                    }
-                    break;
-            }
+    
+    // Block headers and counters only for the runs that read them
+    bool accounted = config.metrics || any_of(begin(config.memoryBudget), end(config.memoryBudget),
+                                              [](int64_t budget) { return budget > 0; });
+    if (!scores.empty() || !mineTo.empty()) {
+        accounted = false;
+    } else if (load.instances.empty() && config.autoplay > 0) {
+        accounted = true; // for the memory report
+    }
+    setMemoryAccounting(accounted);
+    
+    if (!scores.empty()) {
+        Leaderboard board(config.leaderboard);
+        if (scores == "--scores-depth") {
+            printRuns(board.topAtDepth(atoi(scoresFor.c_str()), 10));
+        } else if (scores == "--scores-player") {
+            printRuns(board.topForPlayer(scoresFor, 10));
+        } else {
+            printRuns(board.top(10));
         }
+        return 0;
     }
-};
-
-int main() {
+    
+    if (!mineTo.empty()) {
+        return mineSeeds(config, mineTo, mineCount);
+    }
+    
+    if (!load.instances.empty()) {
+        return runLoadTest(config, load);
+    }
+    
+    if (config.autoplay > 0) {
+        return runAutoplay(config);
+    }
+    
     // Set console code page to support extended ASCII characters
     SetConsoleCP(437);
     SetConsoleOutputCP(437);
     
-    // Seed random number generator
-    srand(static_cast<unsigned>(time(0)));
-    
     // Show title screen
-    HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-    SetConsoleTextAttribute(consoleHandle, LIGHTCYAN);
-    cout << "\n\n";
-    cout << " ########  ##     ## ##    ##  ######   ########  #######  ##    ## \n";
-    cout << " ##     ## ##     ## ###   ## ##    ##  ##       ##     ## ###   ## \n";
-    cout << " ##     ## ##     ## ####  ## ##        ##       ##     ## ####  ## \n";
-    cout << " ##     ## ##     ## ## ## ## ##   #### ######   ##     ## ## ## ## \n";
-    cout << " ##     ## ##     ## ##  #### ##    ##  ##       ##     ## ##  #### \n";
-    cout << " ##     ## ##     ## ##   ### ##    ##  ##       ##     ## ##   ### \n";
-    cout << " ########   #######  ##    ##  ######   ########  #######  ##    ## \n";
-    cout << "                         CRAWLER                                    \n";
-    cout << "\n\n";
-    
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << "Welcome to the Dungeon Crawler game!" << endl;
-    cout << "Navigate the dangerous dungeons, defeat monsters, and collect treasures!" << endl;
-    cout << "\nControls:" << endl;
-    cout << "Move with WASD" << endl;
-    cout << "Attack with SPACE" << endl;
-    cout << "Open inventory with I" << endl;
-    cout << "Use health potion with H" << endl;
-    cout << "Quit with Q" << endl;
-    
-    cout << "\nLegend:" << endl;
-    SetConsoleTextAttribute(consoleHandle, YELLOW);
-    cout << "@";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Player" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, GREEN);
-    cout << "s";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Slime" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, LIGHTRED);
-    cout << "g";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Goblin" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, RED);
-    cout << "T";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Troll" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, YELLOW);
-    cout << "K";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Key" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, BROWN);
-    cout << "D";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Door" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, LIGHTGREEN);
-    cout << "+";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Health Potion" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, CYAN);
-    cout << "W";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Weapon" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, BLUE);
-    cout << "A";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Armor" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, RED);
-    cout << "^";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Trap" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, YELLOW);
-    cout << "$";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Gold" << endl;
-    
-    SetConsoleTextAttribute(consoleHandle, MAGENTA);
-    cout << ">";
-    SetConsoleTextAttribute(consoleHandle, WHITE);
-    cout << " - Stairs to next level" << endl;
-    
-    cout << "\nPress any key to start your adventure...";
+    ScreenFrame title;
+    renderTitle(title);
+    printFrame(title);
+    if (config.spectators) config.spectators->publish(title);
+    if (config.recorder) config.recorder->record(title);
     _getch();
     
-    GameManager game;
-    game.run();
+    GameManager game(config);
+    if (!game.layoutFailed()) game.run();
+    if (game.layoutFailed()) {
+        cout << game.layoutError() << endl;
+        return 1;
+    }
     
     return 0;
 }